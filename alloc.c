@@ -1,23 +1,31 @@
+/* For MAP_ANONYMOUS, which POSIX leaves out, under --std=c99. */
+#define _DEFAULT_SOURCE
 
 #include "datatype.h"
 
+/*
+A memory pool (arena) hands out objects of any size by bumping a
+pointer through large cells of memory obtained from the OS. There
+is no way to free an individual object: the whole pool is either
+reset, which keeps its first cell for reuse, or freed.
+
+The MemPool header itself lives at the start of the first cell.
+*/
+
 typedef struct MemPoolCell {
   struct MemPoolCell* prevCell;
-  Term firstObject[1];
+  size_t size; /* Total size of the cell, including this header. */
 } MemPoolCell;
 
 typedef struct MemPool {
   struct MemPoolCell* currentCell;
-  Term* nextAlloc;
-  unsigned freeSpace;
+  struct MemPoolCell* firstCell;
+  char* nextAlloc;
+  size_t freeSpace; /* Bytes left in the current cell. */
 } MemPool;
 
-typedef struct MemPoolAllocUnit {
-  MemPool pool;
-  MemPoolCell cell;
-} MemPoolAllocUnit;
-
-#define MEMPOOL_BLOCK_SIZE
+#define MEMPOOL_CELL_SIZE 0x10000 // 64 KB
+#define MEMPOOL_ALIGNMENT 8
 
 // FIXME: Don't use malloc/realloc at all.
 
@@ -39,31 +47,176 @@ void* Realloc(void* p, size_t size) {
   return p;
 }
 
+/* Starts at 1, so that an empty cache (version 0) is never valid. */
+unsigned envVersion = 1;
+
+/* Any new binding may shadow a cached one, so it invalidates
+   every global reference's cache. */
 Env* EnvBind(MemPool* pool, Env* env, Term* argNameSymbol, Term* value) {
-  Env* newEnv = (Env*)Alloc(sizeof(Env));
+  envVersion++;
+  Env* newEnv = (Env*)NewFromMemPool(pool, sizeof(Env));
   newEnv->next = env;
-  newEnv->nameText = argNameSymbol->value.string.text;
-  newEnv->nameLen = argNameSymbol->value.string.len;
+  newEnv->name = argNameSymbol;
   newEnv->value = value;
   return newEnv;
 }
 
+/* Objects are allocated from the pool if one is given. Pool
+   objects are static as far as the garbage collector is concerned.
+   Otherwise they're garbage collected, which is only possible
+   while the collector is active. The caller must initialize the
+   type. */
+static void* AllocObject(MemPool* pool, size_t size) {
+  if (!pool) {
+    assert(gcActive);
+    return GcAlloc(size);
+  }
+  GcObject* obj = (GcObject*)NewFromMemPool(pool, size);
+  obj->gcInfo.bits = 0;
+  return obj;
+}
+
+/* Terms are allocated with only as much of the value union as
+   their type uses. */
+size_t TermSize(DataType type) {
+  switch (type) {
+    case T_CONS:
+      return CONS_SIZE;
+    case T_STRING:
+    case T_SYMBOL:
+      return offsetof(Term, value) + sizeof(((Term*)0)->value.string);
+    case T_FUN_NATIVE:
+      return offsetof(Term, value) + sizeof(((Term*)0)->value.bif);
+    case T_LOCAL_REF:
+      return offsetof(Term, value) + sizeof(((Term*)0)->value.localRef);
+    case T_GLOBAL_REF:
+      return offsetof(Term, value) + sizeof(((Term*)0)->value.globalRef);
+    default:
+      return sizeof(Term);
+  }
+}
+
 Term* NewCons(MemPool* pool, Term* head, Term* tail) {
-  Term* newNode = (Term*)Alloc(sizeof(Term));
+  if (!pool && !GcHasRoom(CONS_SIZE)) {
+    /* A collection may move the head and tail. */
+    GC_ENTER();
+    GC_ROOT(head);
+    GC_ROOT(tail);
+    GcCollect();
+    GC_LEAVE();
+  }
+  Term* newNode = (Term*)AllocObject(pool, CONS_SIZE);
   newNode->type = T_CONS;
-  HEAD(newNode) = head;
-  TAIL(newNode) = tail;
+  newNode->cdrCode = CDR_NORMAL;
+  newNode->value.list.head = head;
+  newNode->value.list.tail = tail;
   return newNode;
 }
 
+/* Garbage collected runs are kept short, so that they are
+   allocated in the nursery like any other object. */
+#define GC_CDR_RUN_MAX 1024
+
+/* Allocate a run of count compact cons cells holding the elements.
+   If tail is given, the last cell is an ordinary cons cell that
+   points to it; otherwise the run ends the list. */
+static Term* NewListRun(MemPool* pool, Term** elements, int count, Term* tail) {
+  size_t size = (count - 1) * CDR_CELL_SIZE + (tail ? CONS_SIZE : CDR_CELL_SIZE);
+  if (!pool && !GcHasRoom(size)) {
+    GC_ENTER();
+    GC_ROOT(tail);
+    GcCollect();
+    GC_LEAVE();
+  }
+  char* run = (char*)AllocObject(pool, size);
+  for (int i = 0; i < count; i++) {
+    Term* cell = (Term*)(run + i * CDR_CELL_SIZE);
+    cell->type = T_CONS;
+    cell->gcInfo.bits = 0;
+    cell->value.list.head = elements[i];
+    if (i < count - 1) {
+      cell->cdrCode = CDR_NEXT;
+    } else if (tail) {
+      cell->cdrCode = CDR_NORMAL;
+      cell->value.list.tail = tail;
+    } else {
+      cell->cdrCode = CDR_NIL;
+    }
+  }
+  return (Term*)run;
+}
+
+/* Make a list of the elements as CDR-coded runs. If the list is
+   garbage collected, the elements must be reachable by the
+   collector (e.g. on a stack that it scans), since they may be
+   moved while the list is being allocated. */
+Term* NewList(MemPool* pool, Term** elements, int count) {
+  if (count == 0) {
+    return 0;
+  }
+  if (pool) {
+    return NewListRun(pool, elements, count, 0);
+  }
+  /* Build the runs from the back, so that each one can point
+     to the one after it. */
+  int runStart = (count - 1) / GC_CDR_RUN_MAX * GC_CDR_RUN_MAX;
+  Term* list = NewListRun(pool, elements + runStart, count - runStart, 0);
+  while (runStart > 0) {
+    runStart -= GC_CDR_RUN_MAX;
+    list = NewListRun(pool, elements + runStart, GC_CDR_RUN_MAX, list);
+  }
+  return list;
+}
+
 Term* NewAtom(MemPool* pool, DataType type) {
   assert(TYPE_IS_ATOM(type));
-  assert(!TYPE_IS_NIL(type));
-  Term* newAtom = (Term*)Alloc(sizeof(Term));
+  /* These are immediate values, never allocated. */
+  assert(!TYPE_IS_PRIM(type) && !TYPE_IS_NUMBER(type));
+  size_t size = TermSize(type);
+  if (!pool && !GcHasRoom(size)) {
+    GcCollect();
+  }
+  Term* newAtom = (Term*)AllocObject(pool, size);
   newAtom->type = type;
   return newAtom;
 }
 
+/* The slots are initialized to nil. If the frame is filled in
+   after anything else has been allocated, use the write barrier. */
+Frame* NewFrame(MemPool* pool, Frame* parent, int size) {
+  size_t frameSize =
+    sizeof(Frame) + (size > 0 ? size - 1 : 0) * sizeof(Term*);
+  if (!pool && !GcHasRoom(frameSize)) {
+    GC_ENTER();
+    GC_ROOT(parent);
+    GcCollect();
+    GC_LEAVE();
+  }
+  Frame* frame = (Frame*)AllocObject(pool, frameSize);
+  frame->type = T_FRAME;
+  frame->size = size;
+  frame->parent = parent;
+  for (int i = 0; i < size; i++) {
+    frame->slots[i] = 0;
+  }
+  if (!pool) {
+    GC_WRITE_BARRIER(frame, parent);
+  }
+  return frame;
+}
+
+BigNum* NewBigNum(MemPool* pool, int len) {
+  assert(len > 0);
+  size_t size = sizeof(BigNum) + (len - 1) * sizeof(uint32_t);
+  if (!pool && !GcHasRoom(size)) {
+    GcCollect();
+  }
+  BigNum* b = (BigNum*)AllocObject(pool, size);
+  b->type = T_BIGNUM;
+  b->len = len;
+  return b;
+}
+
 PageSize pageSize;
 void* memBase;
 size_t memSize;
@@ -80,7 +233,7 @@ static PageSize GetPageSize() {
 
 static void* ReserveMemory(size_t size) {
 #ifdef _WIN32
-  void* mem = VirtualAlloc(0, size, MEM_RESERVE, 0);
+  void* mem = VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
   int failure = (mem == 0);
 #else
   void* mem = mmap(0, size, PROT_READ | PROT_WRITE,
@@ -94,21 +247,187 @@ static void* ReserveMemory(size_t size) {
   return mem;
 }
 
+static size_t RoundUpTo(size_t size, size_t unit);
+
+/*
+Typed pages ("big bag of pages").
+
+The region reserved by MemInit is divided into TYPED_PAGE_SIZE
+pages, aligned to their size. Each page in use belongs to a class
+of objects of one type and one size, recorded in the page header,
+and is divided into slots of that size. A free slot is marked with
+GC_FREE and linked into its page's free list.
+
+Since every slot in a page is the same size, an object needs no
+header of its own for the allocator, and an old cons cell takes
+only CONS_SIZE bytes. The sweep finds the objects in a page by
+stepping through its slots.
+*/
+
+char* typedPagesStart;
+char* typedPagesEnd;
+
+typedef struct TypedClass {
+  TypedPage* pages;
+  TypedPage* available; /* Pages with a free slot. */
+} TypedClass;
+
+/* The types that can be allocated in typed pages. */
+static const DataType typedPageTypes[] = {
+  T_CONS, T_STRING, T_SYMBOL, T_BIGNUM, T_FUN_NATIVE, T_FUN_USER,
+  T_FUN_MACRO, T_FUN_COMPILED, T_LOCAL_REF, T_FRAME,
+};
+#define TYPED_TYPE_COUNT \
+  ((int)(sizeof(typedPageTypes) / sizeof(typedPageTypes[0])))
+#define TYPED_SIZE_COUNT (TYPED_MAX_OBJECT_SIZE / MEMPOOL_ALIGNMENT + 1)
+
+static TypedClass typedClasses[TYPED_TYPE_COUNT][TYPED_SIZE_COUNT];
+static char* typedPagesNext; /* Start of the never-used pages. */
+static TypedPage* freeTypedPages;
+
+static int TypedTypeIndex(DataType type) {
+  for (int i = 0; i < TYPED_TYPE_COUNT; i++) {
+    if (typedPageTypes[i] == type)
+      return i;
+  }
+  Die("No typed pages for type %04x.", type);
+}
+
+#ifdef _WIN32
+static void CommitPages(void* mem, size_t size) {
+  if (!VirtualAlloc(mem, size, MEM_COMMIT, PAGE_READWRITE)) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+}
+#endif
+
+/* Returns null when the region is used up. */
+static TypedPage* NewTypedPage(TypedClass* cls, DataType type, size_t size) {
+  TypedPage* page = freeTypedPages;
+  if (page) {
+    freeTypedPages = page->next;
+  } else {
+    if (typedPagesNext == typedPagesEnd)
+      return 0;
+    page = (TypedPage*)typedPagesNext;
+    typedPagesNext += TYPED_PAGE_SIZE;
+#ifdef _WIN32
+    CommitPages(page, TYPED_PAGE_SIZE);
+#endif
+  }
+  page->type = type;
+  page->objectSize = size;
+  page->liveCount = 0;
+  page->freeList = 0;
+  char* first = (char*)page + RoundUpTo(sizeof(TypedPage), MEMPOOL_ALIGNMENT);
+  page->slotCount = ((char*)page + TYPED_PAGE_SIZE - first) / size;
+  /* Link the slots so that they're handed out in address order. */
+  for (int i = page->slotCount - 1; i >= 0; i--) {
+    GcObject* slot = (GcObject*)(first + i * size);
+    slot->gcInfo.bits = GC_FREE;
+    slot->forward = page->freeList;
+    page->freeList = slot;
+  }
+  page->next = cls->pages;
+  cls->pages = page;
+  page->nextAvailable = cls->available;
+  cls->available = page;
+  return page;
+}
+
+/* Allocate an object in a page of its type. Returns null if it's
+   too big for a page or the pages have run out. The caller fills
+   in the header. */
+void* AllocTyped(DataType type, size_t size) {
+  size = RoundUpTo(size, MEMPOOL_ALIGNMENT);
+  if (size > TYPED_MAX_OBJECT_SIZE)
+    return 0;
+  TypedClass* cls =
+    &typedClasses[TypedTypeIndex(type)][size / MEMPOOL_ALIGNMENT];
+  TypedPage* page = cls->available;
+  if (!page) {
+    page = NewTypedPage(cls, type, size);
+    if (!page)
+      return 0;
+  }
+  GcObject* obj = page->freeList;
+  page->freeList = (GcObject*)obj->forward;
+  page->liveCount++;
+  if (!page->freeList) {
+    cls->available = page->nextAvailable;
+  }
+  obj->gcInfo.bits = 0;
+  return obj;
+}
+
+/* Free the unmarked objects in the typed pages and unmark the
+   rest. Pages left empty go back to be reused by any class.
+   Returns the number of bytes freed. */
+size_t SweepTypedPages() {
+  size_t bytesFreed = 0;
+  for (int t = 0; t < TYPED_TYPE_COUNT; t++) {
+    for (int s = 0; s < TYPED_SIZE_COUNT; s++) {
+      TypedClass* cls = &typedClasses[t][s];
+      TypedPage** link = &cls->pages;
+      cls->available = 0;
+      while (*link) {
+        TypedPage* page = *link;
+        char* first =
+          (char*)page + RoundUpTo(sizeof(TypedPage), MEMPOOL_ALIGNMENT);
+        for (int i = 0; i < page->slotCount; i++) {
+          GcObject* obj = (GcObject*)(first + i * page->objectSize);
+          if (obj->gcInfo.bits & GC_FREE)
+            continue;
+          assert(obj->type == page->type);
+          if (obj->gcInfo.bits & GC_MARKED) {
+            obj->gcInfo.bits &= ~GC_MARKED;
+          } else {
+            obj->gcInfo.bits = GC_FREE;
+            obj->forward = page->freeList;
+            page->freeList = obj;
+            page->liveCount--;
+            bytesFreed += page->objectSize;
+          }
+        }
+        if (page->liveCount == 0) {
+          *link = page->next;
+          page->next = freeTypedPages;
+          freeTypedPages = page;
+          continue;
+        }
+        if (page->freeList) {
+          page->nextAvailable = cls->available;
+          cls->available = page;
+        }
+        link = &page->next;
+      }
+    }
+  }
+  return bytesFreed;
+}
+
 void MemInit() {
   pageSize = GetPageSize();
   // memSize = 0x40000000; // 1 GB
-  memSize = 0x1000000; // 16 MB
-  memBase = ReserveMemory(memSize);
+  memSize = 0x10000000; // 256 MB
+  /* Reserve an extra page so that the typed pages can be aligned. */
+  memBase = ReserveMemory(memSize + TYPED_PAGE_SIZE);
+  typedPagesStart = (char*)RoundUpTo((size_t)memBase, TYPED_PAGE_SIZE);
+  typedPagesEnd = typedPagesStart + memSize;
+  typedPagesNext = typedPagesStart;
 }
 
-void* AllocPage() {
+/* Allocate memory directly from the OS. The size
+   is rounded up to a whole number of pages. */
+static void* AllocPages(size_t size) {
   void* mem;
   int failure;
 #ifdef _WIN32
-  mem = VirtualAlloc(0, pageSize, MEM_COMMIT | MEM_RESERVE, 0);
+  mem = VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
   failure = (mem == 0);
 #else
-  mem = mmap(0, pageSize, PROT_READ | PROT_WRITE,
+  mem = mmap(0, size, PROT_READ | PROT_WRITE,
              MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
   failure = (mem == MAP_FAILED);
 #endif
@@ -119,47 +438,101 @@ void* AllocPage() {
   return mem;
 }
 
+static void FreePages(void* mem, size_t size) {
+  int failure;
+#ifdef _WIN32
+  failure = !VirtualFree(mem, 0, MEM_RELEASE);
+#else
+  failure = (munmap(mem, size) != 0);
+#endif
+  if (failure) {
+    Die("Failed to free memory.");
+  }
+}
+
+static size_t RoundUpTo(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+static MemPoolCell* NewMemPoolCell(MemPoolCell* prevCell, size_t minSize) {
+  size_t size = RoundUpTo(minSize, pageSize);
+  if (size < MEMPOOL_CELL_SIZE)
+    size = MEMPOOL_CELL_SIZE;
+  MemPoolCell* cell = (MemPoolCell*)AllocPages(size);
+  cell->prevCell = prevCell;
+  cell->size = size;
+  return cell;
+}
+
+static void UseMemPoolCell(MemPool* pool, MemPoolCell* cell, char* start) {
+  pool->currentCell = cell;
+  pool->nextAlloc = start;
+  pool->freeSpace = (char*)cell + cell->size - start;
+}
+
+static char* FirstCellStart(MemPool* pool) {
+  return (char*)pool + RoundUpTo(sizeof(MemPool), MEMPOOL_ALIGNMENT);
+}
+
 MemPool* NewMemPool() {
-  MemPoolAllocUnit* allocUnit = AllocPage();
-  MemPool* pool = &allocUnit->pool;
-  pool->currentCell = &allocUnit->cell;
-  pool->currentCell->prevCell = 0;
-  Term* firstObject = allocUnit->cell.firstObject;
-  pool->nextAlloc = firstObject;
-  pool->freeSpace =
-    ((void*)allocUnit + pageSize - (void*)firstObject)
-      / sizeof(Term);
+  MemPoolCell* cell = NewMemPoolCell(0, MEMPOOL_CELL_SIZE);
+  MemPool* pool = (MemPool*)(cell + 1);
+  pool->firstCell = cell;
+  UseMemPoolCell(pool, cell, FirstCellStart(pool));
   return pool;
 }
 
-// TODO: Support different object sizes?
-Term* NewTermFromMemPool(MemPool* pool) {
-  if (pool->freeSpace == 0) {
-    MemPoolCell* newCell = AllocPage();
-    newCell->prevCell = pool->currentCell;
-    pool->nextAlloc = newCell->firstObject;
-    pool->freeSpace =
-      ((void*)newCell + pageSize - (void*)pool->nextAlloc)
-        / sizeof(Term);
-    pool->currentCell = newCell;
+/* Objects bigger than a cell get a cell of their own. */
+void* NewFromMemPool(MemPool* pool, size_t size) {
+  size = RoundUpTo(size, MEMPOOL_ALIGNMENT);
+  if (size > pool->freeSpace) {
+    MemPoolCell* cell =
+      NewMemPoolCell(pool->currentCell, sizeof(MemPoolCell) + size);
+    UseMemPoolCell(pool, cell, (char*)(cell + 1));
   }
-  Term* newTerm = pool->nextAlloc;
-  pool->nextAlloc++;
-  pool->freeSpace--;
-  return newTerm;
+  void* p = pool->nextAlloc;
+  pool->nextAlloc += size;
+  pool->freeSpace -= size;
+  return p;
 }
 
-void FreeMemPool(MemPool* pool) {
+Term* NewTermFromMemPool(MemPool* pool) {
+  return (Term*)NewFromMemPool(pool, sizeof(Term));
+}
+
+/* Free everything allocated from the pool, but keep the pool. */
+void ResetMemPool(MemPool* pool) {
   MemPoolCell* cell = pool->currentCell;
-  while (cell) {
+  while (cell != pool->firstCell) {
     MemPoolCell* prevCell = cell->prevCell;
-#ifdef _WIN32
-    // TODO: Check unmap failure.
-    VirtualFree(cell, pageSize, MEM_DECOMMIT);
-#else
-    munmap(cell, pageSize);
-#endif
+    FreePages(cell, cell->size);
     cell = prevCell;
   }
+  UseMemPoolCell(pool, pool->firstCell, FirstCellStart(pool));
 }
 
+void FreeMemPool(MemPool* pool) {
+  ResetMemPool(pool);
+  FreePages(pool->firstCell, pool->firstCell->size);
+}
+
+/* Move everything allocated from other into pool, so that it
+   lives as long as pool does. Other is freed along the way, and
+   pool continues allocating where other left off. */
+void AdoptMemPool(MemPool* pool, MemPool* other) {
+  other->firstCell->prevCell = pool->currentCell;
+  pool->currentCell = other->currentCell;
+  pool->nextAlloc = other->nextAlloc;
+  pool->freeSpace = other->freeSpace;
+}
+
+/* Whether p points into memory allocated from the pool. */
+int MemPoolContains(MemPool* pool, void* p) {
+  for (MemPoolCell* cell = pool->currentCell; cell; cell = cell->prevCell) {
+    if ((char*)p >= (char*)cell && (char*)p < (char*)cell + cell->size)
+      return 1;
+    if (cell == pool->firstCell)
+      break;
+  }
+  return 0;
+}
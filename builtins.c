@@ -6,29 +6,52 @@
 #include <assert.h>
 #include "datatype.h"
 
-// TODO: Intern symbols.
-Term* GetSymbol(const char* name) {
-  Term* sym = NewAtom(0, T_SYMBOL);
-  sym->value.string.text = name;
-  sym->value.string.len = strlen(name);
-  return sym;
-}
-
-Term* MakeString(const char* str) {
-  Term* s = NewAtom(0, T_STRING);
+Term* MakeString(MemPool* pool, const char* str) {
+  Term* s = NewAtom(pool, T_STRING);
   s->value.string.text = str;
   s->value.string.len = strlen(str);
   return s;
 }
 
 // Allocate a built-in function object.
-static Term* BIFun(const char* name, Term* (*funPtr)(struct Term*)) {
-  Term* bif = NewAtom(0, T_FUN_NATIVE);
+static Term* BIFun(MemPool* pool, const char* name, NativeFun funPtr) {
+  Term* bif = NewAtom(pool, T_FUN_NATIVE);
   bif->value.bif.funName = name;
   bif->value.bif.funPtr = funPtr;
+  bif->value.bif.arrayFunPtr = 0;
+  bif->value.bif.arity = ARITY_VARIADIC;
+  bif->value.bif.pure = 0;
+  return bif;
+}
+
+// Allocate a built-in function object that takes an argument array.
+static Term* BIArrayFun(MemPool* pool, const char* name, int arity, NativeArrayFun funPtr) {
+  Term* bif = NewAtom(pool, T_FUN_NATIVE);
+  bif->value.bif.funName = name;
+  bif->value.bif.funPtr = 0;
+  bif->value.bif.arrayFunPtr = funPtr;
+  bif->value.bif.arity = arity;
+  bif->value.bif.pure = 0;
   return bif;
 }
 
+// Allocate a built-in function object that the optimizer can fold.
+static Term* BIPureFun(MemPool* pool, const char* name, int arity, NativeArrayFun funPtr) {
+  Term* bif = BIArrayFun(pool, name, arity, funPtr);
+  bif->value.bif.pure = 1;
+  return bif;
+}
+
+/* Called before a builtin that takes an argument array, so that
+   the builtin itself can rely on the number of arguments. */
+void CheckNativeArity(Term* eFun, int argc) {
+  int arity = eFun->value.bif.arity;
+  if (arity != ARITY_VARIADIC && argc != arity) {
+    Die("%s takes %d argument%s.", eFun->value.bif.funName, arity,
+        arity == 1 ? "" : "s");
+  }
+}
+
 int ListLength(Term* list) {
   if (list && !IS_LIST(list))
     Die("Called ListLength on non-list.");
@@ -40,70 +63,387 @@ int ListLength(Term* list) {
   return len;
 }
 
-Term* ListHead(Term* args) {
-  assert(args);
-  Term* list = HEAD(args);
-  assert(list);
-  assert(IS_LIST(list));
+Term* ListHead(int argc, Term** argv, MemPool* pool) {
+  Term* list = argv[0];
+  if (!IS_CONS(list)) {
+    DieShowingTerm("head needs a non-empty list", list);
+  }
   return HEAD(list);
 }
 
-Term* ListTail(Term* args) {
-  assert(args);
-  Term* list = HEAD(args);
-  assert(list);
-  assert(IS_LIST(list));
+Term* ListTail(int argc, Term** argv, MemPool* pool) {
+  Term* list = argv[0];
+  if (!IS_CONS(list)) {
+    DieShowingTerm("tail needs a non-empty list", list);
+  }
   return TAIL(list);
 }
 
-Term* Display(Term* args) {
-  while (args) {
-    PrintTerm(stdout, HEAD(args));
-    args = TAIL(args);
+Term* Cons(int argc, Term** argv, MemPool* pool) {
+  return NewCons(pool, argv[0], argv[1]);
+}
+
+/* The arguments stay on their stack while the list is
+   allocated, so they're updated if the collector moves them. */
+Term* List(int argc, Term** argv, MemPool* pool) {
+  return NewList(pool, argv, argc);
+}
+
+Term* Display(int argc, Term** argv, MemPool* pool) {
+  for (int i = 0; i < argc; i++) {
+    PrintTerm(stdout, argv[i]);
   }
   return 0;
 }
 
+/* Immediate values and interned symbols are equal
+   exactly when they are the same word. */
+Term* Eq(int argc, Term** argv, MemPool* pool) {
+  return MAKE_BOOL(argv[0] == argv[1]);
+}
+
+/* Arithmetic. The operations themselves are in numbers.c. */
+
+typedef Term* (*NumberOp)(Term* a, Term* b, MemPool* pool);
+
+/* Combine the arguments from left to right, starting with
+   init. An operation that overflows allocates a bignum, which
+   may move the arguments (in place, in argv). */
+static Term* FoldNumbers(int argc, Term** argv, Term* init, NumberOp op, MemPool* pool) {
+  GC_ENTER();
+  GC_ROOT(init);
+  for (int i = 0; i < argc; i++) {
+    init = op(init, argv[i], pool);
+  }
+  GC_RETURN(Term*, init);
+}
+
+Term* Add(int argc, Term** argv, MemPool* pool) {
+  return FoldNumbers(argc, argv, MAKE_FIXNUM(0), NumberAdd, pool);
+}
+
+Term* Subtract(int argc, Term** argv, MemPool* pool) {
+  if (argc == 0) {
+    Die("- needs at least one argument.");
+  }
+  if (argc == 1) {
+    return NumberSubtract(MAKE_FIXNUM(0), argv[0], pool);
+  }
+  return FoldNumbers(argc - 1, argv + 1, argv[0], NumberSubtract, pool);
+}
+
+Term* Multiply(int argc, Term** argv, MemPool* pool) {
+  return FoldNumbers(argc, argv, MAKE_FIXNUM(1), NumberMultiply, pool);
+}
+
+static Term* SecondArg(Term* args, const char* name) {
+  if (ListLength(args) != 2) {
+    Die("%s takes two arguments.", name);
+  }
+  return HEAD(TAIL(args));
+}
+
+Term* Quotient(int argc, Term** argv, MemPool* pool) {
+  return NumberQuotient(argv[0], argv[1], pool);
+}
+
+Term* Remainder(int argc, Term** argv, MemPool* pool) {
+  return NumberRemainder(argv[0], argv[1], pool);
+}
+
+/* True if every argument is less than the next one. */
+Term* LessThan(int argc, Term** argv, MemPool* pool) {
+  for (int i = 0; i + 1 < argc; i++) {
+    if (NumberCompare(argv[i], argv[i + 1]) >= 0)
+      return TERM_FALSE;
+  }
+  return TERM_TRUE;
+}
+
+/* True if all the arguments are the same number. */
+Term* NumberEqual(int argc, Term** argv, MemPool* pool) {
+  for (int i = 0; i + 1 < argc; i++) {
+    if (NumberCompare(argv[i], argv[i + 1]) != 0)
+      return TERM_FALSE;
+  }
+  return TERM_TRUE;
+}
+
 /* ListMap (aka mapcar) */
-Term* ListMap(Term* args) {
-  assert(IS_CONS(args));
-  term* fun = HEAD(args);
-  term* argsTail1 = TAIL(args);
-  assert(IS_FUN(fun));
-  assert(IS_CONS(argsTail1));
-  term* list = HEAD(argsTail1);
-  assert(IS_LIST(list));
-  assert(IS_NIL(TAIL(argsTail1)));
-  // Shortcut when the list argument is empty.
-  if (IS_NIL(list)) {
-    return 0;
-  }
-  // TODO: Should call a function call function,
-  // but first I need to write one.
+Term* ListMap(Term* args, MemPool* pool) {
+  Term* list = SecondArg(args, "map");
+  Term* fun = HEAD(args);
+  if (!IS_FUN(fun)) {
+    DieShowingTerm("map needs a function", fun);
+  }
+  if (!IS_LIST(list)) {
+    DieShowingTerm("map needs a list", list);
+  }
   Term* mapHead = 0;
   Term* mapLast = 0;
+  GC_ENTER();
+  GC_ROOT(fun);
+  GC_ROOT(list);
+  GC_ROOT(mapHead);
+  GC_ROOT(mapLast);
+  for (; list; list = TAIL(list)) {
+    Term* eArgs = NewCons(pool, HEAD(list), 0);
+    Term* cell = NewCons(pool, Apply(fun, eArgs, pool), 0);
+    if (mapLast) {
+      SET_TAIL(mapLast, cell);
+    } else {
+      mapHead = cell;
+    }
+    mapLast = cell;
+  }
+  GC_RETURN(Term*, mapHead);
+}
+
+/*
+Parallel map. The list is cut into slices, one per processor,
+which are mapped at the same time (see RunParallel). The results
+are put back together in order.
+
+The workers can't use the garbage collector, so each one evaluates
+into a pool of its own, and copies each result into a results pool
+before resetting its scratch pool for the next element. Afterwards,
+in arena mode the results pools are simply handed over to the
+caller's pool. Otherwise the results are copied into collected
+objects and the pools are freed.
+
+Results from the workers can point to collected objects, which
+must not move while the workers run or while the results are
+being copied. So before the workers start, a collection promotes
+everything they can reach to the old generation, where objects
+never move. Everything they can reach stays reachable from the
+function and the list, which are rooted until the end.
+
+Short lists aren't worth the trouble, and are mapped in order.
+*/
+
+#define PMAP_MIN_LENGTH 16
+
+typedef struct MapSlice {
+  Term* fun;
+  Term** elements; /* Replaced by the results. */
+  int count;
+  MemPool* results;
+} MapSlice;
+
+/* Copy the parts of an object that were allocated from the pool
+   "from" into the pool "to", or into collected objects if "to" is
+   null, so that "from" can be freed. The copy shares whatever lies
+   outside "from". */
+static void* CopyOutOfPool(void* object, MemPool* from, MemPool* to) {
+  GcObject* obj = (GcObject*)object;
+  if (!IS_BOXED(obj) || !MemPoolContains(from, obj)) {
+    return obj;
+  }
+  GC_ENTER();
+  switch (obj->type) {
+    case T_CONS: {
+      Term* src = (Term*)obj;
+      Term* copyHead = 0;
+      Term* copyLast = 0;
+      GC_ROOT(copyHead);
+      GC_ROOT(copyLast);
+      for (; IS_CONS(src) && MemPoolContains(from, src); src = TAIL(src)) {
+        Term* cell = NewCons(to, CopyOutOfPool(HEAD(src), from, to), 0);
+        if (copyLast) {
+          SET_TAIL(copyLast, cell);
+        } else {
+          copyHead = cell;
+        }
+        copyLast = cell;
+      }
+      SET_TAIL(copyLast, CopyOutOfPool(src, from, to));
+      GC_RETURN(void*, copyHead);
+    }
+    case T_BIGNUM: {
+      BigNum* src = (BigNum*)obj;
+      BigNum* copy = NewBigNum(to, src->len);
+      copy->negative = src->negative;
+      memcpy(copy->limbs, src->limbs, src->len * sizeof(uint32_t));
+      GC_RETURN(void*, copy);
+    }
+    case T_FRAME: {
+      Frame* src = (Frame*)obj;
+      Frame* copy = NewFrame(to, CopyOutOfPool(src->parent, from, to), src->size);
+      GC_ROOT(copy);
+      for (int i = 0; i < src->size; i++) {
+        Term* slot = CopyOutOfPool(src->slots[i], from, to);
+        copy->slots[i] = slot;
+        GC_WRITE_BARRIER(copy, slot);
+      }
+      GC_RETURN(void*, copy);
+    }
+    case T_FUN_USER:
+    case T_FUN_MACRO: {
+      Term* src = (Term*)obj;
+      Frame* frame = CopyOutOfPool(src->value.udf.funFrame, from, to);
+      GC_ROOT(frame);
+      Term* copy = NewAtom(to, src->type);
+      copy->value.udf = src->value.udf;
+      copy->value.udf.funFrame = frame;
+      GC_RETURN(void*, copy);
+    }
+    case T_FUN_COMPILED: {
+      Term* src = (Term*)obj;
+      Frame* frame = CopyOutOfPool(src->value.compiled.funFrame, from, to);
+      GC_ROOT(frame);
+      Term* copy = NewAtom(to, src->type);
+      copy->value.compiled = src->value.compiled;
+      copy->value.compiled.funFrame = frame;
+      GC_RETURN(void*, copy);
+    }
+    default: {
+      /* Nothing else points to anything. */
+      Term* src = (Term*)obj;
+      Term* copy = NewAtom(to, src->type);
+      memcpy(&copy->value, &src->value, TermSize(src->type) - offsetof(Term, value));
+      GC_RETURN(void*, copy);
+    }
+  }
+}
+
+static void MapSliceTask(void* arg) {
+  MapSlice* slice = (MapSlice*)arg;
+  MemPool* scratch = NewMemPool();
+  slice->results = NewMemPool();
+  for (int i = 0; i < slice->count; i++) {
+    Term* eArgs = NewCons(scratch, slice->elements[i], 0);
+    Term* eResult = Apply(slice->fun, eArgs, scratch);
+    slice->elements[i] = CopyOutOfPool(eResult, scratch, slice->results);
+    ResetMemPool(scratch);
+  }
+  FreeMemPool(scratch);
+}
+
+Term* ParallelMap(Term* args, MemPool* pool) {
+  Term* list = SecondArg(args, "pmap");
+  Term* fun = HEAD(args);
+  if (!IS_FUN(fun)) {
+    DieShowingTerm("pmap needs a function", fun);
+  }
+  if (!IS_LIST(list)) {
+    DieShowingTerm("pmap needs a list", list);
+  }
+  int count = ListLength(list);
+  int sliceCount = ProcessorCount();
+  if (count < PMAP_MIN_LENGTH || sliceCount < 2) {
+    return ListMap(args, pool);
+  }
+  GC_ENTER();
+  GC_ROOT(fun);
+  GC_ROOT(list);
+  if (!pool) {
+    GcCollect();
+  }
+  Term** elements = (Term**)Alloc(count * sizeof(Term*));
+  int i = 0;
+  for (Term* node = list; node; node = TAIL(node)) {
+    elements[i++] = HEAD(node);
+  }
+  MapSlice* slices = (MapSlice*)Alloc(sliceCount * sizeof(MapSlice));
+  void** sliceArgs = (void**)Alloc(sliceCount * sizeof(void*));
+  for (int s = 0; s < sliceCount; s++) {
+    int start = (int)((long long)count * s / sliceCount);
+    int end = (int)((long long)count * (s + 1) / sliceCount);
+    slices[s].fun = fun;
+    slices[s].elements = elements + start;
+    slices[s].count = end - start;
+    sliceArgs[s] = &slices[s];
+  }
+  RunParallel(MapSliceTask, sliceArgs, sliceCount);
+  Term* mapHead = 0;
+  if (pool) {
+    for (int s = 0; s < sliceCount; s++) {
+      AdoptMemPool(pool, slices[s].results);
+    }
+    mapHead = NewList(pool, elements, count);
+  } else {
+    Term* mapLast = 0;
+    GC_ROOT(mapHead);
+    GC_ROOT(mapLast);
+    for (int s = 0; s < sliceCount; s++) {
+      for (int j = 0; j < slices[s].count; j++) {
+        Term* result = CopyOutOfPool(slices[s].elements[j], slices[s].results, 0);
+        Term* cell = NewCons(0, result, 0);
+        if (mapLast) {
+          SET_TAIL(mapLast, cell);
+        } else {
+          mapHead = cell;
+        }
+        mapLast = cell;
+      }
+      FreeMemPool(slices[s].results);
+    }
+  }
+  free(sliceArgs);
+  free(slices);
+  free(elements);
+  GC_RETURN(Term*, mapHead);
+}
+
+/* Every native function, so that an image (see image.c) can
+   refer to one by its index. */
+static void* nativeFunctions[] = {
+  ListHead, ListTail, Cons, List, Display, Eq, Add, Subtract,
+  Multiply, Quotient, Remainder, LessThan, NumberEqual, ListMap,
+  ParallelMap,
+};
+
+int NativeFunctionCount() {
+  return sizeof(nativeFunctions) / sizeof(nativeFunctions[0]);
+}
+
+int NativeFunctionIndex(void* fun) {
+  for (int i = 0; i < NativeFunctionCount(); i++) {
+    if (nativeFunctions[i] == fun)
+      return i;
+  }
+  Die("Native function missing from the table.");
+}
+
+void* NativeFunctionAt(int index) {
+  assert(index >= 0 && index < NativeFunctionCount());
+  return nativeFunctions[index];
 }
 
 Env* BuiltinEnvironment(MemPool* pool) {
   Env* env = 0;
   /* Primitives */
   env = EnvBind(pool, env, GetSymbol("nil"), 0);
-  env = EnvBind(pool, env, GetSymbol("fun"), NewAtom(0, T_PRIM_FUN));
-  env = EnvBind(pool, env, GetSymbol("begin"), NewAtom(0, T_PRIM_BEGIN));
-  env = EnvBind(pool, env, GetSymbol("quote"), NewAtom(0, T_PRIM_QUOTE));
-  env = EnvBind(pool, env, GetSymbol("head"), BIFun("head", ListHead));
-  env = EnvBind(pool, env, GetSymbol("tail"), BIFun("tail", ListTail));
+  env = EnvBind(pool, env, GetSymbol("fun"), TERM_PRIM_FUN);
+  env = EnvBind(pool, env, GetSymbol("begin"), TERM_PRIM_BEGIN);
+  env = EnvBind(pool, env, GetSymbol("quote"), TERM_PRIM_QUOTE);
+  env = EnvBind(pool, env, GetSymbol("defmacro"), TERM_PRIM_DEFMACRO);
+  env = EnvBind(pool, env, GetSymbol("true"), TERM_TRUE);
+  env = EnvBind(pool, env, GetSymbol("false"), TERM_FALSE);
+  env = EnvBind(pool, env, GetSymbol("eq?"), BIPureFun(pool, "eq?", 2, Eq));
+  env = EnvBind(pool, env, GetSymbol("head"), BIArrayFun(pool, "head", 1, ListHead));
+  env = EnvBind(pool, env, GetSymbol("tail"), BIArrayFun(pool, "tail", 1, ListTail));
+  env = EnvBind(pool, env, GetSymbol("cons"), BIArrayFun(pool, "cons", 2, Cons));
+  env = EnvBind(pool, env, GetSymbol("list"), BIArrayFun(pool, "list", ARITY_VARIADIC, List));
+  env = EnvBind(pool, env, GetSymbol("map"), BIFun(pool, "map", ListMap));
+  env = EnvBind(pool, env, GetSymbol("pmap"), BIFun(pool, "pmap", ParallelMap));
+  /* Arithmetic */
+  env = EnvBind(pool, env, GetSymbol("+"), BIPureFun(pool, "+", ARITY_VARIADIC, Add));
+  env = EnvBind(pool, env, GetSymbol("-"), BIPureFun(pool, "-", ARITY_VARIADIC, Subtract));
+  env = EnvBind(pool, env, GetSymbol("*"), BIPureFun(pool, "*", ARITY_VARIADIC, Multiply));
+  env = EnvBind(pool, env, GetSymbol("quotient"), BIArrayFun(pool, "quotient", 2, Quotient));
+  env = EnvBind(pool, env, GetSymbol("remainder"), BIArrayFun(pool, "remainder", 2, Remainder));
+  env = EnvBind(pool, env, GetSymbol("<"), BIPureFun(pool, "<", ARITY_VARIADIC, LessThan));
+  env = EnvBind(pool, env, GetSymbol("="), BIPureFun(pool, "=", ARITY_VARIADIC, NumberEqual));
   /* I/O */
-  env = EnvBind(pool, env, GetSymbol("display"), BIFun("display", Display));
-  env = EnvBind(pool, env, GetSymbol("newline"), MakeString("\n"));
+  env = EnvBind(pool, env, GetSymbol("display"), BIArrayFun(pool, "display", ARITY_VARIADIC, Display));
+  env = EnvBind(pool, env, GetSymbol("newline"), MakeString(pool, "\n"));
   return env;
 }
 
 /*
 TODO:
 atom?
-eq?
-cons
 cond
 read input
 */
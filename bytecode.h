@@ -0,0 +1,93 @@
+
+#include <stdint.h>
+
+/*
+Bytecode instructions. Each instruction is a one-byte opcode
+followed by its operands, which are 16-bit little-endian
+unsigned integers.
+*/
+typedef enum {
+  OP_CONST = 0, /* k:       push constants[k] */
+  OP_LOCAL,     /* s:       push slot s of the current frame */
+  OP_CAPTURED,  /* s:       push captured variable s of the closure */
+  OP_GLOBAL,    /* k:       push value of global symbol constants[k] */
+  OP_CALL,      /* n:       call function below n arguments */
+  OP_TAILCALL,  /* n:       call, reusing the caller's call record */
+  OP_POP,       /*          discard top of stack */
+  OP_CLOSURE,   /* k:       pop the variables children[k] captures, push closure */
+  OP_RETURN,    /*          return top of stack to caller */
+  OP_COUNT      // dummy value used to count the number of opcodes
+} OpCode;
+
+/* The compiled form of one function (or of the top-level
+   program, which is compiled as a function of no arguments). */
+typedef struct Chunk {
+  uint8_t* code;
+  int codeLen;
+  int codeCapacity;
+  Term** constants;
+  int constantCount;
+  int constantCapacity;
+  struct Chunk** children; /* Functions defined within this one. */
+  int childCount;
+  int childCapacity;
+  int arity;
+  int captureCount; /* Values popped by OP_CLOSURE for this function. */
+  int stackDepth;    /* Stack depth at the end of the code so far. */
+  int maxStackDepth; /* Stack slots needed to run the code. */
+  /* The source of the function, so that closures made by the
+     VM can also be run by the tree walker. */
+  Term* funArgs;
+  Term* funBody;
+  /* Native code for the function, once it has been called often
+     enough to be worth compiling (see jit.c). */
+  unsigned callCount;
+  void* jitCode; /* The entry stub, a JitEntry. */
+  void* jitBody; /* Where the code for the first instruction starts. */
+  size_t jitSize;
+} Chunk;
+
+typedef struct CallInfo {
+  /* State of the caller, restored on return. */
+  struct Chunk* chunk;
+  const uint8_t* ip;
+  void* resume; /* Where to go on in the caller's native code, if any. */
+  Frame* frame;
+  /* Where the callee sat on the stack. Its result goes here. */
+  Term** base;
+} CallInfo;
+
+/* The VM's registers, where the collector (and native code) can
+   get at them. */
+typedef struct VmState {
+  Term** stack;
+  Term** sp;
+  CallInfo* calls;
+  int callDepth;
+  Frame* frame;
+  Env* env;
+  MemPool* pool;
+  /* Set by native code that leaves the VM to make a call. */
+  void* resume;
+  int callArgs;
+} VmState;
+
+/* How native code hands control back to the VM. */
+typedef enum {
+  JIT_RETURN,   /* Return the top of the stack. */
+  JIT_CALL,     /* Call with vm->callArgs arguments, then go on at vm->resume. */
+  JIT_TAILCALL, /* Call with vm->callArgs arguments, in place of this call. */
+} JitStatus;
+
+/* Run a compiled function's native code from the given address,
+   with the VM's registers in the state. */
+typedef JitStatus (*JitEntry)(VmState* vm, void* address);
+
+Chunk* Compile(Term* iProgram, Env* env);
+void FreeChunk(Chunk* chunk);
+Term* VmRun(Chunk* chunk, Env* env, MemPool* pool);
+Term* CallNative(Term* eFun, Term** args, int nArgs, MemPool* pool);
+Term** VmClosure(VmState* vm, Term** sp, Chunk* child);
+void PrintChunk(FILE* f, Chunk* chunk);
+void JitCompile(Chunk* chunk, Env* env);
+void JitFree(Chunk* chunk);
@@ -0,0 +1,295 @@
+/*
+The compiler turns a resolved program (see resolve.c) into
+bytecode for the VM in vm.c.
+
+Special forms are recognized by looking up the head symbol
+of each form in the global environment at compile time, the
+same way the resolver does. This means that, unlike in the
+tree walker, a primitive like quote that reaches the head of
+a form through a variable is a run-time error in the VM.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "datatype.h"
+#include "bytecode.h"
+
+/* Throughout this file, the "tail" argument is true when the
+   code being compiled is in tail position, i.e. its value is
+   the return value of the enclosing function. Calls in tail
+   position are compiled to OP_TAILCALL. */
+
+static void CompileTerm(Chunk* chunk, Term* iTerm, Env* env, int tail);
+static void CompileSequence(Chunk* chunk, Term* iList, Env* env, int tail);
+
+static Chunk* NewChunk(int arity, Term* funArgs, Term* funBody) {
+  Chunk* chunk = (Chunk*)Alloc(sizeof(Chunk));
+  memset(chunk, 0, sizeof(Chunk));
+  chunk->arity = arity;
+  chunk->funArgs = funArgs;
+  chunk->funBody = funBody;
+  return chunk;
+}
+
+static void EmitByte(Chunk* chunk, uint8_t b) {
+  if (chunk->codeLen == chunk->codeCapacity) {
+    chunk->codeCapacity = chunk->codeCapacity ? chunk->codeCapacity * 2 : 64;
+    chunk->code = (uint8_t*)Realloc(chunk->code, chunk->codeCapacity);
+  }
+  chunk->code[chunk->codeLen++] = b;
+}
+
+static void EmitOperand(Chunk* chunk, int operand) {
+  if (operand < 0 || operand > 0xFFFF) {
+    Die("Bytecode operand out of range: %d", operand);
+  }
+  EmitByte(chunk, operand & 0xFF);
+  EmitByte(chunk, operand >> 8);
+}
+
+static int AddConstant(Chunk* chunk, Term* constant) {
+  if (chunk->constantCount == chunk->constantCapacity) {
+    chunk->constantCapacity =
+      chunk->constantCapacity ? chunk->constantCapacity * 2 : 16;
+    chunk->constants = (Term**)Realloc(chunk->constants,
+        chunk->constantCapacity * sizeof(Term*));
+  }
+  chunk->constants[chunk->constantCount] = constant;
+  return chunk->constantCount++;
+}
+
+static int AddChild(Chunk* chunk, Chunk* child) {
+  if (chunk->childCount == chunk->childCapacity) {
+    chunk->childCapacity = chunk->childCapacity ? chunk->childCapacity * 2 : 4;
+    chunk->children = (Chunk**)Realloc(chunk->children,
+        chunk->childCapacity * sizeof(Chunk*));
+  }
+  chunk->children[chunk->childCount] = child;
+  return chunk->childCount++;
+}
+
+/* Track how many stack slots the code will need, so that
+   the VM can check for stack overflow once per call. */
+static void AdjustStackDepth(Chunk* chunk, int delta) {
+  chunk->stackDepth += delta;
+  if (chunk->stackDepth > chunk->maxStackDepth)
+    chunk->maxStackDepth = chunk->stackDepth;
+}
+
+static void EmitConstant(Chunk* chunk, Term* constant) {
+  AdjustStackDepth(chunk, 1);
+  EmitByte(chunk, OP_CONST);
+  EmitOperand(chunk, AddConstant(chunk, constant));
+}
+
+static void CompileFunctionBody(Chunk* chunk, Term* funBody, Env* env) {
+  CompileSequence(chunk, funBody, env, 1);
+  EmitByte(chunk, OP_RETURN);
+}
+
+/* A function definition that the resolver has analyzed. The
+   values of the variables it captures are pushed for OP_CLOSURE
+   to put in the closure. */
+static void CompileFunDef(Chunk* chunk, Term* iFunDef, Env* env) {
+  Term* funArgs = iFunDef->value.funDef.funArgs;
+  Term* funBody = iFunDef->value.funDef.funBody;
+  Chunk* child = NewChunk(ListLength(funArgs), funArgs, funBody);
+  child->captureCount = iFunDef->value.funDef.captureCount;
+  CompileFunctionBody(child, funBody, env);
+  for (Term* iCapture = iFunDef->value.funDef.captures; iCapture;
+       iCapture = TAIL(iCapture)) {
+    CompileTerm(chunk, HEAD(iCapture), env, 0);
+  }
+  AdjustStackDepth(chunk, 1 - child->captureCount);
+  EmitByte(chunk, OP_CLOSURE);
+  EmitOperand(chunk, AddChild(chunk, child));
+}
+
+/* The form is (fun name (args...) body...), and wasn't resolved
+   as a function definition, so the closure captures nothing. */
+static void CompileFunctionDef(Chunk* chunk, Term* iFunDef, Env* env) {
+  if (!iFunDef) {
+    Die("Empty function definition.");
+  }
+  Term* funArgsAndBody = TAIL(iFunDef);
+  if (!funArgsAndBody) {
+    Die("Function arguments and body missing.");
+  }
+  Term* funArgDecls = HEAD(funArgsAndBody);
+  if (!IS_LIST(funArgDecls)) {
+    Die("Function argument declarations must be a list.");
+  }
+  for (Term* decl = funArgDecls; decl; decl = TAIL(decl)) {
+    if (!IS_SYMBOL(HEAD(decl))) {
+      Die("Function argument declarations must be symbols.");
+    }
+  }
+  Term* funBody = TAIL(funArgsAndBody);
+  if (!funBody) {
+    Die("Function body missing.");
+  }
+  Chunk* child = NewChunk(ListLength(funArgDecls), funArgDecls, funBody);
+  CompileFunctionBody(child, funBody, env);
+  AdjustStackDepth(chunk, 1);
+  EmitByte(chunk, OP_CLOSURE);
+  EmitOperand(chunk, AddChild(chunk, child));
+}
+
+static void CompileQuote(Chunk* chunk, Term* iForm) {
+  if (!iForm) {
+    Die("Empty quote form.");
+  }
+  if (TAIL(iForm)) {
+    Die("Quote must have only one argument.");
+  }
+  EmitConstant(chunk, HEAD(iForm));
+}
+
+/* Compile a list of terms so that only the value
+   of the last one is left on the stack. */
+static void CompileSequence(Chunk* chunk, Term* iList, Env* env, int tail) {
+  if (!iList) {
+    EmitConstant(chunk, 0);
+    return;
+  }
+  for (;;) {
+    Term* iTerm = HEAD(iList);
+    iList = TAIL(iList);
+    CompileTerm(chunk, iTerm, env, tail && !iList);
+    if (!iList)
+      break;
+    AdjustStackDepth(chunk, -1);
+    EmitByte(chunk, OP_POP);
+  }
+}
+
+static void CompileCall(Chunk* chunk, Term* iForm, Env* env, int tail) {
+  int nArgs = 0;
+  CompileTerm(chunk, HEAD(iForm), env, 0);
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    CompileTerm(chunk, HEAD(iArg), env, 0);
+    nArgs++;
+  }
+  AdjustStackDepth(chunk, -nArgs);
+  EmitByte(chunk, tail ? OP_TAILCALL : OP_CALL);
+  EmitOperand(chunk, nArgs);
+}
+
+static void CompileForm(Chunk* chunk, Term* iForm, Env* env, int tail) {
+  Term* iHead = HEAD(iForm);
+  if (IS_SYMBOL(iHead)) {
+    Term* eHead = EnvLookup(env, iHead);
+    if (eHead && eHead != ENV_LOOKUP_FAILED) {
+      switch (TYPE_OF(eHead)) {
+        case T_PRIM_QUOTE:
+          CompileQuote(chunk, TAIL(iForm));
+          return;
+        case T_PRIM_BEGIN:
+          CompileSequence(chunk, TAIL(iForm), env, tail);
+          return;
+        case T_PRIM_FUN:
+          CompileFunctionDef(chunk, TAIL(iForm), env);
+          return;
+        default:
+          break;
+      }
+    }
+  }
+  CompileCall(chunk, iForm, env, tail);
+}
+
+static void CompileTerm(Chunk* chunk, Term* iTerm, Env* env, int tail) {
+  if (!iTerm) {
+    EmitConstant(chunk, 0);
+    return;
+  }
+  switch (TYPE_OF(iTerm)) {
+    case T_CONS:
+      CompileForm(chunk, iTerm, env, tail);
+      return;
+    case T_STRING:
+    case T_NUMBER:
+    case T_BIGNUM:
+      EmitConstant(chunk, iTerm);
+      return;
+    case T_SYMBOL:
+    case T_GLOBAL_REF:
+      AdjustStackDepth(chunk, 1);
+      EmitByte(chunk, OP_GLOBAL);
+      EmitOperand(chunk, AddConstant(chunk, iTerm));
+      return;
+    case T_LOCAL_REF:
+      AdjustStackDepth(chunk, 1);
+      EmitByte(chunk, iTerm->value.localRef.captured ? OP_CAPTURED : OP_LOCAL);
+      EmitOperand(chunk, iTerm->value.localRef.slot);
+      return;
+    case T_FUN_DEF:
+      CompileFunDef(chunk, iTerm, env);
+      return;
+    case T_LITERAL:
+      EmitConstant(chunk, iTerm->value.literal.value);
+      return;
+    default:
+      DieShowingTerm("Unexpected term type in CompileTerm", iTerm);
+  }
+}
+
+Chunk* Compile(Term* iProgram, Env* env) {
+  Chunk* chunk = NewChunk(0, 0, 0);
+  /* The top level has no caller to return to, so
+     there's nothing for a tail call to replace. */
+  CompileTerm(chunk, iProgram, env, 0);
+  EmitByte(chunk, OP_RETURN);
+  return chunk;
+}
+
+/* Free a chunk and the chunks of the functions defined in it.
+   No closure over any of them may be called afterwards. */
+void FreeChunk(Chunk* chunk) {
+  for (int i = 0; i < chunk->childCount; i++) {
+    FreeChunk(chunk->children[i]);
+  }
+  JitFree(chunk);
+  free(chunk->children);
+  free(chunk->constants);
+  free(chunk->code);
+  free(chunk);
+}
+
+static const char* opNames[OP_COUNT] = {
+  "CONST", "LOCAL", "CAPTURED", "GLOBAL", "CALL", "TAILCALL", "POP", "CLOSURE",
+  "RETURN",
+};
+
+static int opOperandCounts[OP_COUNT] = {
+  1, 1, 1, 1, 1, 1, 0, 1, 0,
+};
+
+static void PrintChunkIndented(FILE* f, Chunk* chunk, int indent) {
+  int offset = 0;
+  while (offset < chunk->codeLen) {
+    OpCode op = chunk->code[offset];
+    fprintf(f, "%*s%04d %-8s", indent, "", offset, opNames[op]);
+    offset++;
+    int operand = 0;
+    for (int i = 0; i < opOperandCounts[op]; i++) {
+      operand = chunk->code[offset] | chunk->code[offset + 1] << 8;
+      fprintf(f, " %d", operand);
+      offset += 2;
+    }
+    if (op == OP_CONST || op == OP_GLOBAL) {
+      fprintf(f, "  ; ");
+      PrintTerm(f, chunk->constants[operand]);
+    }
+    fprintf(f, "\n");
+    if (op == OP_CLOSURE) {
+      PrintChunkIndented(f, chunk->children[operand], indent + 4);
+    }
+  }
+}
+
+void PrintChunk(FILE* f, Chunk* chunk) {
+  PrintChunkIndented(f, chunk, 0);
+}
@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -11,9 +12,16 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #endif
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 /**
 The data type of this term.
 
@@ -24,28 +32,45 @@ a specific type within that category. (This allows
 for easy bit tests to answer questions like "is this
 a primitive" or "is this a number".)
 
-(NOTE: Currently there's only one kind of number.
-       There will be a numeric tower in the future.)
+Numbers are integers of unlimited size: fixnums (T_NUMBER)
+and bignums (T_BIGNUM). See numbers.c.
+
+Not every term is a pointer to a Term structure. Some values
+are encoded directly in the pointer word instead (see "Immediate
+values" below), so use TYPE_OF to find the type of a term rather
+than reading its type field.
 */
 typedef enum __attribute__((__packed__)) {
   /* These are produced by the parser. */
   T_CONS        = 0x0100,
   T_STRING      = 0x0200,
-  T_NUMBER      = 0x0400,
+  T_NUMBER      = 0x0400, /* A fixnum. */
+  T_BIGNUM      = 0x0401,
   T_SYMBOL      = 0x0800,
   /* These arise at evaluation time. */
   T_PRIM_NIL    = 0x1001, /* NOTE: Nil is a null pointer but it has a type. */
   T_PRIM_FUN    = 0x1002,
   T_PRIM_QUOTE  = 0x1003,
   T_PRIM_BEGIN  = 0x1004,
+  T_PRIM_BOOL   = 0x1005,
+  T_PRIM_DEFMACRO = 0x1006,
   T_FUN_NATIVE  = 0x2001,
   T_FUN_USER    = 0x2002,
   T_FUN_MACRO   = 0x2003,
+  T_FUN_COMPILED = 0x2004, /* A function compiled to C (see emitc.c). */
+  /* These are produced by the resolver and the optimizer. */
+  T_LOCAL_REF   = 0x4001,
+  T_GLOBAL_REF  = 0x4002,
+  T_FUN_DEF     = 0x4003,
+  T_LITERAL     = 0x4004, /* A constant that doesn't evaluate to itself. */
+  /* These are internal to the runtime. */
+  T_FRAME       = 0x8001,
 } DataType;
 
 #define TYPE_CATEGORY_NUMBER  0x0400
 #define TYPE_CATEGORY_PRIM    0x1000
 #define TYPE_CATEGORY_FUN     0x2000
+#define TYPE_CATEGORY_REF     0x4000
 
 #define TYPE_IS_NIL(TYPE) ((TYPE) == T_PRIM_NIL)
 #define TYPE_IS_ATOM(TYPE) ((TYPE) != T_CONS)
@@ -57,20 +82,82 @@ typedef enum __attribute__((__packed__)) {
 #define TYPE_IS_FUN(TYPE) ((TYPE) & TYPE_CATEGORY_FUN)
 #define TYPE_IS_FUN_NATIVE(TYPE) ((TYPE) == T_FUN_NATIVE)
 #define TYPE_IS_FUN_USER(TYPE) ((TYPE) == T_FUN_USER)
-#define TYPE_IS_FUN_MACRO(TYPE) ((TYPE) == T_FUN_USER)
+#define TYPE_IS_FUN_MACRO(TYPE) ((TYPE) == T_FUN_MACRO)
+#define TYPE_IS_FUN_COMPILED(TYPE) ((TYPE) == T_FUN_COMPILED)
+#define TYPE_IS_LOCAL_REF(TYPE) ((TYPE) == T_LOCAL_REF)
+#define TYPE_IS_GLOBAL_REF(TYPE) ((TYPE) == T_GLOBAL_REF)
+#define TYPE_IS_FUN_DEF(TYPE) ((TYPE) == T_FUN_DEF)
+#define TYPE_IS_LITERAL(TYPE) ((TYPE) == T_LITERAL)
+
+/*
+Immediate values.
+
+Terms are at least 8-byte aligned, so the low bits of a real
+term pointer are always zero. A term whose low bit is set is a
+fixnum: a small integer stored in the rest of the word. A term
+whose low two bits are 10 is an immediate constant: its type and
+a small payload are stored in the rest of the word. This is used
+for the booleans and the primitive markers. Nil is still the null
+pointer.
+
+None of these are allocated, and the garbage collector ignores
+them.
+*/
+#define IMMEDIATE_TAG_MASK 3
+#define FIXNUM_TAG 1
+#define CONSTANT_TAG 2
+
+#define IS_IMMEDIATE(TERM) (((uintptr_t)(TERM) & IMMEDIATE_TAG_MASK) != 0)
+#define IS_FIXNUM(TERM) (((uintptr_t)(TERM) & FIXNUM_TAG) != 0)
+#define IS_CONSTANT(TERM) \
+  (((uintptr_t)(TERM) & IMMEDIATE_TAG_MASK) == CONSTANT_TAG)
+/* A pointer to an actual Term structure. */
+#define IS_BOXED(TERM) ((TERM) && !IS_IMMEDIATE(TERM))
+
+#define FIXNUM_MAX (INTPTR_MAX >> 1)
+#define FIXNUM_MIN (INTPTR_MIN >> 1)
+#define MAKE_FIXNUM(N) ((Term*)(((uintptr_t)(intptr_t)(N) << 1) | FIXNUM_TAG))
+/* Relies on right shifts of negative numbers being arithmetic,
+   which they are on every compiler this builds with. */
+#define FIXNUM_VALUE(TERM) ((intptr_t)(TERM) >> 1)
+
+#define MAKE_CONSTANT(TYPE, N) \
+  ((Term*)(((uintptr_t)(N) << 18) | ((uintptr_t)(TYPE) << 2) | CONSTANT_TAG))
+#define CONSTANT_TYPE(TERM) ((DataType)(((uintptr_t)(TERM) >> 2) & 0xFFFF))
+#define CONSTANT_VALUE(TERM) ((uintptr_t)(TERM) >> 18)
+
+#define TERM_FALSE      MAKE_CONSTANT(T_PRIM_BOOL, 0)
+#define TERM_TRUE       MAKE_CONSTANT(T_PRIM_BOOL, 1)
+#define TERM_PRIM_FUN   MAKE_CONSTANT(T_PRIM_FUN, 0)
+#define TERM_PRIM_QUOTE MAKE_CONSTANT(T_PRIM_QUOTE, 0)
+#define TERM_PRIM_BEGIN MAKE_CONSTANT(T_PRIM_BEGIN, 0)
+#define TERM_PRIM_DEFMACRO MAKE_CONSTANT(T_PRIM_DEFMACRO, 0)
+#define MAKE_BOOL(B)    ((B) ? TERM_TRUE : TERM_FALSE)
+
+#define TYPE_OF(TERM) \
+  (!(TERM) ? T_PRIM_NIL \
+   : IS_FIXNUM(TERM) ? T_NUMBER \
+   : IS_CONSTANT(TERM) ? CONSTANT_TYPE(TERM) \
+   : (TERM)->type)
 
 #define IS_NIL(TERM)        (!(TERM))
-#define IS_ATOM(TERM)       (!(TERM) || TYPE_IS_ATOM((TERM)->type))
-#define IS_CONS(TERM)       ((TERM) && TYPE_IS_CONS((TERM)->type))
-#define IS_LIST(TERM)       (!(TERM) || TYPE_IS_CONS((TERM)->type))
-#define IS_STRING(TERM)     ((TERM) && TYPE_IS_STRING((TERM)->type))
-#define IS_SYMBOL(TERM)     ((TERM) && TYPE_IS_SYMBOL((TERM)->type))
-#define IS_NUMBER(TERM)     ((TERM) && TYPE_IS_NUMBER((TERM)->type))
-#define IS_PRIM(TERM)       ((TERM) && TYPE_IS_PRIM((TERM)->type))
-#define IS_FUN(TERM)        ((TERM) && TYPE_IS_FUN((TERM)->type))
-#define IS_FUN_NATIVE(TERM) ((TERM) && TYPE_IS_FUN_NATIVE((TERM)->type))
-#define IS_FUN_USER(TERM)   ((TERM) && TYPE_IS_FUN_USER((TERM)->type))
-#define IS_FUN_MACRO(TERM)  ((TERM) && TYPE_IS_FUN_MACRO((TERM)->type))
+#define IS_ATOM(TERM)       (!IS_CONS(TERM))
+#define IS_CONS(TERM)       (IS_BOXED(TERM) && TYPE_IS_CONS((TERM)->type))
+#define IS_LIST(TERM)       (!(TERM) || IS_CONS(TERM))
+#define IS_STRING(TERM)     (IS_BOXED(TERM) && TYPE_IS_STRING((TERM)->type))
+#define IS_SYMBOL(TERM)     (IS_BOXED(TERM) && TYPE_IS_SYMBOL((TERM)->type))
+#define IS_BIGNUM(TERM)     (IS_BOXED(TERM) && (TERM)->type == T_BIGNUM)
+#define IS_NUMBER(TERM)     (IS_FIXNUM(TERM) || IS_BIGNUM(TERM))
+#define IS_PRIM(TERM)       (IS_CONSTANT(TERM))
+#define IS_FUN(TERM)        (IS_BOXED(TERM) && TYPE_IS_FUN((TERM)->type))
+#define IS_FUN_NATIVE(TERM) (IS_BOXED(TERM) && TYPE_IS_FUN_NATIVE((TERM)->type))
+#define IS_FUN_USER(TERM)   (IS_BOXED(TERM) && TYPE_IS_FUN_USER((TERM)->type))
+#define IS_FUN_MACRO(TERM)  (IS_BOXED(TERM) && TYPE_IS_FUN_MACRO((TERM)->type))
+#define IS_FUN_COMPILED(TERM) (IS_BOXED(TERM) && TYPE_IS_FUN_COMPILED((TERM)->type))
+#define IS_LOCAL_REF(TERM)  (IS_BOXED(TERM) && TYPE_IS_LOCAL_REF((TERM)->type))
+#define IS_GLOBAL_REF(TERM) (IS_BOXED(TERM) && TYPE_IS_GLOBAL_REF((TERM)->type))
+#define IS_FUN_DEF(TERM)    (IS_BOXED(TERM) && TYPE_IS_FUN_DEF((TERM)->type))
+#define IS_LITERAL(TERM)    (IS_BOXED(TERM) && TYPE_IS_LITERAL((TERM)->type))
 
 /* Use this check around a pointer to ensure that the term it
    points to has the type that you expect. It returns null if
@@ -84,19 +171,90 @@ typedef enum __attribute__((__packed__)) {
 #define CHECK_TYPE(TERM, TYPE_PREDICATE) \
   (TYPE_PREDICATE(TERM) ? TERM : (Term*)0)
 
+#define AS_BIGNUM(TERM) ((BigNum*)CHECK_TYPE(TERM, IS_BIGNUM))
+
+/* TAIL is not an lvalue, since the tail of a compact cons cell
+   isn't stored (see CDR_NEXT below). Use SET_TAIL to change it. */
 #define HEAD(TERM) (CHECK_TYPE(TERM, IS_CONS)->value.list.head)
-#define TAIL(TERM) (CHECK_TYPE(TERM, IS_CONS)->value.list.tail)
+#define TAIL(TERM) ConsTail(CHECK_TYPE(TERM, IS_CONS))
+
+/* Use these to modify a cons cell after it has been allocated.
+   They apply the garbage collector's write barrier. The value
+   is evaluated before the cell, since evaluating the value
+   may allocate and so move the cell. Only an ordinary
+   (CDR_NORMAL) cell can have its tail changed. */
+#define SET_HEAD(TERM, VALUE) do { \
+    Term* setValue_ = (VALUE); \
+    Term* setTerm_ = (TERM); \
+    HEAD(setTerm_) = setValue_; \
+    GC_WRITE_BARRIER(setTerm_, setValue_); \
+  } while (0)
+#define SET_TAIL(TERM, VALUE) do { \
+    Term* setValue_ = (VALUE); \
+    Term* setTerm_ = CHECK_TYPE(TERM, IS_CONS); \
+    assert(setTerm_->cdrCode == CDR_NORMAL); \
+    setTerm_->value.list.tail = setValue_; \
+    GC_WRITE_BARRIER(setTerm_, setValue_); \
+  } while (0)
 
-// This isn't used yet.
+/* Garbage collector bookkeeping (see gc.c). */
 typedef struct GCInfo {
   unsigned short bits;
 } GCInfo;
 
+#define GC_OLD        0x0001 /* Lives in the old generation. */
+#define GC_MARKED     0x0002 /* Reached during a major collection. */
+#define GC_REMEMBERED 0x0004 /* Is in the remembered set. */
+#define GC_FORWARDED  0x0008 /* Young object that has been promoted. */
+#define GC_FREE       0x0010 /* Unused slot in a typed page. */
+
 struct Env;
+struct Frame;
+struct Chunk;
+typedef struct MemPool MemPool;
+
+/* A builtin function. The arguments come evaluated, as a list.
+   Anything the function allocates comes from the pool, or from
+   the garbage collector if the pool is null. */
+typedef struct Term* (*NativeFun)(struct Term* args, MemPool* pool);
+
+/* A builtin function that takes its arguments as an array
+   instead, which saves allocating the list. The array is on a
+   stack that the collector scans, so an element that is moved by
+   a collection is updated in place. The function must not
+   evaluate anything (e.g. with Apply), since that may move the
+   array itself. */
+typedef struct Term* (*NativeArrayFun)(int argc, struct Term** argv, MemPool* pool);
+
+/* A user function compiled to C (see emitc.c). It gets exactly
+   as many arguments as it declares, in an array that the collector
+   scans, and the frame of the variables it captures. */
+typedef struct Term* (*CompiledFun)(struct Term** argv, struct Frame* captured, MemPool* pool);
+
+/* The arity of a builtin that takes any number of arguments. */
+#define ARITY_VARIADIC (-1)
+
+/*
+CDR coding.
+
+A list can be stored as a run of compact cons cells that sit next
+to each other in memory. A compact cell holds only its head; its
+tail is implicit, given by its cdrCode: either the next cell in
+the run or nil. Such a cell is CDR_CELL_SIZE bytes instead of
+sizeof(Term), and walking the list reads memory sequentially.
+
+The parser and argument evaluation build lists this way (see
+NewList). The garbage collector expands compact cells into
+ordinary ones when it promotes them.
+*/
+#define CDR_NORMAL 0 /* The tail is stored in the cell. */
+#define CDR_NEXT   1 /* The tail is the next cell in memory. */
+#define CDR_NIL    2 /* The tail is nil. */
 
 typedef struct Term {
   DataType type;
   GCInfo gcInfo;
+  unsigned char cdrCode; /* For T_CONS only. */
   union {
     struct {
       struct Term* head;
@@ -106,50 +264,322 @@ typedef struct Term {
       const char* text;
       int len;
     } string;
-    struct {
-      int n;
-    } number;
     struct {
       const char* funName;  /* Function name (null-terminated string). */
-      struct Term* (*funPtr)(struct Term*);
+      /* Exactly one of these is set. */
+      NativeFun funPtr;
+      NativeArrayFun arrayFunPtr;
+      int arity; /* For arrayFunPtr: checked before the call. */
+      /* No side effects, and can't fail when called with one or
+         more numbers, so such a call can be made ahead of time. */
+      int pure;
     } bif;
     struct {
       //struct Term* funName; /* Function name (a symbol). */
       struct Term* funBody; /* Function code (a list). */
       struct Term* funArgs; /* List of symbols (arg names). */
-      struct Env* funEnv;   /* Closure environment. */
+      struct Frame* funFrame; /* Captured variables, or null. */
+      struct Chunk* funCode;  /* Bytecode, if compiled (else null). */
     } udf;
+    struct {
+      CompiledFun fun;
+      struct Frame* funFrame; /* Captured variables, or null. */
+      int arity;
+    } compiled;
+    struct {
+      int captured; /* In the closure's captured variables, not the arguments. */
+      int slot;     /* Index into the frame's slots. */
+      struct Term* name; /* The symbol, for printing. */
+    } localRef;
+    struct {
+      struct Term* name;  /* The symbol. */
+      /* Inline cache: the value the symbol had when the
+         environment was at the given version. */
+      struct Term* value;
+      struct Term* native; /* The value, if it's a native function. */
+      unsigned version;
+    } globalRef;
+    struct {
+      struct Term* funArgs;  /* List of symbols (arg names). */
+      struct Term* funBody;  /* Function code (a list). */
+      /* Where to find the variables the function captures, as
+         local references in the defining function. */
+      struct Term* captures;
+      int captureCount;
+    } funDef;
+    struct {
+      struct Term* value;
+    } literal;
   } value;
 } Term;
 
+#define CDR_CELL_SIZE (offsetof(Term, value.list.tail))
+/* An ordinary cons cell is allocated without the rest of the union. */
+#define CONS_SIZE (offsetof(Term, value.list.tail) + sizeof(Term*))
+
+static inline Term* ConsTail(Term* cons) {
+  switch (cons->cdrCode) {
+    case CDR_NEXT:
+      return (Term*)((char*)cons + CDR_CELL_SIZE);
+    case CDR_NIL:
+      return 0;
+    default:
+      return cons->value.list.tail;
+  }
+}
+
+/* An activation frame holding the arguments of one call.
+   Closures are flat: a closure keeps the values of the variables
+   it uses from enclosing functions in a frame of their own (with
+   no parent), which becomes the parent of each call's frame. So a
+   local variable is always in one of two frames, and the resolver
+   turns it into a slot in one of them. */
+typedef struct Frame {
+  DataType type; /* Always T_FRAME. */
+  GCInfo gcInfo;
+  int size;
+  struct Frame* parent; /* The closure's captured variables. */
+  Term* slots[1];
+} Frame;
+
+/* An integer too big to be a fixnum. */
+typedef struct BigNum {
+  DataType type; /* Always T_BIGNUM. */
+  GCInfo gcInfo;
+  int negative;
+  int len; /* Number of limbs. The most significant one is nonzero. */
+  uint32_t limbs[1]; /* Magnitude, least significant limb first. */
+} BigNum;
+
+/* The layout that every garbage-collected object (Term, Frame
+   or BigNum) starts with. A promoted nursery object stores the
+   address of its copy in the first pointer-sized field. */
+typedef struct GcObject {
+  DataType type;
+  GCInfo gcInfo;
+  void* forward;
+} GcObject;
+
 typedef struct Env {
   struct Env* next;
-  const char* nameText;
-  int nameLen;
+  Term* name;  /* An interned symbol. */
   Term* value;
 } Env;
 
-Env* BuiltinEnvironment();
+Env* BuiltinEnvironment(MemPool* pool);
+int NativeFunctionCount();
+int NativeFunctionIndex(void* fun);
+void* NativeFunctionAt(int index);
+void SaveImage(const char* filename, Term* program, Env* env);
+void LoadImage(const char* filename, Term** program, Env** env);
+char* CachedImagePath(const char* cacheDir, const char* code, size_t len);
+int LoadCachedImage(const char* path, Term** program, Env** env);
+void SaveCachedImage(const char* path, Term* program, Env* env);
+Term* Resolve(Term* iProgram, Env* env, MemPool* pool);
+Term* Optimize(Term* iProgram, Env* env, MemPool* pool);
+Term* InternSymbol(const char* text, int len);
 Term* GetSymbol(const char* name);
-Term* Interpret(Term* iTerm);
-Term* EnvLookup(Env* env, const char* name, int len);
+Term* Interpret(Term* iProgram, MemPool* programPool, Env* env);
+void InterpretInit(MemPool* envPool, Env* env);
+Term* InterpretForm(Term* iForm, MemPool* formPool);
+void InterpretFinish();
+Term* EnvLookup(Env* env, Term* symbol);
+Term* Apply(Term* eFun, Term* eArgs, MemPool* pool);
+Term* CallMacro(Term* eMacro, Term* iArgs, MemPool* pool);
+Term* MacroExpand(Term* iForm, Env** env, MemPool* envPool, MemPool* pool);
+Term* PrepareForm(Term* iForm, MemPool* formPool, Env** env);
+void RuntimeInit();
+
+/* Compiling a program to C, and the runtime that the
+   compiled program calls (see emitc.c). */
+void EmitC(FILE* f, Term* iProgram, MemPool* pool, const char* sourceName);
+Env* CompiledInit(MemPool* pool);
+Term* CallCompiled(Term* eFun, int argc, Term** argv, MemPool* pool);
+Term* CompiledTailCall(Term* eFun, int argc, Term** argv);
+Term* NewCompiledClosure(CompiledFun fun, int arity, int captureCount,
+                         Term** captures, MemPool* pool);
+Term* CompiledString(MemPool* pool, const char* text, int len);
+Term* CompiledBigNum(MemPool* pool, int negative, int len, const uint32_t* limbs);
+
+/* Run programs on the bytecode VM instead of the tree walker. */
+extern int useBytecode;
+/* Evaluate each top-level form in a scratch pool that is reset
+   afterwards, instead of using the garbage collector. */
+extern int useArena;
+/* Run the optimizer (see optimize.c) over each form. */
+extern int useOptimizer;
+extern int useJit;
+
+/* The sampling profiler (see profile.c). */
+extern int profiling;
+void ProfileStart(const char* outPath, const char* code, size_t len);
+void ProfileNoteList(Term* list, const char* pos);
+int ProfileDepth();
+void ProfileEnter(int depth, const void* key);
+void ProfileLeave(int depth);
 
 #define ENV_LOOKUP_FAILED ((Term*)4)
 
+/*
+Global references.
+
+The resolver replaces each reference to a global symbol with a
+T_GLOBAL_REF term of its own, which caches the symbol's value. The
+cache is valid as long as no binding has been made since it was
+filled: envVersion counts the bindings made by EnvBind.
+*/
+extern unsigned envVersion;
+
+Term* RefreshGlobalRef(Term* ref, Env* env);
+
+#define GLOBAL_REF_VALUE(REF, ENV) \
+  ((REF)->value.globalRef.version == envVersion \
+   ? (REF)->value.globalRef.value : RefreshGlobalRef(REF, ENV))
+
 void Die(const char* message, ...)
   __attribute__((noreturn));
 void DieShowingTerm(const char* message, Term* term, ...)
   __attribute__((noreturn));
 
 void PrintTerm(FILE* f, Term* atom);
+int ListLength(Term* list);
+void CheckNativeArity(Term* eFun, int argc);
 
-typedef struct MemPool MemPool;
+/* Builtins whose calls are compiled inline (see jit.c and emitc.c). */
+Term* Add(int argc, Term** argv, MemPool* pool);
+Term* Subtract(int argc, Term** argv, MemPool* pool);
+Term* Multiply(int argc, Term** argv, MemPool* pool);
+Term* LessThan(int argc, Term** argv, MemPool* pool);
+Term* NumberEqual(int argc, Term** argv, MemPool* pool);
+
+/* Arithmetic on numbers of either kind (see numbers.c). */
+Term* NumberAdd(Term* a, Term* b, MemPool* pool);
+Term* NumberSubtract(Term* a, Term* b, MemPool* pool);
+Term* NumberMultiply(Term* a, Term* b, MemPool* pool);
+Term* NumberQuotient(Term* a, Term* b, MemPool* pool);
+Term* NumberRemainder(Term* a, Term* b, MemPool* pool);
+int NumberCompare(Term* a, Term* b);
+Term* ParseInteger(MemPool* pool, const char* text, int len);
+void PrintBigNum(FILE* f, Term* term);
+
+void MemInit();
+MemPool* NewMemPool();
+void* NewFromMemPool(MemPool* pool, size_t size);
+void ResetMemPool(MemPool* pool);
+void FreeMemPool(MemPool* pool);
+void AdoptMemPool(MemPool* pool, MemPool* other);
+int MemPoolContains(MemPool* pool, void* p);
 Env* EnvBind(MemPool* pool, Env* env, Term* argNameSymbol, Term* value);
 Term* NewCons(MemPool* pool, Term* head, Term* tail);
+Term* NewList(MemPool* pool, Term** elements, int count);
 Term* NewAtom(MemPool* pool, DataType type);
+size_t TermSize(DataType type);
+Frame* NewFrame(MemPool* pool, Frame* parent, int size);
+BigNum* NewBigNum(MemPool* pool, int len);
 void* Alloc(size_t size);
 void* Realloc(void* p, size_t size);
 
+/*
+Garbage collection.
+
+Objects allocated without a pool while the collector is active
+(i.e. during evaluation) are garbage collected. Everything else,
+such as the parsed program, interned symbols and builtins, is
+allocated from a pool and is static as far as the collector is
+concerned: it is never moved or freed by it, and it must not point
+to collected objects.
+
+Any C variable that holds a collected object across a call
+that might allocate must be registered as a root, so that the
+collector can find the object and update the variable when the
+object moves. Use GC_ENTER at the top of the function, GC_ROOT
+for each variable, and GC_LEAVE (or GC_RETURN) on the way out.
+*/
+
+/*
+Typed pages.
+
+The old generation lives in pages that each hold objects of a
+single type and size (a "big bag of pages"). The page holding an
+object is found by masking its address, so the collector gets the
+type and size of an old object from its page. See alloc.c.
+*/
+
+#define TYPED_PAGE_SIZE 0x10000 // 64 KB
+/* Bigger objects are allocated on their own, outside the pages. */
+#define TYPED_MAX_OBJECT_SIZE 256
+
+typedef struct TypedPage {
+  struct TypedPage* next;          /* Next page of the same class. */
+  struct TypedPage* nextAvailable; /* Next page of the class with a free slot. */
+  DataType type;
+  unsigned short objectSize;
+  int slotCount;
+  int liveCount;
+  GcObject* freeList; /* Linked through the forward field. */
+} TypedPage;
+
+extern char* typedPagesStart;
+extern char* typedPagesEnd;
+
+#define IS_IN_TYPED_PAGE(P) \
+  ((char*)(P) >= typedPagesStart && (char*)(P) < typedPagesEnd)
+#define TYPED_PAGE_OF(P) \
+  ((TypedPage*)((uintptr_t)(P) & ~(uintptr_t)(TYPED_PAGE_SIZE - 1)))
+
+void* AllocTyped(DataType type, size_t size);
+size_t SweepTypedPages();
+
+typedef void (*GcVisitor)(void** slot);
+typedef void (*GcRootScanner)(void* data, GcVisitor visit);
+
+/* Each thread has its own shadow stack, though only the main
+   thread's roots matter to the collector (see threads.c). */
+extern int gcActive;
+extern THREAD_LOCAL void*** gcRoots;
+extern THREAD_LOCAL int gcRootCount;
+extern THREAD_LOCAL int gcRootCapacity;
+extern char* gcNurseryStart;
+extern char* gcNurseryEnd;
+
+void GcInit();
+void GcGrowRoots();
+void GcPushRootScanner(GcRootScanner scanner, void* data);
+void GcPopRootScanner();
+void* GcAlloc(size_t size);
+int GcHasRoom(size_t size);
+void GcCollect();
+void GcRemember(GcObject* obj);
+void GcPrintStats(FILE* f);
+
+#define GC_ENTER() int gcRootMark_ = gcRootCount
+#define GC_ROOT(VAR) \
+  ((gcRootCount == gcRootCapacity ? GcGrowRoots() : (void)0), \
+   gcRoots[gcRootCount++] = (void**)&(VAR))
+#define GC_LEAVE() (gcRootCount = gcRootMark_)
+#define GC_RETURN(TYPE, VALUE) do { \
+    TYPE gcResult_ = (VALUE); \
+    GC_LEAVE(); \
+    return gcResult_; \
+  } while (0)
+
+/* Immediate values are never young, even if their bits happen
+   to look like an address in the nursery. */
+#define GC_IS_YOUNG(P) \
+  (!IS_IMMEDIATE(P) && \
+   (char*)(P) >= gcNurseryStart && (char*)(P) < gcNurseryEnd)
+
+/* Record a store of VALUE into the object OBJ. An old object
+   that points to a young one has to be treated as a root by
+   the next minor collection. */
+#define GC_WRITE_BARRIER(OBJ, VALUE) do { \
+    GcObject* barrierObj_ = (GcObject*)(OBJ); \
+    if ((barrierObj_->gcInfo.bits & (GC_OLD | GC_REMEMBERED)) == GC_OLD \
+        && GC_IS_YOUNG(VALUE)) { \
+      GcRemember(barrierObj_); \
+    } \
+  } while (0)
+
 #ifdef _WIN32
 typedef DWORD PageSize;
 #else
@@ -158,3 +588,28 @@ typedef long PageSize;
 
 extern PageSize pageSize;
 
+/* Threads (see threads.c). */
+
+typedef void (*TaskFun)(void* arg);
+
+typedef struct Lock {
+#ifdef _WIN32
+  CRITICAL_SECTION section;
+#else
+  pthread_mutex_t mutex;
+#endif
+} Lock;
+
+int ProcessorCount();
+void RunParallel(TaskFun fun, void** args, int count);
+int InParallelTask();
+void InitLock(Lock* lock);
+void AcquireLock(Lock* lock);
+void ReleaseLock(Lock* lock);
+
+/* Call with 1 before letting more than one thread intern
+   symbols, and with 0 once they're done. */
+void ShareSymbols(int shared);
+Term** InternedSymbols(int* count);
+void AdoptSymbol(Term* sym);
+
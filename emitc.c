@@ -0,0 +1,733 @@
+/*
+The C emitter turns a program into a C translation unit that runs
+it without the interpreter (ByteSize --emit-c OUT.c FILE). Each
+top-level form is expanded, resolved and optimized the way the
+interpreter would do it (see PrepareForm), and then:
+
+- Each function definition becomes a C function (a CompiledFun),
+  and evaluating the definition makes a T_FUN_COMPILED closure
+  over it.
+- Constants are built once at startup, from a pool.
+- Globals are looked up once at startup. The only globals that a
+  program can define are macros, which are gone once it has been
+  expanded, so the compiled program only has the builtins. (So
+  unlike in the interpreter, a macro can't be used as a value.)
+- A call to a builtin that is bound at compile time calls its C
+  function directly, and +, -, *, < and = on two fixnums are done
+  inline. Other calls go through CallCompiled.
+- A call in tail position returns through CompiledTailCall, so
+  that a chain of tail calls runs in constant space.
+
+Values are kept in an array of temporaries that is registered with
+the collector, and used as a stack the way the VM uses its stack
+(see compile.c): the value of a term compiled at depth d ends up
+in t[d], and the arguments of a call at depth d go from t[d + 1] on.
+
+The output is built with the rest of the runtime, everything but
+main.c, by: ./mk.sh program OUT.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include "datatype.h"
+#include "bytecode.h"
+
+/* Constants built by each startup function. */
+#define CONSTANT_BATCH_SIZE 256
+
+typedef struct Text {
+  char* s;
+  size_t len;
+  size_t capacity;
+} Text;
+
+typedef struct Emitter {
+  Text decls;      /* Prototypes of the functions. */
+  Text functions;  /* Their definitions. */
+  Text constants;  /* The code that builds the constants. */
+  Term** constantValues;
+  int constantCount;
+  int constantCapacity;
+  Term** globals;  /* Symbols. */
+  int globalCount;
+  int globalCapacity;
+  int functionCount;
+} Emitter;
+
+/* The C function that a function definition or a top-level
+   form is compiled to. */
+typedef struct Function {
+  Emitter* em;
+  Env* env;
+  Text code;
+  int depth;    /* Temporaries used. */
+  int hasFrame; /* False for a top-level form. */
+  int returned; /* The code ends in a return. */
+} Function;
+
+static void EmitTerm(Function* fn, Term* iTerm, int depth, int tail);
+
+static void Append(Text* text, const char* format, ...) {
+  if (!text->s) {
+    text->capacity = 1024;
+    text->s = (char*)Alloc(text->capacity);
+    text->len = 0;
+  }
+  for (;;) {
+    size_t room = text->capacity - text->len;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text->s + text->len, room, format, args);
+    va_end(args);
+    if ((size_t)n < room) {
+      text->len += n;
+      return;
+    }
+    text->capacity = text->capacity * 2 + n;
+    text->s = (char*)Realloc(text->s, text->capacity);
+  }
+}
+
+static void AppendText(Text* text, Text* more) {
+  if (more->len > 0) {
+    Append(text, "%s", more->s);
+  }
+}
+
+/* A C string literal with the given bytes. Octal escapes can't
+   run into the characters that follow them, unlike hex ones. */
+static void AppendCString(Text* text, const char* s, int len) {
+  Append(text, "\"");
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+      Append(text, "%c", c);
+    } else {
+      Append(text, "\\%03o", c);
+    }
+  }
+  Append(text, "\"");
+}
+
+/* Emit a line of code into the function. */
+static void Line(Function* fn, const char* format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  Append(&fn->code, "  %s\n", line);
+}
+
+static void UseDepth(Function* fn, int depth) {
+  if (depth + 1 > fn->depth)
+    fn->depth = depth + 1;
+}
+
+static void AppendConstant(Emitter* em, Text* text, Term* value);
+
+/* The index in k[] of a constant that has to be allocated. */
+static int ConstantIndex(Emitter* em, Term* value) {
+  for (int i = 0; i < em->constantCount; i++) {
+    if (em->constantValues[i] == value)
+      return i;
+  }
+  /* The parts of a list are made before the list. */
+  Text expr = {0};
+  switch (TYPE_OF(value)) {
+    case T_SYMBOL:
+      Append(&expr, "InternSymbol(");
+      AppendCString(&expr, value->value.string.text, value->value.string.len);
+      Append(&expr, ", %d)", value->value.string.len);
+      break;
+    case T_STRING:
+      Append(&expr, "CompiledString(pool, ");
+      AppendCString(&expr, value->value.string.text, value->value.string.len);
+      Append(&expr, ", %d)", value->value.string.len);
+      break;
+    case T_BIGNUM: {
+      BigNum* big = AS_BIGNUM(value);
+      Append(&expr, "CompiledBigNum(pool, %d, %d, (const uint32_t[]){",
+             big->negative, big->len);
+      for (int i = 0; i < big->len; i++) {
+        Append(&expr, "%s0x%08xu", i ? ", " : "", (unsigned)big->limbs[i]);
+      }
+      Append(&expr, "})");
+      break;
+    }
+    case T_CONS: {
+      Term* node = value;
+      int count = 0;
+      for (; IS_CONS(node); node = TAIL(node)) {
+        count++;
+      }
+      if (!node) {
+        Append(&expr, "NewList(pool, (Term*[]){");
+        for (node = value; node; node = TAIL(node)) {
+          if (node != value)
+            Append(&expr, ", ");
+          AppendConstant(em, &expr, HEAD(node));
+        }
+        Append(&expr, "}, %d)", count);
+      } else {
+        for (node = value; IS_CONS(node); node = TAIL(node)) {
+          Append(&expr, "NewCons(pool, ");
+          AppendConstant(em, &expr, HEAD(node));
+          Append(&expr, ", ");
+        }
+        AppendConstant(em, &expr, node);
+        for (int i = 0; i < count; i++) {
+          Append(&expr, ")");
+        }
+      }
+      break;
+    }
+    default:
+      DieShowingTerm("Can't compile a constant of this type", value);
+  }
+  if (em->constantCount == em->constantCapacity) {
+    em->constantCapacity = em->constantCapacity ? em->constantCapacity * 2 : 16;
+    em->constantValues = (Term**)Realloc(em->constantValues,
+        em->constantCapacity * sizeof(Term*));
+  }
+  int index = em->constantCount++;
+  em->constantValues[index] = value;
+  /* A function that long takes the C compiler a long time,
+     so the constants are built in batches. */
+  if (index % CONSTANT_BATCH_SIZE == 0) {
+    Append(&em->constants, "%s\nstatic void InitConstants%d(MemPool* pool) {\n",
+           index ? "}\n" : "", index / CONSTANT_BATCH_SIZE);
+  }
+  Append(&em->constants, "  k[%d] = %s;\n", index, expr.s);
+  free(expr.s);
+  return index;
+}
+
+/* An expression for a constant value. */
+static void AppendConstant(Emitter* em, Text* text, Term* value) {
+  if (!value) {
+    Append(text, "0");
+  } else if (value == TERM_TRUE) {
+    Append(text, "TERM_TRUE");
+  } else if (value == TERM_FALSE) {
+    Append(text, "TERM_FALSE");
+  } else if (IS_FIXNUM(value)) {
+    Append(text, "MAKE_FIXNUM(%lldLL)", (long long)FIXNUM_VALUE(value));
+  } else if (IS_IMMEDIATE(value)) {
+    Append(text, "((Term*)(uintptr_t)0x%llxu)", (unsigned long long)(uintptr_t)value);
+  } else {
+    Append(text, "k[%d]", ConstantIndex(em, value));
+  }
+}
+
+/* The index in g[] of a global symbol. */
+static int GlobalIndex(Emitter* em, Term* name) {
+  for (int i = 0; i < em->globalCount; i++) {
+    if (em->globals[i] == name)
+      return i;
+  }
+  if (em->globalCount == em->globalCapacity) {
+    em->globalCapacity = em->globalCapacity ? em->globalCapacity * 2 : 16;
+    em->globals = (Term**)Realloc(em->globals, em->globalCapacity * sizeof(Term*));
+  }
+  em->globals[em->globalCount] = name;
+  return em->globalCount++;
+}
+
+static void EmitConstant(Function* fn, int depth, Term* value) {
+  Text expr = {0};
+  AppendConstant(fn->em, &expr, value);
+  UseDepth(fn, depth);
+  Line(fn, "t[%d] = %s;", depth, expr.s);
+  free(expr.s);
+}
+
+static void EmitSequence(Function* fn, Term* iList, int depth, int tail) {
+  if (!iList) {
+    EmitConstant(fn, depth, 0);
+    return;
+  }
+  for (; iList; iList = TAIL(iList)) {
+    EmitTerm(fn, HEAD(iList), depth, tail && !TAIL(iList));
+  }
+}
+
+/* Declare the temporaries, and register them with the collector. */
+static void AppendPrologue(Text* out, int depth) {
+  Append(out, "  Term* t[%d] = {0};\n", depth);
+  Append(out, "  GC_ENTER();\n");
+  if (depth == 1) {
+    Append(out, "  GC_ROOT(t[0]);\n");
+  } else {
+    Append(out, "  for (int i = 0; i < %d; i++) {\n", depth);
+    Append(out, "    GC_ROOT(t[i]);\n");
+    Append(out, "  }\n");
+  }
+}
+
+/* Emit the C function for a function body, and return its index. */
+static int EmitFunction(Function* parent, int arity, Term* funBody) {
+  Emitter* em = parent->em;
+  Function fn;
+  memset(&fn, 0, sizeof(fn));
+  fn.em = em;
+  fn.env = parent->env;
+  fn.hasFrame = 1;
+  int index = em->functionCount++;
+  EmitSequence(&fn, funBody, 0, 1);
+  Append(&em->decls, "static Term* F%d(Term** argv, Frame* captured, MemPool* pool);\n",
+         index);
+  Text* out = &em->functions;
+  Append(out, "\nstatic Term* F%d(Term** argv, Frame* captured, MemPool* pool) {\n",
+         index);
+  AppendPrologue(out, fn.depth);
+  Append(out, "  Frame* frame = NewFrame(pool, captured, %d);\n", arity);
+  Append(out, "  GC_ROOT(frame);\n");
+  for (int i = 0; i < arity; i++) {
+    Append(out, "  frame->slots[%d] = argv[%d];\n", i, i);
+    Append(out, "  GC_WRITE_BARRIER(frame, argv[%d]);\n", i);
+  }
+  AppendText(out, &fn.code);
+  if (!fn.returned) {
+    Append(out, "  GC_RETURN(Term*, t[0]);\n");
+  }
+  Append(out, "}\n");
+  free(fn.code.s);
+  return index;
+}
+
+/* A function definition that the resolver has analyzed. The values
+   of the variables it captures go in the temporaries from t[depth]
+   on, for NewCompiledClosure to put in the closure. */
+static void EmitFunDef(Function* fn, Term* iFunDef, int depth) {
+  int arity = ListLength(iFunDef->value.funDef.funArgs);
+  int index = EmitFunction(fn, arity, iFunDef->value.funDef.funBody);
+  int captureCount = iFunDef->value.funDef.captureCount;
+  int slot = depth;
+  for (Term* iCapture = iFunDef->value.funDef.captures; iCapture;
+       iCapture = TAIL(iCapture)) {
+    EmitTerm(fn, HEAD(iCapture), slot++, 0);
+  }
+  UseDepth(fn, depth);
+  if (captureCount > 0) {
+    Line(fn, "t[%d] = NewCompiledClosure(F%d, %d, %d, &t[%d], pool);",
+         depth, index, arity, captureCount, depth);
+  } else {
+    Line(fn, "t[%d] = NewCompiledClosure(F%d, %d, 0, 0, pool);",
+         depth, index, arity);
+  }
+}
+
+/* The form is (fun name (args...) body...), and wasn't resolved
+   as a function definition, so the closure captures nothing. */
+static void EmitFunctionDef(Function* fn, Term* iFunDef, int depth) {
+  if (!iFunDef) {
+    Die("Empty function definition.");
+  }
+  Term* funArgsAndBody = TAIL(iFunDef);
+  if (!funArgsAndBody) {
+    Die("Function arguments and body missing.");
+  }
+  Term* funArgDecls = HEAD(funArgsAndBody);
+  if (!IS_LIST(funArgDecls)) {
+    Die("Function argument declarations must be a list.");
+  }
+  for (Term* decl = funArgDecls; decl; decl = TAIL(decl)) {
+    if (!IS_SYMBOL(HEAD(decl))) {
+      Die("Function argument declarations must be symbols.");
+    }
+  }
+  Term* funBody = TAIL(funArgsAndBody);
+  if (!funBody) {
+    Die("Function body missing.");
+  }
+  int arity = ListLength(funArgDecls);
+  int index = EmitFunction(fn, arity, funBody);
+  UseDepth(fn, depth);
+  Line(fn, "t[%d] = NewCompiledClosure(F%d, %d, 0, 0, pool);", depth, index, arity);
+}
+
+/* The builtin that a call's head is bound to at compile time, if
+   it takes an array of arguments and the call has the right number
+   of them. */
+static Term* KnownNative(Function* fn, Term* iHead, int nArgs) {
+  Term* name = IS_GLOBAL_REF(iHead) ? iHead->value.globalRef.name : iHead;
+  if (!IS_SYMBOL(name))
+    return 0;
+  Term* eFun = EnvLookup(fn->env, name);
+  if (!IS_FUN_NATIVE(eFun) || !eFun->value.bif.arrayFunPtr)
+    return 0;
+  int arity = eFun->value.bif.arity;
+  if (arity != ARITY_VARIADIC && arity != nArgs)
+    return 0;
+  return eFun;
+}
+
+/* The inline version of a builtin, for a call with two arguments. */
+static const char* FastPath(Term* eFun) {
+  NativeArrayFun f = eFun->value.bif.arrayFunPtr;
+  if (f == Add) return "Add2";
+  if (f == Subtract) return "Subtract2";
+  if (f == Multiply) return "Multiply2";
+  if (f == LessThan) return "LessThan2";
+  if (f == NumberEqual) return "NumberEqual2";
+  return 0;
+}
+
+static void EmitCall(Function* fn, Term* iForm, int depth, int tail) {
+  Term* iHead = HEAD(iForm);
+  Term* eNative = KnownNative(fn, iHead, ListLength(TAIL(iForm)));
+  /* A native function's value doesn't change, so the head
+     isn't evaluated. */
+  if (!eNative) {
+    EmitTerm(fn, iHead, depth, 0);
+  }
+  int nArgs = 0;
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    EmitTerm(fn, HEAD(iArg), depth + 1 + nArgs, 0);
+    nArgs++;
+  }
+  UseDepth(fn, depth);
+  if (eNative) {
+    Term* name = IS_GLOBAL_REF(iHead) ? iHead->value.globalRef.name : iHead;
+    const char* fastPath = nArgs == 2 ? FastPath(eNative) : 0;
+    if (fastPath) {
+      Line(fn, "t[%d] = %s(&t[%d], pool);", depth, fastPath, depth + 1);
+    } else {
+      Line(fn, "t[%d] = g[%d]->value.bif.arrayFunPtr(%d, &t[%d], pool);",
+           depth, GlobalIndex(fn->em, name), nArgs, depth + 1);
+    }
+    return;
+  }
+  if (tail && fn->hasFrame) {
+    Line(fn, "GC_RETURN(Term*, CompiledTailCall(t[%d], %d, &t[%d]));",
+         depth, nArgs, depth + 1);
+    fn->returned = 1;
+  } else {
+    Line(fn, "t[%d] = CallCompiled(t[%d], %d, &t[%d], pool);",
+         depth, depth, nArgs, depth + 1);
+  }
+}
+
+static void EmitForm(Function* fn, Term* iForm, int depth, int tail) {
+  Term* iHead = HEAD(iForm);
+  if (IS_SYMBOL(iHead)) {
+    Term* eHead = EnvLookup(fn->env, iHead);
+    if (eHead && eHead != ENV_LOOKUP_FAILED) {
+      switch (TYPE_OF(eHead)) {
+        case T_PRIM_QUOTE:
+          if (!TAIL(iForm)) {
+            Die("Empty quote form.");
+          }
+          if (TAIL(TAIL(iForm))) {
+            Die("Quote must have only one argument.");
+          }
+          EmitConstant(fn, depth, HEAD(TAIL(iForm)));
+          return;
+        case T_PRIM_BEGIN:
+          EmitSequence(fn, TAIL(iForm), depth, tail);
+          return;
+        case T_PRIM_FUN:
+          EmitFunctionDef(fn, TAIL(iForm), depth);
+          return;
+        default:
+          break;
+      }
+    }
+  }
+  EmitCall(fn, iForm, depth, tail);
+}
+
+static void EmitTerm(Function* fn, Term* iTerm, int depth, int tail) {
+  if (!iTerm) {
+    EmitConstant(fn, depth, 0);
+    return;
+  }
+  switch (TYPE_OF(iTerm)) {
+    case T_CONS:
+      EmitForm(fn, iTerm, depth, tail);
+      return;
+    case T_STRING:
+    case T_NUMBER:
+    case T_BIGNUM:
+      EmitConstant(fn, depth, iTerm);
+      return;
+    case T_LITERAL:
+      EmitConstant(fn, depth, iTerm->value.literal.value);
+      return;
+    case T_SYMBOL:
+    case T_GLOBAL_REF: {
+      Term* name = IS_SYMBOL(iTerm) ? iTerm : iTerm->value.globalRef.name;
+      Term* eValue = EnvLookup(fn->env, name);
+      UseDepth(fn, depth);
+      if (eValue == ENV_LOOKUP_FAILED || IS_FUN_MACRO(eValue)) {
+        /* Unbound in the compiled program, so it fails if it's
+           ever evaluated. */
+        Line(fn, "t[%d] = Global(%d);", depth, GlobalIndex(fn->em, name));
+      } else {
+        Line(fn, "t[%d] = g[%d];", depth, GlobalIndex(fn->em, name));
+      }
+      return;
+    }
+    case T_LOCAL_REF:
+      assert(fn->hasFrame);
+      UseDepth(fn, depth);
+      Line(fn, "t[%d] = frame->%sslots[%d];", depth,
+           iTerm->value.localRef.captured ? "parent->" : "",
+           iTerm->value.localRef.slot);
+      return;
+    case T_FUN_DEF:
+      EmitFunDef(fn, iTerm, depth);
+      return;
+    default:
+      DieShowingTerm("Unexpected term type in EmitTerm", iTerm);
+  }
+}
+
+/* Helpers for the generated code. */
+static const char prelude[] =
+  "static inline Term* Global(int i) {\n"
+  "  if (g[i] == ENV_LOOKUP_FAILED)\n"
+  "    Die(\"Unresolved symbol: %s\", globalNames[i]);\n"
+  "  return g[i];\n"
+  "}\n";
+
+static const char fastPaths[] =
+  "#define FAST_ARITH(NAME, OVERFLOW, SLOW) \\\n"
+  "  static inline Term* NAME(Term** argv, MemPool* pool) { \\\n"
+  "    intptr_t n; \\\n"
+  "    if (IS_FIXNUM(argv[0]) && IS_FIXNUM(argv[1]) \\\n"
+  "        && !OVERFLOW(FIXNUM_VALUE(argv[0]), FIXNUM_VALUE(argv[1]), &n) \\\n"
+  "        && n >= FIXNUM_MIN && n <= FIXNUM_MAX) \\\n"
+  "      return MAKE_FIXNUM(n); \\\n"
+  "    return SLOW(2, argv, pool); \\\n"
+  "  }\n"
+  "FAST_ARITH(Add2, __builtin_add_overflow, Add)\n"
+  "FAST_ARITH(Subtract2, __builtin_sub_overflow, Subtract)\n"
+  "FAST_ARITH(Multiply2, __builtin_mul_overflow, Multiply)\n"
+  "\n"
+  "static inline Term* LessThan2(Term** argv, MemPool* pool) {\n"
+  "  if (IS_FIXNUM(argv[0]) && IS_FIXNUM(argv[1]))\n"
+  "    return MAKE_BOOL(FIXNUM_VALUE(argv[0]) < FIXNUM_VALUE(argv[1]));\n"
+  "  return LessThan(2, argv, pool);\n"
+  "}\n"
+  "\n"
+  "static inline Term* NumberEqual2(Term** argv, MemPool* pool) {\n"
+  "  if (IS_FIXNUM(argv[0]) && IS_FIXNUM(argv[1]))\n"
+  "    return MAKE_BOOL(argv[0] == argv[1]);\n"
+  "  return NumberEqual(2, argv, pool);\n"
+  "}\n";
+
+/* Write the program as C to the file. The interpreter must have
+   been set up (see InterpretInit), since the program's macros are
+   expanded by running them. */
+void EmitC(FILE* f, Term* iProgram, MemPool* pool, const char* sourceName) {
+  Emitter em;
+  memset(&em, 0, sizeof(em));
+  Text forms = {0};
+  int formCount = 0;
+  for (Term* iForms = iProgram; iForms; iForms = TAIL(iForms)) {
+    Env* env;
+    Term* iForm = PrepareForm(HEAD(iForms), pool, &env);
+    if (!iForm)
+      continue; /* A macro definition, or nil. */
+    Function fn;
+    memset(&fn, 0, sizeof(fn));
+    fn.em = &em;
+    fn.env = env;
+    /* The top level has no caller to return to, so
+       there's nothing for a tail call to replace. */
+    EmitTerm(&fn, iForm, 0, 0);
+    Append(&forms, "\nstatic Term* Form%d(MemPool* pool) {\n", formCount++);
+    AppendPrologue(&forms, fn.depth);
+    AppendText(&forms, &fn.code);
+    Append(&forms, "  GC_RETURN(Term*, t[0]);\n}\n");
+    free(fn.code.s);
+  }
+
+  fprintf(f, "/* Compiled from %s by ByteSize --emit-c. */\n\n", sourceName);
+  fprintf(f, "#include \"datatype.h\"\n\n");
+  if (em.constantCount > 0) {
+    fprintf(f, "static Term* k[%d];\n", em.constantCount);
+  }
+  if (em.globalCount > 0) {
+    Text names = {0};
+    for (int i = 0; i < em.globalCount; i++) {
+      Append(&names, "  ");
+      AppendCString(&names, em.globals[i]->value.string.text,
+                    em.globals[i]->value.string.len);
+      Append(&names, ",\n");
+    }
+    fprintf(f, "static Term* g[%d];\n", em.globalCount);
+    fprintf(f, "static const char* globalNames[%d] = {\n%s};\n\n%s",
+            em.globalCount, names.s, prelude);
+    free(names.s);
+  }
+  fprintf(f, "\n%s\n", fastPaths);
+  if (em.decls.len > 0) {
+    fprintf(f, "%s", em.decls.s);
+  }
+  if (em.functions.len > 0) {
+    fprintf(f, "%s", em.functions.s);
+  }
+  if (forms.len > 0) {
+    fprintf(f, "%s", forms.s);
+  }
+
+  if (em.constants.len > 0) {
+    fprintf(f, "%s}\n", em.constants.s);
+  }
+  /* The functions are called through tables, since the C
+     compiler would otherwise inline them all into one. */
+  int batchCount = (em.constantCount + CONSTANT_BATCH_SIZE - 1) / CONSTANT_BATCH_SIZE;
+  fprintf(f, "\nstatic void (*const constantBatches[%d])(MemPool* pool) = {\n",
+          batchCount + 1);
+  for (int i = 0; i < batchCount; i++) {
+    fprintf(f, "  InitConstants%d,\n", i);
+  }
+  fprintf(f, "  0,\n};\n");
+  fprintf(f, "\nstatic Term* (*const forms[%d])(MemPool* pool) = {\n", formCount + 1);
+  for (int i = 0; i < formCount; i++) {
+    fprintf(f, "  Form%d,\n", i);
+  }
+  fprintf(f, "  0,\n};\n");
+  fprintf(f, "\nstatic void InitGlobals(Env* env) {\n");
+  for (int i = 0; i < em.globalCount; i++) {
+    Text name = {0};
+    AppendCString(&name, em.globals[i]->value.string.text,
+                  em.globals[i]->value.string.len);
+    fprintf(f, "  g[%d] = EnvLookup(env, InternSymbol(%s, %d));\n",
+            i, name.s, em.globals[i]->value.string.len);
+    free(name.s);
+  }
+  fprintf(f, "}\n\nint main() {\n");
+  fprintf(f, "  MemInit();\n");
+  fprintf(f, "  MemPool* pool = NewMemPool();\n");
+  fprintf(f, "  Env* env = CompiledInit(pool);\n");
+  fprintf(f, "  for (int i = 0; constantBatches[i]; i++) {\n");
+  fprintf(f, "    constantBatches[i](pool);\n");
+  fprintf(f, "  }\n");
+  fprintf(f, "  InitGlobals(env);\n");
+  fprintf(f, "  for (int i = 0; forms[i]; i++) {\n");
+  fprintf(f, "    forms[i](0);\n");
+  fprintf(f, "  }\n");
+  fprintf(f, "  return 0;\n}\n");
+
+  free(forms.s);
+  free(em.decls.s);
+  free(em.functions.s);
+  free(em.constants.s);
+  free(em.constantValues);
+  free(em.globals);
+}
+
+/*
+The runtime of a compiled program.
+
+A call in tail position doesn't make the call: it leaves the
+function and its arguments in the tail call buffer, and returns
+the tail call marker to CallCompiled, which makes the call in a
+loop. The buffer is scanned by the collector.
+*/
+
+static Term tailCallMarker;
+static THREAD_LOCAL Term* tailFun;
+static THREAD_LOCAL Term** tailArgs;
+static THREAD_LOCAL int tailArgCount;
+static THREAD_LOCAL int tailArgCapacity;
+
+static void VisitTailCall(void* data, GcVisitor visit) {
+  visit((void**)&tailFun);
+  for (int i = 0; i < tailArgCount; i++) {
+    visit((void**)&tailArgs[i]);
+  }
+}
+
+/* Set up the builtins and the collector. Evaluation is left to
+   the compiled code, and to Apply for calls from builtins. */
+Env* CompiledInit(MemPool* pool) {
+  Env* env = BuiltinEnvironment(pool);
+  RuntimeInit();
+  GcPushRootScanner(VisitTailCall, 0);
+  gcActive = 1;
+  return env;
+}
+
+/* Call a function with an array of arguments that the collector
+   scans. A compiled function copies its arguments out of the
+   array before it evaluates anything. */
+Term* CallCompiled(Term* eFun, int argc, Term** argv, MemPool* pool) {
+  for (;;) {
+    if (IS_FUN_NATIVE(eFun)) {
+      return CallNative(eFun, argv, argc, pool);
+    }
+    if (!IS_FUN_COMPILED(eFun)) {
+      DieShowingTerm("Called a non-function", eFun);
+    }
+    int arity = eFun->value.compiled.arity;
+    if (argc < arity) {
+      Die("Too few arguments to function.");
+    } else if (argc > arity) {
+      Die("Too many arguments to function.");
+    }
+    Term* eResult = eFun->value.compiled.fun(argv, eFun->value.compiled.funFrame, pool);
+    if (eResult != &tailCallMarker) {
+      return eResult;
+    }
+    eFun = tailFun;
+    argc = tailArgCount;
+    argv = tailArgs;
+  }
+}
+
+Term* CompiledTailCall(Term* eFun, int argc, Term** argv) {
+  if (argc > tailArgCapacity) {
+    tailArgCapacity = argc > 16 ? argc : 16;
+    tailArgs = (Term**)Realloc(tailArgs, tailArgCapacity * sizeof(Term*));
+  }
+  tailFun = eFun;
+  for (int i = 0; i < argc; i++) {
+    tailArgs[i] = argv[i];
+  }
+  tailArgCount = argc;
+  return &tailCallMarker;
+}
+
+/* Make a closure over the captured values, which are somewhere
+   that the collector scans. */
+Term* NewCompiledClosure(CompiledFun fun, int arity, int captureCount,
+                         Term** captures, MemPool* pool) {
+  GC_ENTER();
+  Frame* captured = 0;
+  GC_ROOT(captured);
+  if (captureCount > 0) {
+    captured = NewFrame(pool, 0, captureCount);
+    for (int i = 0; i < captureCount; i++) {
+      captured->slots[i] = captures[i];
+      GC_WRITE_BARRIER(captured, captures[i]);
+    }
+  }
+  Term* eFun = NewAtom(pool, T_FUN_COMPILED);
+  GC_LEAVE();
+  eFun->value.compiled.fun = fun;
+  eFun->value.compiled.funFrame = captured;
+  eFun->value.compiled.arity = arity;
+  return eFun;
+}
+
+Term* CompiledString(MemPool* pool, const char* text, int len) {
+  Term* s = NewAtom(pool, T_STRING);
+  s->value.string.text = text;
+  s->value.string.len = len;
+  return s;
+}
+
+Term* CompiledBigNum(MemPool* pool, int negative, int len, const uint32_t* limbs) {
+  BigNum* big = NewBigNum(pool, len);
+  big->negative = negative;
+  memcpy(big->limbs, limbs, len * sizeof(uint32_t));
+  return (Term*)big;
+}
@@ -0,0 +1,354 @@
+/*
+A generational garbage collector.
+
+New objects are bump-allocated in the nursery. When the nursery
+fills up, a minor collection copies every nursery object that is
+still reachable into the old generation (each object is promoted
+the first time it survives), and the nursery is then reused from
+the start.
+
+The old generation is collected by mark and sweep, so old objects
+never move. A major collection runs after a minor one whenever
+the old generation has grown past a threshold that adapts to the
+amount of live data. Old objects are kept in typed pages (see
+alloc.c), except for large ones, which are allocated one by one.
+
+Roots are the variables registered on the shadow stack (gcRoots),
+the root scanners (e.g. the VM's value stack) and, during a minor
+collection, the remembered set: old objects that were modified to
+point to young ones (see GC_WRITE_BARRIER).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "datatype.h"
+
+#define NURSERY_SIZE 0x100000 // 1 MB
+#define MIN_MAJOR_THRESHOLD 0x800000 // 8 MB
+
+/* Objects at least this big are allocated in the old generation
+   directly instead of being copied out of the nursery later. */
+#define LARGE_OBJECT_SIZE (NURSERY_SIZE / 4)
+
+/* A large object in the old generation. */
+typedef struct OldObject {
+  struct OldObject* next;
+  size_t size;
+  /* The object itself follows. */
+} OldObject;
+
+typedef struct RootScannerEntry {
+  GcRootScanner scanner;
+  void* data;
+} RootScannerEntry;
+
+/* A growable stack of objects. */
+typedef struct ObjectStack {
+  GcObject** objects;
+  int count;
+  int capacity;
+} ObjectStack;
+
+typedef struct GcStats {
+  unsigned minorCollections;
+  unsigned majorCollections;
+  size_t bytesAllocated;
+  size_t bytesPromoted;
+  size_t bytesFreed;
+  double totalPause; /* Seconds. */
+  double maxPause;   /* Seconds. */
+} GcStats;
+
+int gcActive;
+THREAD_LOCAL void*** gcRoots;
+THREAD_LOCAL int gcRootCount;
+THREAD_LOCAL int gcRootCapacity;
+char* gcNurseryStart;
+char* gcNurseryEnd;
+
+static char* nurseryNext;
+static OldObject* oldObjects;
+static size_t oldBytes;
+static size_t majorThreshold = MIN_MAJOR_THRESHOLD;
+static RootScannerEntry rootScanners[16];
+static int rootScannerCount;
+static ObjectStack rememberedSet;
+static ObjectStack greyObjects; /* Promoted or marked, not yet scanned. */
+static GcStats stats;
+
+void GcInit() {
+  if (gcNurseryStart)
+    return;
+  gcNurseryStart = (char*)Alloc(NURSERY_SIZE);
+  gcNurseryEnd = gcNurseryStart + NURSERY_SIZE;
+  nurseryNext = gcNurseryStart;
+}
+
+void GcGrowRoots() {
+  gcRootCapacity = gcRootCapacity ? gcRootCapacity * 2 : 256;
+  gcRoots = (void***)Realloc(gcRoots, gcRootCapacity * sizeof(void**));
+}
+
+void GcPushRootScanner(GcRootScanner scanner, void* data) {
+  if (rootScannerCount == sizeof(rootScanners) / sizeof(rootScanners[0])) {
+    Die("Too many GC root scanners.");
+  }
+  rootScanners[rootScannerCount].scanner = scanner;
+  rootScanners[rootScannerCount].data = data;
+  rootScannerCount++;
+}
+
+void GcPopRootScanner() {
+  assert(rootScannerCount > 0);
+  rootScannerCount--;
+}
+
+static void PushObject(ObjectStack* stack, GcObject* obj) {
+  if (stack->count == stack->capacity) {
+    stack->capacity = stack->capacity ? stack->capacity * 2 : 256;
+    stack->objects = (GcObject**)Realloc(stack->objects,
+        stack->capacity * sizeof(GcObject*));
+  }
+  stack->objects[stack->count++] = obj;
+}
+
+void GcRemember(GcObject* obj) {
+  obj->gcInfo.bits |= GC_REMEMBERED;
+  PushObject(&rememberedSet, obj);
+}
+
+static size_t ObjectSize(GcObject* obj) {
+  if (obj->type == T_FRAME) {
+    int size = ((Frame*)obj)->size;
+    return sizeof(Frame) + (size > 0 ? size - 1 : 0) * sizeof(Term*);
+  }
+  if (obj->type == T_CONS && ((Term*)obj)->cdrCode != CDR_NORMAL) {
+    return CDR_CELL_SIZE;
+  }
+  if (obj->type == T_BIGNUM) {
+    return sizeof(BigNum) + (((BigNum*)obj)->len - 1) * sizeof(uint32_t);
+  }
+  return TermSize(obj->type);
+}
+
+static size_t RoundUp(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+static void VisitChildren(GcObject* obj, GcVisitor visit) {
+  switch (obj->type) {
+    case T_CONS: {
+      Term* term = (Term*)obj;
+      visit((void**)&term->value.list.head);
+      if (term->cdrCode == CDR_NORMAL)
+        visit((void**)&term->value.list.tail);
+      break;
+    }
+    case T_FUN_USER:
+    case T_FUN_MACRO: {
+      Term* term = (Term*)obj;
+      visit((void**)&term->value.udf.funBody);
+      visit((void**)&term->value.udf.funArgs);
+      visit((void**)&term->value.udf.funFrame);
+      break;
+    }
+    case T_FUN_COMPILED: {
+      Term* term = (Term*)obj;
+      visit((void**)&term->value.compiled.funFrame);
+      break;
+    }
+    case T_FRAME: {
+      Frame* frame = (Frame*)obj;
+      visit((void**)&frame->parent);
+      for (int i = 0; i < frame->size; i++) {
+        visit((void**)&frame->slots[i]);
+      }
+      break;
+    }
+    default:
+      /* Nothing else points to collected objects. */
+      break;
+  }
+}
+
+static void VisitRoots(GcVisitor visit) {
+  for (int i = 0; i < gcRootCount; i++) {
+    visit(gcRoots[i]);
+  }
+  for (int i = 0; i < rootScannerCount; i++) {
+    rootScanners[i].scanner(rootScanners[i].data, visit);
+  }
+}
+
+static GcObject* AllocLarge(size_t size) {
+  OldObject* header = (OldObject*)Alloc(sizeof(OldObject) + size);
+  header->next = oldObjects;
+  header->size = size;
+  oldObjects = header;
+  oldBytes += size;
+  return (GcObject*)(header + 1);
+}
+
+/* Allocate in the old generation. Objects go in a typed page
+   unless they're too big or the pages have run out. */
+static GcObject* AllocOld(DataType type, size_t size) {
+  size = RoundUp(size);
+  GcObject* obj = (GcObject*)AllocTyped(type, size);
+  if (!obj)
+    return AllocLarge(size);
+  oldBytes += size;
+  return obj;
+}
+
+/* Minor collection: promote a young object, if it hasn't
+   been already, and update the slot to point to the copy. */
+static void ForwardSlot(void** slot) {
+  GcObject* obj = (GcObject*)*slot;
+  if (!GC_IS_YOUNG(obj))
+    return;
+  if (!(obj->gcInfo.bits & GC_FORWARDED)) {
+    size_t size;
+    GcObject* copy;
+    if (obj->type == T_CONS && ((Term*)obj)->cdrCode != CDR_NORMAL) {
+      /* A compact cons cell only makes sense next to the rest
+         of its run, so it's expanded into an ordinary one. Its
+         tail is still young, and is promoted when the copy is
+         scanned. */
+      Term* cell = (Term*)obj;
+      Term* expanded = (Term*)AllocOld(T_CONS, CONS_SIZE);
+      expanded->type = T_CONS;
+      expanded->cdrCode = CDR_NORMAL;
+      expanded->value.list.head = cell->value.list.head;
+      expanded->value.list.tail = TAIL(cell);
+      copy = (GcObject*)expanded;
+      size = CONS_SIZE;
+    } else {
+      size = ObjectSize(obj);
+      copy = AllocOld(obj->type, size);
+      memcpy(copy, obj, size);
+    }
+    copy->gcInfo.bits = GC_OLD;
+    stats.bytesPromoted += size;
+    obj->gcInfo.bits |= GC_FORWARDED;
+    obj->forward = copy;
+    PushObject(&greyObjects, copy);
+  }
+  *slot = obj->forward;
+}
+
+static void MinorCollection() {
+  VisitRoots(ForwardSlot);
+  for (int i = 0; i < rememberedSet.count; i++) {
+    GcObject* obj = rememberedSet.objects[i];
+    obj->gcInfo.bits &= ~GC_REMEMBERED;
+    VisitChildren(obj, ForwardSlot);
+  }
+  rememberedSet.count = 0;
+  while (greyObjects.count > 0) {
+    VisitChildren(greyObjects.objects[--greyObjects.count], ForwardSlot);
+  }
+  nurseryNext = gcNurseryStart;
+  stats.minorCollections++;
+}
+
+/* Major collection: mark an old object. Static objects and
+   immediate values are skipped; the nursery is always empty
+   during a major collection. */
+static void MarkSlot(void** slot) {
+  GcObject* obj = (GcObject*)*slot;
+  if (!IS_BOXED(obj) || (obj->gcInfo.bits & (GC_OLD | GC_MARKED)) != GC_OLD)
+    return;
+  obj->gcInfo.bits |= GC_MARKED;
+  PushObject(&greyObjects, obj);
+}
+
+static void MajorCollection() {
+  VisitRoots(MarkSlot);
+  while (greyObjects.count > 0) {
+    VisitChildren(greyObjects.objects[--greyObjects.count], MarkSlot);
+  }
+  OldObject** link = &oldObjects;
+  while (*link) {
+    OldObject* header = *link;
+    GcObject* obj = (GcObject*)(header + 1);
+    if (obj->gcInfo.bits & GC_MARKED) {
+      obj->gcInfo.bits &= ~GC_MARKED;
+      link = &header->next;
+    } else {
+      *link = header->next;
+      oldBytes -= header->size;
+      stats.bytesFreed += header->size;
+      free(header);
+    }
+  }
+  size_t typedBytesFreed = SweepTypedPages();
+  oldBytes -= typedBytesFreed;
+  stats.bytesFreed += typedBytesFreed;
+  majorThreshold = 2 * oldBytes;
+  if (majorThreshold < MIN_MAJOR_THRESHOLD)
+    majorThreshold = MIN_MAJOR_THRESHOLD;
+  stats.majorCollections++;
+}
+
+void GcCollect() {
+  clock_t start = clock();
+  MinorCollection();
+  if (oldBytes > majorThreshold) {
+    MajorCollection();
+  }
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  stats.totalPause += pause;
+  if (pause > stats.maxPause)
+    stats.maxPause = pause;
+}
+
+static int NurseryHasRoom(size_t size) {
+  return size >= LARGE_OBJECT_SIZE || nurseryNext + size <= gcNurseryEnd;
+}
+
+/* Whether an object of the given size can be allocated without
+   triggering a collection. Allocators that hold pointers in
+   unregistered variables use this to decide whether they need
+   to register them and collect first.
+
+   Define GC_STRESS to collect before every allocation. */
+int GcHasRoom(size_t size) {
+#ifdef GC_STRESS
+  return 0;
+#else
+  return NurseryHasRoom(RoundUp(size));
+#endif
+}
+
+/* Allocate a collected object. This may trigger a collection.
+   The caller fills in the header. */
+void* GcAlloc(size_t size) {
+  size = RoundUp(size);
+  stats.bytesAllocated += size;
+  if (size >= LARGE_OBJECT_SIZE) {
+    GcObject* obj = AllocLarge(size);
+    obj->gcInfo.bits = GC_OLD;
+    return obj;
+  }
+  if (!NurseryHasRoom(size)) {
+    GcCollect();
+  }
+  GcObject* obj = (GcObject*)nurseryNext;
+  nurseryNext += size;
+  obj->gcInfo.bits = 0;
+  return obj;
+}
+
+void GcPrintStats(FILE* f) {
+  fprintf(f, "GC: %u minor, %u major collections\n",
+      stats.minorCollections, stats.majorCollections);
+  fprintf(f, "GC: %lu bytes allocated, %lu promoted, %lu freed\n",
+      (unsigned long)stats.bytesAllocated,
+      (unsigned long)stats.bytesPromoted,
+      (unsigned long)stats.bytesFreed);
+  fprintf(f, "GC: %.3f ms total pause, %.3f ms max pause\n",
+      stats.totalPause * 1000, stats.maxPause * 1000);
+}
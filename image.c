@@ -0,0 +1,559 @@
+/*
+Heap images.
+
+An image holds a parsed program together with the interned symbols
+and the global environment, laid out the way they are in memory,
+so that a later run can map the file and start evaluating without
+lexing, parsing or building the environment.
+
+The image is position independent. Every pointer in it is stored
+as an offset from the start of the image, and listed in a
+relocation table; loading adds the address that the image was
+mapped at to each one. Pointers to native functions are stored as
+indexes into the table of native functions in builtins.c, and
+listed in a second table. Since those indexes (and the layout of
+terms) can change from one build to the next, an image can only be
+loaded by the build that wrote it, as far as the header can tell.
+
+Lists are written as CDR-coded runs. A list that shares its tail
+with another is written twice, which the parser never produces.
+
+The image is mapped copy-on-write: the resolver rewrites the
+program in place, but the file is never changed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "datatype.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#define IMAGE_MAGIC "BSIMAGE"
+#define IMAGE_VERSION 1
+
+typedef struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t termSize;    /* sizeof(Term), as a check on the layout. */
+  uint32_t nativeTableSize; /* Entries in the table of native functions. */
+  uint32_t symbolCount;
+  uint64_t size;        /* Of the whole image, header included. */
+  /* The rest are offsets from the start of the image. */
+  uint64_t symbols;     /* Pointers to each interned symbol. */
+  uint64_t env;         /* The first Env node. */
+  uint64_t program;     /* The list of top-level forms. */
+  uint64_t relocations; /* Offsets of the pointers in the image. */
+  uint64_t relocationCount;
+  uint64_t nativeFixups; /* Where the native function pointers go. */
+  uint64_t nativeFixupCount;
+} ImageHeader;
+
+/* A word in the image that holds a native function pointer. */
+typedef struct NativeFixup {
+  uint64_t offset;
+  uint64_t index;
+} NativeFixup;
+
+typedef struct ImageWriter {
+  char* buf;
+  size_t len;
+  size_t capacity;
+  uint64_t* relocations;
+  size_t relocationCount;
+  size_t relocationCapacity;
+  NativeFixup* natives;
+  size_t nativeCount;
+  size_t nativeCapacity;
+  /* Objects already written: address to offset. */
+  void** seenObjects;
+  size_t* seenOffsets;
+  size_t seenCount;
+  size_t seenCapacity; /* A power of two. */
+} ImageWriter;
+
+static size_t RoundUp8(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+/* Reserve space at the end of the image, zeroed. */
+static size_t Reserve(ImageWriter* w, size_t size) {
+  size = RoundUp8(size);
+  if (w->len + size > w->capacity) {
+    while (w->len + size > w->capacity)
+      w->capacity = w->capacity ? w->capacity * 2 : 0x10000;
+    w->buf = (char*)Realloc(w->buf, w->capacity);
+  }
+  size_t offset = w->len;
+  memset(w->buf + offset, 0, size);
+  w->len += size;
+  return offset;
+}
+
+static void PutWord(ImageWriter* w, size_t offset, uintptr_t value) {
+  memcpy(w->buf + offset, &value, sizeof(value));
+}
+
+/* Store a pointer to the object at target in the word at offset. */
+static void PutPointer(ImageWriter* w, size_t offset, size_t target) {
+  PutWord(w, offset, target);
+  if (w->relocationCount == w->relocationCapacity) {
+    w->relocationCapacity = w->relocationCapacity ? w->relocationCapacity * 2 : 256;
+    w->relocations = (uint64_t*)Realloc(w->relocations,
+        w->relocationCapacity * sizeof(uint64_t));
+  }
+  w->relocations[w->relocationCount++] = offset;
+}
+
+static void PutNative(ImageWriter* w, size_t offset, void* fun) {
+  if (!fun)
+    return;
+  if (w->nativeCount == w->nativeCapacity) {
+    w->nativeCapacity = w->nativeCapacity ? w->nativeCapacity * 2 : 64;
+    w->natives = (NativeFixup*)Realloc(w->natives,
+        w->nativeCapacity * sizeof(NativeFixup));
+  }
+  w->natives[w->nativeCount].offset = offset;
+  w->natives[w->nativeCount].index = NativeFunctionIndex(fun);
+  w->nativeCount++;
+}
+
+static size_t HashAddress(void* p) {
+  uintptr_t h = (uintptr_t)p >> 3;
+  return (size_t)(h * 0x9E3779B97F4A7C15ull);
+}
+
+static void Remember(ImageWriter* w, void* obj, size_t offset);
+
+static void GrowSeen(ImageWriter* w) {
+  void** oldObjects = w->seenObjects;
+  size_t* oldOffsets = w->seenOffsets;
+  size_t oldCapacity = w->seenCapacity;
+  w->seenCapacity = oldCapacity ? oldCapacity * 2 : 1024;
+  w->seenObjects = (void**)Alloc(w->seenCapacity * sizeof(void*));
+  w->seenOffsets = (size_t*)Alloc(w->seenCapacity * sizeof(size_t));
+  memset(w->seenObjects, 0, w->seenCapacity * sizeof(void*));
+  w->seenCount = 0;
+  for (size_t i = 0; i < oldCapacity; i++) {
+    if (oldObjects[i])
+      Remember(w, oldObjects[i], oldOffsets[i]);
+  }
+  free(oldObjects);
+  free(oldOffsets);
+}
+
+static void Remember(ImageWriter* w, void* obj, size_t offset) {
+  if (2 * (w->seenCount + 1) > w->seenCapacity)
+    GrowSeen(w);
+  size_t mask = w->seenCapacity - 1;
+  size_t i = HashAddress(obj) & mask;
+  while (w->seenObjects[i])
+    i = (i + 1) & mask;
+  w->seenObjects[i] = obj;
+  w->seenOffsets[i] = offset;
+  w->seenCount++;
+}
+
+/* The offset the object was written at, or 0 if it hasn't been. */
+static size_t Seen(ImageWriter* w, void* obj) {
+  if (!w->seenCapacity)
+    return 0;
+  size_t mask = w->seenCapacity - 1;
+  for (size_t i = HashAddress(obj) & mask; w->seenObjects[i]; i = (i + 1) & mask) {
+    if (w->seenObjects[i] == obj)
+      return w->seenOffsets[i];
+  }
+  return 0;
+}
+
+static size_t WriteTerm(ImageWriter* w, Term* term);
+
+/* Store a term in the word at offset, writing it if need be. */
+static void PutTerm(ImageWriter* w, size_t offset, Term* term) {
+  if (!IS_BOXED(term)) {
+    PutWord(w, offset, (uintptr_t)term);
+    return;
+  }
+  size_t target = WriteTerm(w, term);
+  PutPointer(w, offset, target);
+}
+
+static size_t WriteBytes(ImageWriter* w, const char* bytes, size_t len) {
+  size_t offset = Reserve(w, len + 1); /* Null-terminated. */
+  memcpy(w->buf + offset, bytes, len);
+  return offset;
+}
+
+static size_t NewTerm(ImageWriter* w, Term* term, size_t size) {
+  size_t offset = Reserve(w, size);
+  Term* copy = (Term*)(w->buf + offset);
+  copy->type = term->type;
+  return offset;
+}
+
+#define TERM_FIELD(FIELD) offsetof(Term, FIELD)
+
+static size_t WriteList(ImageWriter* w, Term* list) {
+  int count = 0;
+  Term* node;
+  for (node = list; IS_CONS(node); node = TAIL(node))
+    count++;
+  Term* end = node;
+  /* An improper list ends with an ordinary cell, to hold the tail. */
+  size_t size = (count - 1) * CDR_CELL_SIZE + (end ? CONS_SIZE : CDR_CELL_SIZE);
+  size_t offset = Reserve(w, size);
+  Remember(w, list, offset);
+  node = list;
+  for (int i = 0; i < count; i++, node = TAIL(node)) {
+    size_t cell = offset + i * CDR_CELL_SIZE;
+    Term* copy = (Term*)(w->buf + cell);
+    copy->type = T_CONS;
+    copy->cdrCode = i < count - 1 ? CDR_NEXT : end ? CDR_NORMAL : CDR_NIL;
+    PutTerm(w, cell + TERM_FIELD(value.list.head), HEAD(node));
+  }
+  if (end) {
+    PutTerm(w, offset + (count - 1) * CDR_CELL_SIZE + TERM_FIELD(value.list.tail), end);
+  }
+  return offset;
+}
+
+static size_t WriteTerm(ImageWriter* w, Term* term) {
+  size_t offset = Seen(w, term);
+  if (offset)
+    return offset;
+  switch (term->type) {
+    case T_CONS:
+      return WriteList(w, term);
+    case T_SYMBOL:
+    case T_STRING: {
+      offset = NewTerm(w, term, TermSize(term->type));
+      Remember(w, term, offset);
+      size_t text = WriteBytes(w, term->value.string.text, term->value.string.len);
+      PutPointer(w, offset + TERM_FIELD(value.string.text), text);
+      ((Term*)(w->buf + offset))->value.string.len = term->value.string.len;
+      return offset;
+    }
+    case T_BIGNUM: {
+      BigNum* big = (BigNum*)term;
+      size_t size = sizeof(BigNum) + (big->len - 1) * sizeof(uint32_t);
+      offset = Reserve(w, size);
+      Remember(w, term, offset);
+      memcpy(w->buf + offset, big, size);
+      ((BigNum*)(w->buf + offset))->gcInfo.bits = 0;
+      return offset;
+    }
+    case T_FUN_NATIVE: {
+      offset = NewTerm(w, term, TermSize(term->type));
+      Remember(w, term, offset);
+      const char* name = term->value.bif.funName;
+      size_t nameOffset = WriteBytes(w, name, strlen(name));
+      PutPointer(w, offset + TERM_FIELD(value.bif.funName), nameOffset);
+      PutNative(w, offset + TERM_FIELD(value.bif.funPtr),
+                (void*)term->value.bif.funPtr);
+      PutNative(w, offset + TERM_FIELD(value.bif.arrayFunPtr),
+                (void*)term->value.bif.arrayFunPtr);
+      Term* copy = (Term*)(w->buf + offset);
+      copy->value.bif.arity = term->value.bif.arity;
+      copy->value.bif.pure = term->value.bif.pure;
+      return offset;
+    }
+    default:
+      DieShowingTerm("Can't write this term to an image", term);
+  }
+}
+
+static size_t WriteEnv(ImageWriter* w, Env* env) {
+  size_t first = 0;
+  size_t previous = 0;
+  for (; env; env = env->next) {
+    size_t node = Reserve(w, sizeof(Env));
+    if (previous) {
+      PutPointer(w, previous + offsetof(Env, next), node);
+    } else {
+      first = node;
+    }
+    PutTerm(w, node + offsetof(Env, name), env->name);
+    PutTerm(w, node + offsetof(Env, value), env->value);
+    previous = node;
+  }
+  return first;
+}
+
+/* Write the program and the global environment, with every
+   interned symbol, to an image file. */
+/* Returns 0 if the file couldn't be written. */
+static int WriteImage(const char* filename, Term* program, Env* env) {
+  ImageWriter w;
+  memset(&w, 0, sizeof(w));
+  size_t header = Reserve(&w, sizeof(ImageHeader));
+  int symbolCount;
+  Term** symbols = InternedSymbols(&symbolCount);
+  size_t symbolTable = Reserve(&w, symbolCount * sizeof(Term*));
+  for (int i = 0; i < symbolCount; i++) {
+    PutTerm(&w, symbolTable + i * sizeof(Term*), symbols[i]);
+  }
+  free(symbols);
+  size_t envOffset = WriteEnv(&w, env);
+  size_t programOffset = Reserve(&w, sizeof(Term*));
+  PutTerm(&w, programOffset, program);
+  size_t relocations = Reserve(&w, w.relocationCount * sizeof(uint64_t));
+  memcpy(w.buf + relocations, w.relocations, w.relocationCount * sizeof(uint64_t));
+  size_t natives = Reserve(&w, w.nativeCount * sizeof(NativeFixup));
+  memcpy(w.buf + natives, w.natives, w.nativeCount * sizeof(NativeFixup));
+
+  ImageHeader* h = (ImageHeader*)(w.buf + header);
+  memcpy(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  h->version = IMAGE_VERSION;
+  h->termSize = sizeof(Term);
+  h->nativeTableSize = NativeFunctionCount();
+  h->symbolCount = symbolCount;
+  h->size = w.len;
+  h->symbols = symbolTable;
+  h->env = envOffset;
+  h->program = programOffset;
+  h->relocations = relocations;
+  h->relocationCount = w.relocationCount;
+  h->nativeFixups = natives;
+  h->nativeFixupCount = w.nativeCount;
+
+  FILE* f = fopen(filename, "wb");
+  int written = 0;
+  if (f) {
+    written = fwrite(w.buf, 1, w.len, f) == w.len;
+    written = fclose(f) == 0 && written;
+  }
+  free(w.buf);
+  free(w.relocations);
+  free(w.natives);
+  free(w.seenObjects);
+  free(w.seenOffsets);
+  return written;
+}
+
+void SaveImage(const char* filename, Term* program, Env* env) {
+  if (!WriteImage(filename, program, env)) {
+    Die("Error writing image: %s", filename);
+  }
+}
+
+/* Map the file copy-on-write. It's never unmapped. */
+static char* MapImage(const char* filename, size_t* size) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+                            OPEN_EXISTING, 0, 0);
+  if (file == INVALID_HANDLE_VALUE)
+    return 0;
+  LARGE_INTEGER fileSize;
+  char* image = 0;
+  if (GetFileSizeEx(file, &fileSize)) {
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+    if (mapping) {
+      image = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+      CloseHandle(mapping); // The view keeps the mapping alive.
+    }
+  }
+  CloseHandle(file);
+  *size = (size_t)fileSize.QuadPart;
+  return image;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  char* image = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    image = (char*)mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+      image = 0;
+  }
+  close(fd);
+  *size = st.st_size;
+  return image;
+#endif
+}
+
+static void UnmapImage(char* image, size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(image);
+#else
+  munmap(image, size);
+#endif
+}
+
+/* Whether count entries of entrySize bytes at offset lie within
+   the image, after the header. */
+static int InImage(uint64_t offset, uint64_t count, size_t entrySize, size_t size) {
+  return offset >= sizeof(ImageHeader) && offset <= size
+    && count <= (size - offset) / entrySize;
+}
+
+/* Whether every offset that LinkImage follows or writes to lies
+   within the image, so that a damaged file can't make it write
+   outside of the mapping. */
+static int CheckImageOffsets(char* image, size_t size) {
+  ImageHeader* h = (ImageHeader*)image;
+  if (!InImage(h->relocations, h->relocationCount, sizeof(uint64_t), size)
+      || !InImage(h->nativeFixups, h->nativeFixupCount, sizeof(NativeFixup), size)
+      || !InImage(h->symbols, h->symbolCount, sizeof(Term*), size)
+      || !InImage(h->program, 1, sizeof(Term*), size)
+      || (h->env && !InImage(h->env, 1, sizeof(Env), size))) {
+    return 0;
+  }
+  uint64_t* relocations = (uint64_t*)(image + h->relocations);
+  for (uint64_t i = 0; i < h->relocationCount; i++) {
+    uintptr_t target;
+    if (!InImage(relocations[i], 1, sizeof(uintptr_t), size))
+      return 0;
+    memcpy(&target, image + relocations[i], sizeof(target));
+    if (!InImage(target, 1, 1, size))
+      return 0;
+  }
+  NativeFixup* natives = (NativeFixup*)(image + h->nativeFixups);
+  for (uint64_t i = 0; i < h->nativeFixupCount; i++) {
+    if (!InImage(natives[i].offset, 1, sizeof(void*), size)
+        || natives[i].index >= h->nativeTableSize) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Why the image can't be loaded, or null if it can. */
+static const char* CheckImage(char* image, size_t size) {
+  ImageHeader* h = (ImageHeader*)image;
+  if (size < sizeof(ImageHeader) || memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+      || h->size != size) {
+    return "Not an image";
+  }
+  if (h->version != IMAGE_VERSION || h->termSize != sizeof(Term)
+      || h->nativeTableSize != (uint32_t)NativeFunctionCount()) {
+    return "The image was written by a different build";
+  }
+  if (!CheckImageOffsets(image, size)) {
+    return "The image is damaged";
+  }
+  return 0;
+}
+
+static void LinkImage(char* image, Term** program, Env** env) {
+  ImageHeader* h = (ImageHeader*)image;
+  uint64_t* relocations = (uint64_t*)(image + h->relocations);
+  for (uint64_t i = 0; i < h->relocationCount; i++) {
+    *(uintptr_t*)(image + relocations[i]) += (uintptr_t)image;
+  }
+  NativeFixup* natives = (NativeFixup*)(image + h->nativeFixups);
+  for (uint64_t i = 0; i < h->nativeFixupCount; i++) {
+    *(void**)(image + natives[i].offset) = NativeFunctionAt(natives[i].index);
+  }
+  Term** symbols = (Term**)(image + h->symbols);
+  for (uint32_t i = 0; i < h->symbolCount; i++) {
+    AdoptSymbol(symbols[i]);
+  }
+  *env = h->env ? (Env*)(image + h->env) : 0;
+  *program = *(Term**)(image + h->program);
+}
+
+/* Load an image written by SaveImage. Its symbols become the
+   interned symbols, so this must be done before any are interned. */
+void LoadImage(const char* filename, Term** program, Env** env) {
+  size_t size;
+  char* image = MapImage(filename, &size);
+  if (!image) {
+    Die("Unable to map image: %s", filename);
+  }
+  const char* error = CheckImage(image, size);
+  if (error) {
+    Die("%s: %s", error, filename);
+  }
+  LinkImage(image, program, env);
+}
+
+/*
+The image cache.
+
+Loading an image is much faster than lexing and parsing its source,
+so a run given a cache directory keeps the image of each source
+file that it parses there, and the next run of the same source
+loads it instead. Many runs of the same program share the work.
+
+An image is found by the name it's cached under, which is made of a
+hash of the source text and a tag for the build of the interpreter,
+so that a changed source file or a new build is parsed afresh. The
+image holds the parsed program, not the resolved one: resolving
+and expanding macros depend on what the program defines as it runs.
+
+Images are written to a file of their own and renamed into place,
+so that runs sharing the cache never see one half written. Any
+trouble with the cache just means the source is parsed.
+*/
+
+static uint64_t HashBytes(uint64_t h, const void* bytes, size_t len) {
+  const unsigned char* p = (const unsigned char*)bytes;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001B3ull; /* FNV-1a */
+  return h;
+}
+
+#define HASH_SEED 0xCBF29CE484222325ull
+
+/* Changes with anything that SaveImage's header checks, and with
+   each build, since the header can't tell every change. */
+static uint32_t BuildTag() {
+  uint32_t layout[3] = { IMAGE_VERSION, sizeof(Term), NativeFunctionCount() };
+  uint64_t h = HashBytes(HASH_SEED, layout, sizeof(layout));
+  h = HashBytes(h, __DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__));
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/* The file that the image of the source text is cached in. The
+   directory is created if it doesn't exist. The caller frees the
+   name. */
+char* CachedImagePath(const char* cacheDir, const char* code, size_t len) {
+#ifdef _WIN32
+  CreateDirectoryA(cacheDir, 0);
+#else
+  mkdir(cacheDir, 0777);
+#endif
+  size_t size = strlen(cacheDir) + 40;
+  char* path = (char*)Alloc(size);
+  snprintf(path, size, "%s/%016llx-%08x.img", cacheDir,
+           (unsigned long long)HashBytes(HASH_SEED, code, len),
+           (unsigned)BuildTag());
+  return path;
+}
+
+/* Load the cached image, if there is one that this build can use.
+   Returns 0 if there isn't. */
+int LoadCachedImage(const char* path, Term** program, Env** env) {
+  size_t size;
+  char* image = MapImage(path, &size);
+  if (!image)
+    return 0;
+  if (CheckImage(image, size)) {
+    UnmapImage(image, size);
+    return 0;
+  }
+  LinkImage(image, program, env);
+  return 1;
+}
+
+void SaveCachedImage(const char* path, Term* program, Env* env) {
+  size_t size = strlen(path) + 24;
+  char* temp = (char*)Alloc(size);
+#ifdef _WIN32
+  snprintf(temp, size, "%s.%lu", path, (unsigned long)GetCurrentProcessId());
+  if (!WriteImage(temp, program, env)
+      || !MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING)) {
+    remove(temp);
+  }
+#else
+  snprintf(temp, size, "%s.%ld", path, (long)getpid());
+  if (!WriteImage(temp, program, env) || rename(temp, path) != 0) {
+    remove(temp);
+  }
+#endif
+  free(temp);
+}
@@ -6,6 +6,12 @@ interpreted. More generally, the "i" prefix
 identifies something that's being interpreted,
 and an "e" suffix (e.g. "eTerm") is a term
 that has already been evaluated.
+
+Interpreted terms are static (they come from
+the parser) but evaluated terms and frames are
+garbage collected, so any of those that are
+held across an evaluation must be registered
+with GC_ROOT.
 */
 
 #include <stdio.h>
@@ -14,11 +20,20 @@ that has already been evaluated.
 #include <string.h>
 #include <assert.h>
 #include "datatype.h"
+#include "bytecode.h"
 
-static Term* InterpretForm(Term* iTerm, Env* env, MemPool* pool);
-static Term* InterpretString(Term* iTerm, Env* env, MemPool* pool);
-static Term* InterpretNumber(Term* iTerm, Env* env, MemPool* pool);
-static Term* InterpretSymbol(Term* iTerm, Env* env, MemPool* pool);
+static Term* InterpretTerm(Term* iTerm, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretString(Term* iTerm, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretNumber(Term* iTerm, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretSymbol(Term* iTerm, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretLocalRef(Term* iTerm, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretBeginPrefix(Term* iForm, Frame* frame, Env* env, MemPool* pool);
+static Frame* InterpretUdfArgs(Term* eFun, Term* iArgList, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretList(Term* iList, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretBifCall(Term* eFun, Term* iArgList, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretFunctionDef(Term* iFunDef, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretFunDef(Term* iFunDef, Frame* frame, Env* env, MemPool* pool);
+static Term* InterpretQuote(Term* iForm, Frame* frame, Env* env, MemPool* pool);
 
 void Die(const char* message, ...) {
   va_list args;
@@ -42,7 +57,7 @@ void DieShowingTerm(const char* message, Term* term, ...) {
 
 void PrintEnv(FILE* f, Env* env) {
   while (env) {
-    fwrite(env->nameText, 1, env->nameLen, f);
+    PrintTerm(f, env->name);
     fprintf(f, " = ");
     PrintTerm(f, env->value);
     fprintf(f, "\n");
@@ -50,74 +65,191 @@ void PrintEnv(FILE* f, Env* env) {
   }
 }
 
-static Term* InterpretTerm(Term* iTerm, Env* env, MemPool* pool) {
-  if (!iTerm)
-    return 0;
-  switch (iTerm->type) {
-    case T_PRIM_NIL:
-      ; /* Already handled by the null check above. */
-    case T_CONS:
-      return InterpretForm(iTerm, env, pool);
-    case T_STRING:
-      return InterpretString(iTerm, env, pool);
-    case T_NUMBER:
-      return InterpretNumber(iTerm, env, pool);
-    case T_SYMBOL:
-      return InterpretSymbol(iTerm, env, pool);
-    case T_PRIM_FUN:
-    case T_PRIM_QUOTE:
-    case T_PRIM_BEGIN:
-    case T_FUN_NATIVE:
-    case T_FUN_USER:
-    case T_FUN_MACRO:
-      ; /* The parser doesn't generate these. */
-  }
-  Die("Unexpected term type in InterpretTerm.");
-}
-
-static Term* InterpretList(Term* iList, Env* env, MemPool* pool) {
+/* Terms in tail position (the last term of a begin, and the
+   body of a function) are interpreted by going around the loop
+   again instead of by recursing, so a tail call reuses the C
+   stack frame of its caller. While profiling, a tail call
+   likewise takes over its caller's entry in the shadow stack,
+   which is at profileDepth. */
+static Term* InterpretTermLoop(Term* iTerm, Frame* frame, Env* env, MemPool* pool,
+                               int profileDepth) {
+  GC_ENTER();
+  GC_ROOT(frame);
+  for (;;) {
+    if (!iTerm)
+      GC_RETURN(Term*, 0);
+    switch (TYPE_OF(iTerm)) {
+      case T_PRIM_NIL:
+        ; /* Already handled by the null check above. */
+      case T_CONS:
+        break; /* Handled below. */
+      case T_STRING:
+        GC_RETURN(Term*, InterpretString(iTerm, frame, env, pool));
+      case T_NUMBER:
+      case T_BIGNUM:
+        GC_RETURN(Term*, InterpretNumber(iTerm, frame, env, pool));
+      case T_SYMBOL:
+        GC_RETURN(Term*, InterpretSymbol(iTerm, frame, env, pool));
+      case T_LOCAL_REF:
+        GC_RETURN(Term*, InterpretLocalRef(iTerm, frame, env, pool));
+      case T_GLOBAL_REF:
+        GC_RETURN(Term*, GLOBAL_REF_VALUE(iTerm, env));
+      case T_FUN_DEF:
+        GC_RETURN(Term*, InterpretFunDef(iTerm, frame, env, pool));
+      case T_LITERAL:
+        GC_RETURN(Term*, iTerm->value.literal.value);
+      case T_PRIM_FUN:
+      case T_PRIM_QUOTE:
+      case T_PRIM_BEGIN:
+      case T_PRIM_BOOL:
+      case T_PRIM_DEFMACRO:
+      case T_FUN_NATIVE:
+      case T_FUN_USER:
+      case T_FUN_MACRO:
+      case T_FUN_COMPILED:
+      case T_FRAME:
+        /* The parser doesn't generate these. */
+        Die("Unexpected term type in InterpretTerm.");
+    }
+    /* A call to a builtin through a valid inline cache needs
+       neither the lookup nor the dispatch below. */
+    Term* iHead = HEAD(iTerm);
+    if (IS_GLOBAL_REF(iHead) && iHead->value.globalRef.version == envVersion
+        && iHead->value.globalRef.native) {
+      GC_RETURN(Term*, InterpretBifCall(iHead->value.globalRef.native,
+                                        TAIL(iTerm), frame, env, pool));
+    }
+    /* Interpret the head first, then the head determines
+       the interpretation of the rest of the form. */
+    Term* eHead = InterpretTerm(iHead, frame, env, pool);
+    if (!eHead) {
+      DieShowingTerm("Invalid form", iTerm);
+    }
+    switch (TYPE_OF(eHead)) {
+      case T_PRIM_QUOTE:
+        GC_RETURN(Term*, InterpretQuote(TAIL(iTerm), frame, env, pool));
+      case T_PRIM_BEGIN:
+        iTerm = InterpretBeginPrefix(TAIL(iTerm), frame, env, pool);
+        break;
+      case T_FUN_NATIVE:
+        GC_RETURN(Term*, InterpretBifCall(eHead, TAIL(iTerm), frame, env, pool));
+      case T_FUN_USER: {
+        /* Evaluating the arguments may move the function. */
+        Term* funBody = eHead->value.udf.funBody;
+        frame = InterpretUdfArgs(eHead, TAIL(iTerm), frame, env, pool);
+        if (profiling) {
+          ProfileEnter(profileDepth, funBody);
+        }
+        iTerm = InterpretBeginPrefix(funBody, frame, env, pool);
+        break;
+      }
+      case T_PRIM_FUN:
+        GC_RETURN(Term*, InterpretFunctionDef(TAIL(iTerm), frame, env, pool));
+      default:
+        DieShowingTerm("Invalid form", iTerm);
+    }
+  }
+}
+
+static Term* InterpretTerm(Term* iTerm, Frame* frame, Env* env, MemPool* pool) {
+  if (!profiling)
+    return InterpretTermLoop(iTerm, frame, env, pool, 0);
+  int depth = ProfileDepth();
+  Term* eResult = InterpretTermLoop(iTerm, frame, env, pool, depth);
+  ProfileLeave(depth);
+  return eResult;
+}
+
+/* Evaluated list elements wait here until the whole list can be
+   allocated as a CDR-coded run. The collector scans it. Each
+   thread has its own (see pmap). */
+static THREAD_LOCAL Term** valueStack;
+static THREAD_LOCAL int valueStackCount;
+static THREAD_LOCAL int valueStackCapacity;
+
+static void VisitValueStack(void* data, GcVisitor visit) {
+  for (int i = 0; i < valueStackCount; i++) {
+    visit((void**)&valueStack[i]);
+  }
+}
+
+static void PushValue(Term* eValue) {
+  if (valueStackCount == valueStackCapacity) {
+    valueStackCapacity = valueStackCapacity ? valueStackCapacity * 2 : 256;
+    valueStack = (Term**)Realloc(valueStack, valueStackCapacity * sizeof(Term*));
+  }
+  valueStack[valueStackCount++] = eValue;
+}
+
+static Term* InterpretList(Term* iList, Frame* frame, Env* env, MemPool* pool) {
   /* Shortcut for lists with no elements. */
   if (!iList) {
     return 0;
   }
+  GC_ENTER();
+  GC_ROOT(frame);
   /* Evaluate list elements in left-to-right order. */
-  Term* eListHead = NewCons(pool, InterpretTerm(HEAD(iList), env, pool), 0);
-  Term* eListLast = eListHead;
-  Term* iListNode = TAIL(iList);
-  while (iListNode) {
-    eListLast->value.list.tail =
-      NewCons(pool, InterpretTerm(HEAD(iListNode), env, pool), 0);
-    eListLast = TAIL(eListLast);
-    iListNode = TAIL(iListNode);
+  int firstValue = valueStackCount;
+  while (iList) {
+    PushValue(InterpretTerm(HEAD(iList), frame, env, pool));
+    iList = TAIL(iList);
   }
-  return eListHead;
+  Term* eList = NewList(pool, valueStack + firstValue, valueStackCount - firstValue);
+  valueStackCount = firstValue;
+  GC_RETURN(Term*, eList);
+}
+
+/* Call a builtin that takes an argument array, with arguments
+   that have been pushed on the value stack from firstValue up. */
+static Term* CallArrayBif(Term* eFun, int firstValue, MemPool* pool) {
+  int argc = valueStackCount - firstValue;
+  CheckNativeArity(eFun, argc);
+  Term* eResult = eFun->value.bif.arrayFunPtr(argc, valueStack + firstValue, pool);
+  valueStackCount = firstValue;
+  return eResult;
 }
 
-static Term* InterpretBifCall(Term* eFun, Term* iArgList, Env* env, MemPool* pool) {
+/* Builtins are allocated from a pool, so they don't move. */
+static Term* InterpretBifCall(Term* eFun, Term* iArgList, Frame* frame, Env* env, MemPool* pool) {
   assert(IS_FUN_NATIVE(eFun));
-  Term* eArgList = InterpretList(iArgList, env, pool);
-  return eFun->value.bif.funPtr(eArgList);
+  if (eFun->value.bif.arrayFunPtr) {
+    GC_ENTER();
+    GC_ROOT(frame);
+    int firstValue = valueStackCount;
+    for (; iArgList; iArgList = TAIL(iArgList)) {
+      PushValue(InterpretTerm(HEAD(iArgList), frame, env, pool));
+    }
+    GC_RETURN(Term*, CallArrayBif(eFun, firstValue, pool));
+  }
+  Term* eArgList = InterpretList(iArgList, frame, env, pool);
+  return eFun->value.bif.funPtr(eArgList, pool);
 }
 
-static Term* InterpretUdfCall(Term* eFun, Term* iArgList, Env* env, MemPool* pool) {
+/* Build the frame for a call to a user function. The caller
+   then interprets the function body in that frame. */
+static Frame* InterpretUdfArgs(Term* eFun, Term* iArgList, Frame* frame, Env* env, MemPool* pool) {
   assert(IS_FUN_USER(eFun));
-  Term* eArgList = InterpretList(iArgList, env, pool);
-  /* Bind function arguments. */
-  Env* callEnv = eFun->value.udf.funEnv;
-  Term* funArgNames = eFun->value.udf.funArgs;
-  while (funArgNames) {
-    if (eArgList == NULL) {
-      Die("Too few arguments to function.");
+  /* Evaluate the arguments straight into the slots
+     of the new frame. */
+  int arity = ListLength(eFun->value.udf.funArgs);
+  GC_ENTER();
+  GC_ROOT(frame);
+  Frame* callFrame = NewFrame(pool, eFun->value.udf.funFrame, arity);
+  GC_ROOT(callFrame);
+  int nArgs = 0;
+  while (iArgList) {
+    if (nArgs == arity) {
+      Die("Too many arguments to function.");
     }
-    callEnv = EnvBind(pool, env, HEAD(funArgNames), HEAD(eArgList));
-    eArgList = TAIL(eArgList);
-    funArgNames = TAIL(funArgNames);
+    Term* eArg = InterpretTerm(HEAD(iArgList), frame, env, pool);
+    callFrame->slots[nArgs++] = eArg;
+    GC_WRITE_BARRIER(callFrame, eArg);
+    iArgList = TAIL(iArgList);
   }
-  if (eArgList != NULL) {
-    Die("Too many arguments to function.");
+  if (nArgs < arity) {
+    Die("Too few arguments to function.");
   }
-  /* Invoke the function body. */
-  return InterpretTerm(eFun->value.udf.funBody, callEnv, pool);
+  GC_RETURN(Frame*, callFrame);
 }
 
 static void ValidateFunArgDecls(Term* funArgDecls) {
@@ -129,7 +261,48 @@ static void ValidateFunArgDecls(Term* funArgDecls) {
   }
 }
 
-static Term* InterpretFunctionDef(Term* iFunDef, Env* env, MemPool* pool) {
+static Term* NewClosure(Term* funArgs, Term* funBody, Frame* captured, MemPool* pool) {
+  GC_ENTER();
+  GC_ROOT(captured);
+  Term* eFun = NewAtom(pool, T_FUN_USER);
+  GC_LEAVE();
+  //eFun->value.udf.funName = funName;
+  eFun->value.udf.funBody = funBody;
+  eFun->value.udf.funArgs = funArgs;
+  eFun->value.udf.funFrame = captured;
+  eFun->value.udf.funCode = 0;
+  return eFun;
+}
+
+/* A function definition that the resolver has analyzed (see
+   resolve.c). The closure gets a copy of the variables it uses
+   from the enclosing functions, and nothing else. */
+static Term* InterpretFunDef(Term* iFunDef, Frame* frame, Env* env, MemPool* pool) {
+  assert(IS_FUN_DEF(iFunDef));
+  int captureCount = iFunDef->value.funDef.captureCount;
+  Frame* captured = 0;
+  if (captureCount > 0) {
+    GC_ENTER();
+    GC_ROOT(frame);
+    captured = NewFrame(pool, 0, captureCount);
+    GC_LEAVE();
+    Term* iCapture = iFunDef->value.funDef.captures;
+    for (int i = 0; i < captureCount; i++) {
+      Term* eValue = InterpretLocalRef(HEAD(iCapture), frame, env, pool);
+      captured->slots[i] = eValue;
+      GC_WRITE_BARRIER(captured, eValue);
+      iCapture = TAIL(iCapture);
+    }
+  }
+  return NewClosure(iFunDef->value.funDef.funArgs,
+                    iFunDef->value.funDef.funBody, captured, pool);
+}
+
+/* A function definition that the resolver didn't see as one,
+   because fun wasn't known to be at the head of the form. Its
+   body wasn't resolved, so it can't refer to local variables and
+   the closure captures nothing. */
+static Term* InterpretFunctionDef(Term* iFunDef, Frame* frame, Env* env, MemPool* pool) {
   if (!iFunDef) {
     Die("Empty function definition.");
   }
@@ -147,16 +320,10 @@ static Term* InterpretFunctionDef(Term* iFunDef, Env* env, MemPool* pool) {
   if (!funBody) {
     Die("Function body missing.");
   }
-  Term* eFunDef = (Term*)Alloc(sizeof(Term));
-  eFunDef->type = T_FUN_USER;
-  //eFunDef->value.udf.funName = funName;
-  eFunDef->value.udf.funBody = funBody;
-  eFunDef->value.udf.funArgs = funArgDecls;
-  eFunDef->value.udf.funEnv = env;
-  return eFunDef;
+  return NewClosure(funArgDecls, funBody, 0, pool);
 }
 
-static Term* InterpretQuote(Term* iForm, Env* env, MemPool* pool) {
+static Term* InterpretQuote(Term* iForm, Frame* frame, Env* env, MemPool* pool) {
   if (!iForm) {
     Die("Empty quote form.");
   }
@@ -169,55 +336,34 @@ static Term* InterpretQuote(Term* iForm, Env* env, MemPool* pool) {
   return iQuotedTerm;
 }
 
-static Term* InterpretBegin(Term* iForm, Env* env, MemPool* pool) {
+/* Interpret all but the last term of a begin form. The last
+   term is in tail position, so it's returned uninterpreted. */
+static Term* InterpretBeginPrefix(Term* iForm, Frame* frame, Env* env, MemPool* pool) {
   if (!iForm) {
     return 0;
   }
-  for (;;) {
-    Term* eFormHead = InterpretTerm(HEAD(iForm), env, pool);
-    if (!TAIL(iForm)) {
-      return eFormHead;
-    }
+  GC_ENTER();
+  GC_ROOT(frame);
+  while (TAIL(iForm)) {
+    InterpretTerm(HEAD(iForm), frame, env, pool);
     iForm = TAIL(iForm);
   }
+  GC_RETURN(Term*, HEAD(iForm));
 }
 
-static Term* InterpretForm(Term* iTerm, Env* env, MemPool* pool) {
-  /* Interpret the head first, then the head determines
-     the interpretation of the rest of the form. */
-  Term* eHead = InterpretTerm(HEAD(iTerm), env, pool);
-  switch (eHead->type) {
-    case T_PRIM_QUOTE:
-      return InterpretQuote(TAIL(iTerm), env, pool);
-    case T_PRIM_BEGIN:
-      return InterpretBegin(TAIL(iTerm), env, pool);
-    case T_FUN_NATIVE:
-      return InterpretBifCall(eHead, TAIL(iTerm), env, pool);
-      break;
-    case T_FUN_USER:
-      return InterpretUdfCall(eHead, TAIL(iTerm), env, pool);
-      break;
-    case T_PRIM_FUN:
-      return InterpretFunctionDef(TAIL(iTerm), env, pool);
-      break;
-    default:
-      DieShowingTerm("Invalid form", iTerm);
-  }
-}
-
-static Term* InterpretString(Term* iTerm, Env* env, MemPool* pool) {
+static Term* InterpretString(Term* iTerm, Frame* frame, Env* env, MemPool* pool) {
   return iTerm;
 }
 
-static Term* InterpretNumber(Term* iTerm, Env* env, MemPool* pool) {
+static Term* InterpretNumber(Term* iTerm, Frame* frame, Env* env, MemPool* pool) {
   return iTerm;
 }
 
-Term* EnvLookup(Env* env, const char* name, int len) {
+/* Symbols are interned, so they can be compared by address. */
+Term* EnvLookup(Env* env, Term* symbol) {
   Env* envNode = env;
   while (envNode) {
-    if (envNode->nameLen == len
-        && 0 == strncmp(envNode->nameText, name, len)) {
+    if (envNode->name == symbol) {
       return envNode->value;
     }
     envNode = envNode->next;
@@ -225,24 +371,219 @@ Term* EnvLookup(Env* env, const char* name, int len) {
   return ENV_LOOKUP_FAILED;
 }
 
-static Term* InterpretSymbol(Term* iTerm, Env* env, MemPool* pool) {
+static Term* InterpretSymbol(Term* iTerm, Frame* frame, Env* env, MemPool* pool) {
   assert(IS_SYMBOL(iTerm));
-  Term* t = EnvLookup(env, iTerm->value.string.text, iTerm->value.string.len);
+  Term* t = EnvLookup(env, iTerm);
   if (t == ENV_LOOKUP_FAILED) {
     DieShowingTerm("Unresolved symbol", iTerm);
   }
   return t;
 }
 
-Term* Interpret(Term* iProgram) {
-  //MemPool* pool = NewMemPool();
-  MemPool* pool = 0;
-  Env* builtinEnv = BuiltinEnvironment(pool);
+/* Fill in the inline cache of a global reference. Worker threads
+   (see pmap) look the symbol up without touching the cache, which
+   is shared with the other threads. */
+Term* RefreshGlobalRef(Term* ref, Env* env) {
+  assert(IS_GLOBAL_REF(ref));
+  Term* value = EnvLookup(env, ref->value.globalRef.name);
+  if (value == ENV_LOOKUP_FAILED) {
+    DieShowingTerm("Unresolved symbol", ref->value.globalRef.name);
+  }
+  if (!InParallelTask()) {
+    ref->value.globalRef.value = value;
+    ref->value.globalRef.native = IS_FUN_NATIVE(value) ? value : 0;
+    ref->value.globalRef.version = envVersion;
+  }
+  return value;
+}
+
+static Term* InterpretLocalRef(Term* iTerm, Frame* frame, Env* env, MemPool* pool) {
+  assert(IS_LOCAL_REF(iTerm));
+  if (iTerm->value.localRef.captured) {
+    frame = frame->parent;
+  }
+  return frame->slots[iTerm->value.localRef.slot];
+}
+
+int useBytecode = 0;
+int useArena = 0;
+int useOptimizer = 1;
+int useJit = 1;
+
+static Env* globalEnv;
+static MemPool* envPool; /* For the global environment, which lasts. */
+static MemPool* scratchPool;
+static Chunk* lastChunk; /* Bytecode of the last top-level form. */
+
+/* Run a user function (or a macro) on a list of arguments. */
+static Term* ApplyUdf(Term* eFun, Term* eArgs, MemPool* pool) {
+  GC_ENTER();
+  GC_ROOT(eFun);
+  GC_ROOT(eArgs);
+  int arity = ListLength(eFun->value.udf.funArgs);
+  if (ListLength(eArgs) != arity) {
+    Die("Wrong number of arguments to function.");
+  }
+  Frame* callFrame = NewFrame(pool, eFun->value.udf.funFrame, arity);
+  GC_ROOT(callFrame);
+  for (int i = 0; i < arity; i++) {
+    callFrame->slots[i] = HEAD(eArgs);
+    GC_WRITE_BARRIER(callFrame, HEAD(eArgs));
+    eArgs = TAIL(eArgs);
+  }
+  int profileDepth = 0;
+  if (profiling) {
+    profileDepth = ProfileDepth();
+    ProfileEnter(profileDepth, eFun->value.udf.funBody);
+  }
+  Term* iBody = InterpretBeginPrefix(eFun->value.udf.funBody, callFrame, globalEnv, pool);
+  Term* eResult = InterpretTerm(iBody, callFrame, globalEnv, pool);
+  if (profiling) {
+    ProfileLeave(profileDepth);
+  }
+  GC_RETURN(Term*, eResult);
+}
+
+/* Call a function with a list of evaluated arguments. This is
+   how builtins such as map call functions. A user function is
+   run by the tree walker, even if it was made by the VM. */
+Term* Apply(Term* eFun, Term* eArgs, MemPool* pool) {
+  if (IS_FUN_NATIVE(eFun)) {
+    if (!eFun->value.bif.arrayFunPtr) {
+      return eFun->value.bif.funPtr(eArgs, pool);
+    }
+    int firstValue = valueStackCount;
+    for (; eArgs; eArgs = TAIL(eArgs)) {
+      PushValue(HEAD(eArgs));
+    }
+    return CallArrayBif(eFun, firstValue, pool);
+  }
+  if (IS_FUN_COMPILED(eFun)) {
+    /* The function copies its arguments out of the value stack
+       before it evaluates anything that could move the stack. */
+    int firstValue = valueStackCount;
+    for (; eArgs; eArgs = TAIL(eArgs)) {
+      PushValue(HEAD(eArgs));
+    }
+    Term* eResult = CallCompiled(eFun, valueStackCount - firstValue,
+                                 valueStack + firstValue, pool);
+    valueStackCount = firstValue;
+    return eResult;
+  }
+  if (!IS_FUN_USER(eFun)) {
+    DieShowingTerm("Called a non-function", eFun);
+  }
+  return ApplyUdf(eFun, eArgs, pool);
+}
+
+/* Call a macro with the argument forms of a macro call (see
+   macroexpand.c). What it returns is the expansion. */
+Term* CallMacro(Term* eMacro, Term* iArgs, MemPool* pool) {
+  assert(IS_FUN_MACRO(eMacro));
+  return ApplyUdf(eMacro, iArgs, pool);
+}
+
+/* Evaluate a top-level form. Allocation during evaluation comes
+   from the pool if one is given, else from the garbage collector.
+
+   Nothing created by a top-level form outlives it (the only
+   globals it can define are macros, which are made during
+   expansion) except for its result, so its bytecode is freed
+   before the next form runs. */
+static Term* InterpretTopLevel(Term* iForm, Env* env, MemPool* programPool, MemPool* pool) {
+  iForm = Resolve(iForm, env, programPool);
+  if (useOptimizer) {
+    iForm = Optimize(iForm, env, programPool);
+  }
+  Term* eResult;
+  if (lastChunk) {
+    FreeChunk(lastChunk);
+    lastChunk = 0;
+  }
+  if (useBytecode) {
+    Chunk* chunk = Compile(iForm, env);
+    lastChunk = chunk;
+    printf("Bytecode:\n");
+    PrintChunk(stdout, chunk);
+    printf("--------------------\n");
+    gcActive = !pool;
+    eResult = VmRun(chunk, env, pool);
+  } else {
+    gcActive = !pool;
+    eResult = InterpretTerm(iForm, 0, env, pool);
+  }
+  gcActive = 0;
+  return eResult;
+}
+
+/* Set up the global environment: the given one (from an image),
+   or else the builtins, allocated from the pool. Later bindings
+   are allocated from the pool too. */
+void InterpretInit(MemPool* pool, Env* env) {
+  envPool = pool;
+  globalEnv = env ? env : BuiltinEnvironment(envPool);
   printf("--------------------\n");
   printf("Environment:\n");
-  PrintEnv(stdout, builtinEnv);
+  PrintEnv(stdout, globalEnv);
+  printf("--------------------\n");
+  scratchPool = useArena ? NewMemPool() : 0;
+  RuntimeInit();
+}
+
+/* Set up the collector, and the stack of values that Apply
+   keeps where it can see them. */
+void RuntimeInit() {
+  GcInit();
+  GcPushRootScanner(VisitValueStack, 0);
+}
+
+/* Evaluate one top-level form, which was parsed into the pool.
+   The result is only valid until the next form is evaluated. */
+Term* InterpretForm(Term* iForm, MemPool* formPool) {
+  /* Nothing created by a top-level form outlives it, except for
+     its result. So in arena mode the scratch pool is reset before
+     each form. */
+  if (scratchPool) {
+    ResetMemPool(scratchPool);
+  }
+  if (profiling) {
+    ProfileEnter(0, iForm);
+  }
+  iForm = MacroExpand(iForm, &globalEnv, envPool, formPool);
+  Term* eResult = InterpretTopLevel(iForm, globalEnv, formPool, scratchPool);
+  if (profiling) {
+    ProfileLeave(0);
+  }
+  return eResult;
+}
+
+/* Expand, resolve and optimize a top-level form as InterpretForm
+   does, but return the form instead of evaluating it, along with
+   the global environment it was resolved in. Macros defined by
+   the form are bound for the forms that follow. */
+Term* PrepareForm(Term* iForm, MemPool* formPool, Env** env) {
+  iForm = MacroExpand(iForm, &globalEnv, envPool, formPool);
+  *env = globalEnv;
+  if (!iForm)
+    return 0;
+  iForm = Resolve(iForm, globalEnv, formPool);
+  if (useOptimizer) {
+    iForm = Optimize(iForm, globalEnv, formPool);
+  }
+  return iForm;
+}
+
+void InterpretFinish() {
   printf("--------------------\n");
-  Term* iWrappedProgram = NewCons(pool, GetSymbol("begin"), iProgram);
-  return InterpretTerm(iWrappedProgram, builtinEnv, pool);
+  GcPrintStats(stdout);
 }
 
+Term* Interpret(Term* iProgram, MemPool* programPool, Env* env) {
+  InterpretInit(programPool, env);
+  Term* eResult = 0;
+  for (Term* iForms = iProgram; iForms; iForms = TAIL(iForms)) {
+    eResult = InterpretForm(HEAD(iForms), programPool);
+  }
+  InterpretFinish();
+  return eResult;
+}
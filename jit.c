@@ -0,0 +1,521 @@
+/*
+The JIT: a template compiler from the bytecode of a function (see
+compile.c) to x86-64 machine code, for functions that are called
+often (see vm.c).
+
+Each instruction becomes a fixed sequence of machine code that
+does what the VM would do for it, working on the VM's registers in
+the VmState: the top of the stack is kept in rbx while the code
+runs, and the state is in r12. The frame is read from the state
+whenever it's needed, since the collector may move it at any
+allocation. Operands are compiled in, so nothing is decoded or
+dispatched at run time.
+
+Calls to builtins are made from the native code. A call to +, -,
+*, < or = with two fixnums, when the function being called is the
+builtin the name was bound to when the code was compiled, is done
+inline, without calling anything. Everything else that needs the
+VM, namely calls to user functions and returns, is done by giving
+control back to it with a JitStatus. For a call, the code says
+where it goes on afterwards; the VM jumps back in there when the
+callee returns.
+
+The code for a function begins with an entry stub, a JitEntry,
+that sets up the registers and jumps to the given address, and an
+exit sequence that saves the stack pointer and returns to the VM.
+
+The JIT is only built for x86-64 with the System V calling
+convention. Elsewhere JitCompile does nothing, and the VM runs the
+bytecode as before.
+*/
+
+/* For MAP_ANONYMOUS, which POSIX leaves out, under --std=c99. */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "datatype.h"
+#include "bytecode.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+       R12 = 12, R13 = 13 };
+
+/* Condition codes, for Jcc and CMOVcc. */
+enum { CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD };
+
+typedef struct CodeBuffer {
+  uint8_t* code;
+  size_t len;
+  size_t capacity;
+} CodeBuffer;
+
+/* The builtins whose calls with two fixnums are compiled inline. */
+typedef enum {
+  INLINE_NONE,
+  INLINE_ADD,
+  INLINE_SUBTRACT,
+  INLINE_MULTIPLY,
+  INLINE_LESS_THAN,
+  INLINE_EQUAL,
+} InlineOp;
+
+static void EmitByte(CodeBuffer* b, uint8_t byte) {
+  if (b->len == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : 256;
+    b->code = (uint8_t*)Realloc(b->code, b->capacity);
+  }
+  b->code[b->len++] = byte;
+}
+
+static void Emit32(CodeBuffer* b, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    EmitByte(b, (uint8_t)(value >> (8 * i)));
+}
+
+static void Emit64(CodeBuffer* b, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    EmitByte(b, (uint8_t)(value >> (8 * i)));
+}
+
+/* A REX prefix for a 64-bit operation on the registers in the
+   reg and r/m fields of the ModRM byte. */
+static void EmitRex(CodeBuffer* b, int reg, int rm) {
+  EmitByte(b, 0x48 | (reg >= 8) << 2 | (rm >= 8));
+}
+
+/* [base + disp32] in the r/m field. */
+static void EmitMemOperand(CodeBuffer* b, int reg, int base, int32_t disp) {
+  EmitByte(b, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP)
+    EmitByte(b, 0x24); /* SIB: no index. */
+  Emit32(b, (uint32_t)disp);
+}
+
+/* An instruction "op r/m, reg" between two registers. */
+static void EmitRegReg(CodeBuffer* b, uint8_t op, int rm, int reg) {
+  EmitRex(b, reg, rm);
+  EmitByte(b, op);
+  EmitByte(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* mov reg, [base + disp] */
+static void EmitLoad(CodeBuffer* b, int reg, int base, int32_t disp) {
+  EmitRex(b, reg, base);
+  EmitByte(b, 0x8B);
+  EmitMemOperand(b, reg, base, disp);
+}
+
+/* mov [base + disp], reg */
+static void EmitStore(CodeBuffer* b, int base, int32_t disp, int reg) {
+  EmitRex(b, reg, base);
+  EmitByte(b, 0x89);
+  EmitMemOperand(b, reg, base, disp);
+}
+
+/* mov reg, imm64 */
+static void EmitMoveImmediate(CodeBuffer* b, int reg, const void* value) {
+  EmitByte(b, 0x48 | (reg >= 8));
+  EmitByte(b, 0xB8 | (reg & 7));
+  Emit64(b, (uint64_t)(uintptr_t)value);
+}
+
+/* mov reg, reg2 */
+static void EmitMove(CodeBuffer* b, int reg, int reg2) {
+  EmitRegReg(b, 0x89, reg, reg2);
+}
+
+/* add reg, imm32 (sub if negative) */
+static void EmitAddImmediate(CodeBuffer* b, int reg, int32_t value) {
+  EmitRex(b, 0, reg);
+  EmitByte(b, 0x81);
+  EmitByte(b, 0xC0 | (value < 0 ? 5 : 0) << 3 | (reg & 7));
+  Emit32(b, (uint32_t)(value < 0 ? -value : value));
+}
+
+/* Call a C function. The stack is kept aligned by the entry stub,
+   and rbx and r12 survive the call. */
+static void EmitCall(CodeBuffer* b, const void* fun) {
+  EmitMoveImmediate(b, RAX, fun);
+  EmitByte(b, 0xFF);
+  EmitByte(b, 0xD0); /* call rax */
+}
+
+/* A jump with a 32-bit displacement, to be filled in by
+   PatchJump. Returns where the displacement is. */
+static size_t EmitJump(CodeBuffer* b) {
+  EmitByte(b, 0xE9);
+  Emit32(b, 0);
+  return b->len - 4;
+}
+
+static size_t EmitJumpIf(CodeBuffer* b, int cc) {
+  EmitByte(b, 0x0F);
+  EmitByte(b, 0x80 | cc);
+  Emit32(b, 0);
+  return b->len - 4;
+}
+
+/* Point the jump (or lea) whose displacement is at the given
+   offset to the target. */
+static void PatchJump(CodeBuffer* b, size_t at, size_t target) {
+  uint32_t disp = (uint32_t)(target - (at + 4));
+  memcpy(b->code + at, &disp, 4);
+}
+
+static void EmitJumpTo(CodeBuffer* b, size_t target) {
+  PatchJump(b, EmitJump(b), target);
+}
+
+/* Push rax onto the VM stack. */
+static void EmitPushRax(CodeBuffer* b) {
+  EmitStore(b, RBX, 0, RAX);
+  EmitAddImmediate(b, RBX, sizeof(Term*));
+}
+
+/* rax = vm->frame */
+static void EmitLoadFrame(CodeBuffer* b) {
+  EmitLoad(b, RAX, R12, offsetof(VmState, frame));
+}
+
+/* Give control back to the VM. */
+static void EmitExit(CodeBuffer* b, JitStatus status, size_t exit) {
+  EmitByte(b, 0xB8); /* mov eax, imm32 */
+  Emit32(b, status);
+  EmitJumpTo(b, exit);
+}
+
+/* The value of a global, when the inline cache in the reference
+   has gone stale, or of a symbol that wasn't resolved. */
+static Term* JitGlobal(Term* ref, VmState* vm) {
+  if (IS_GLOBAL_REF(ref))
+    return RefreshGlobalRef(ref, vm->env);
+  Term* value = EnvLookup(vm->env, ref);
+  if (value == ENV_LOOKUP_FAILED) {
+    DieShowingTerm("Unresolved symbol", ref);
+  }
+  return value;
+}
+
+/* Make a call if the function is a builtin. Returns the new top
+   of the stack, or null if the VM has to make the call. */
+static Term** JitCallNative(VmState* vm, Term** sp, int nArgs) {
+  Term** base = sp - nArgs - 1;
+  if (!IS_FUN_NATIVE(*base))
+    return 0;
+  vm->sp = sp;
+  *base = CallNative(*base, base + 1, nArgs, vm->pool);
+  return base + 1;
+}
+
+static void EmitGlobal(CodeBuffer* b, Term* ref) {
+  EmitMoveImmediate(b, RAX, ref);
+  if (IS_GLOBAL_REF(ref)) {
+    /* The inline cache is good if no binding has been made. */
+    EmitMoveImmediate(b, RCX, &envVersion);
+    EmitByte(b, 0x8B);
+    EmitByte(b, 0x09); /* mov ecx, [rcx] */
+    EmitByte(b, 0x3B); /* cmp ecx, [rax + version] */
+    EmitMemOperand(b, RCX, RAX, offsetof(Term, value.globalRef.version));
+    size_t stale = EmitJumpIf(b, CC_NE);
+    EmitLoad(b, RAX, RAX, offsetof(Term, value.globalRef.value));
+    size_t done = EmitJump(b);
+    PatchJump(b, stale, b->len);
+    EmitMove(b, RDI, RAX);
+    EmitMove(b, RSI, R12);
+    EmitCall(b, (void*)JitGlobal);
+    PatchJump(b, done, b->len);
+  } else {
+    EmitMove(b, RDI, RAX);
+    EmitMove(b, RSI, R12);
+    EmitCall(b, (void*)JitGlobal);
+  }
+  EmitPushRax(b);
+}
+
+/* The arithmetic of a two-argument call, with the arguments (both
+   fixnums) in rax and rcx. Leaves the result in rax. Returns the
+   jump taken on overflow, or 0. */
+static size_t EmitInlineOp(CodeBuffer* b, InlineOp op) {
+  switch (op) {
+    case INLINE_ADD:
+      /* (2x + 1) + (2y + 1) - 1 = 2(x + y) + 1 */
+      EmitAddImmediate(b, RCX, -1);
+      EmitRegReg(b, 0x01, RAX, RCX); /* add rax, rcx */
+      return EmitJumpIf(b, CC_O);
+    case INLINE_SUBTRACT:
+      /* (2x + 1) - (2y + 1) + 1 = 2(x - y) + 1 */
+      EmitAddImmediate(b, RCX, -1);
+      EmitRegReg(b, 0x29, RAX, RCX); /* sub rax, rcx */
+      return EmitJumpIf(b, CC_O);
+    case INLINE_MULTIPLY: {
+      /* x * 2y + 1 = 2xy + 1 */
+      EmitRex(b, 0, RAX);
+      EmitByte(b, 0xD1);
+      EmitByte(b, 0xF8); /* sar rax, 1 */
+      EmitAddImmediate(b, RCX, -1);
+      EmitRex(b, RAX, RCX);
+      EmitByte(b, 0x0F);
+      EmitByte(b, 0xAF);
+      EmitByte(b, 0xC1); /* imul rax, rcx */
+      size_t overflow = EmitJumpIf(b, CC_O);
+      EmitRex(b, 0, RAX);
+      EmitByte(b, 0x83);
+      EmitByte(b, 0xC8);
+      EmitByte(b, 0x01); /* or rax, 1 */
+      return overflow;
+    }
+    case INLINE_LESS_THAN:
+    case INLINE_EQUAL:
+      /* Tagging keeps the order of fixnums. */
+      EmitRegReg(b, 0x39, RAX, RCX); /* cmp rax, rcx */
+      EmitMoveImmediate(b, RAX, TERM_TRUE);
+      EmitMoveImmediate(b, RDX, TERM_FALSE);
+      EmitRex(b, RAX, RDX);
+      EmitByte(b, 0x0F);
+      EmitByte(b, 0x40 | (op == INLINE_LESS_THAN ? CC_GE : CC_NE));
+      EmitByte(b, 0xC2); /* cmovcc rax, rdx */
+      return 0;
+    default:
+      Die("Invalid inline operation: %d", op);
+  }
+}
+
+/* A call with the function and its arguments on the stack. */
+static void EmitCallInstruction(CodeBuffer* b, int nArgs, int tail,
+                                Term* eInline, InlineOp op, size_t exit) {
+  size_t slowPaths[3];
+  int slowPathCount = 0;
+  size_t doneJump = 0;
+  if (op != INLINE_NONE && nArgs == 2) {
+    EmitMoveImmediate(b, RAX, eInline);
+    EmitByte(b, 0x48);
+    EmitByte(b, 0x39); /* cmp [rbx - 24], rax */
+    EmitMemOperand(b, RAX, RBX, -3 * (int)sizeof(Term*));
+    slowPaths[slowPathCount++] = EmitJumpIf(b, CC_NE);
+    EmitLoad(b, RAX, RBX, -2 * (int)sizeof(Term*));
+    EmitLoad(b, RCX, RBX, -1 * (int)sizeof(Term*));
+    EmitMove(b, RDX, RAX);
+    EmitRegReg(b, 0x21, RDX, RCX); /* and rdx, rcx */
+    EmitByte(b, 0xF6);
+    EmitByte(b, 0xC2);
+    EmitByte(b, FIXNUM_TAG); /* test dl, FIXNUM_TAG */
+    slowPaths[slowPathCount++] = EmitJumpIf(b, CC_E);
+    size_t overflow = EmitInlineOp(b, op);
+    if (overflow)
+      slowPaths[slowPathCount++] = overflow;
+    EmitStore(b, RBX, -3 * (int)sizeof(Term*), RAX);
+    EmitAddImmediate(b, RBX, -2 * (int)sizeof(Term*));
+    if (tail)
+      EmitExit(b, JIT_RETURN, exit);
+    else
+      doneJump = EmitJump(b);
+  }
+  for (int i = 0; i < slowPathCount; i++)
+    PatchJump(b, slowPaths[i], b->len);
+  EmitMove(b, RDI, R12);
+  EmitMove(b, RSI, RBX);
+  EmitByte(b, 0xBA); /* mov edx, imm32 */
+  Emit32(b, nArgs);
+  EmitCall(b, (void*)JitCallNative);
+  EmitRegReg(b, 0x85, RAX, RAX); /* test rax, rax */
+  size_t notNative = EmitJumpIf(b, CC_E);
+  EmitMove(b, RBX, RAX);
+  size_t nativeDone = 0;
+  if (tail)
+    EmitExit(b, JIT_RETURN, exit);
+  else
+    nativeDone = EmitJump(b);
+  PatchJump(b, notNative, b->len);
+  /* mov dword [r12 + callArgs], nArgs */
+  EmitByte(b, 0x41);
+  EmitByte(b, 0xC7);
+  EmitMemOperand(b, 0, R12, offsetof(VmState, callArgs));
+  Emit32(b, nArgs);
+  if (tail) {
+    EmitExit(b, JIT_TAILCALL, exit);
+    return;
+  }
+  EmitByte(b, 0x48);
+  EmitByte(b, 0x8D);
+  EmitByte(b, 0x05); /* lea rax, [rip + resume] */
+  Emit32(b, 0);
+  size_t resumeLea = b->len - 4;
+  EmitStore(b, R12, offsetof(VmState, resume), RAX);
+  EmitExit(b, JIT_CALL, exit);
+  /* The VM comes back here when the callee returns. */
+  PatchJump(b, resumeLea, b->len);
+  if (doneJump)
+    PatchJump(b, doneJump, b->len);
+  PatchJump(b, nativeDone, b->len);
+}
+
+/* The builtin that a call to the global can be compiled inline
+   for, as it's bound now. */
+static InlineOp InlineOpFor(Term* ref, Env* env, Term** eFun) {
+  if (!IS_GLOBAL_REF(ref))
+    return INLINE_NONE;
+  Term* value = EnvLookup(env, ref->value.globalRef.name);
+  if (value == ENV_LOOKUP_FAILED || !IS_FUN_NATIVE(value)
+      || !value->value.bif.arrayFunPtr)
+    return INLINE_NONE;
+  static const struct {
+    NativeArrayFun fun;
+    InlineOp op;
+  } inlineOps[] = {
+    { Add, INLINE_ADD },
+    { Subtract, INLINE_SUBTRACT },
+    { Multiply, INLINE_MULTIPLY },
+    { LessThan, INLINE_LESS_THAN },
+    { NumberEqual, INLINE_EQUAL },
+  };
+  for (size_t i = 0; i < sizeof(inlineOps) / sizeof(inlineOps[0]); i++) {
+    if (value->value.bif.arrayFunPtr == inlineOps[i].fun) {
+      *eFun = value;
+      return inlineOps[i].op;
+    }
+  }
+  return INLINE_NONE;
+}
+
+static void* MapCode(CodeBuffer* b, size_t* size) {
+  *size = (b->len + 0xFFF) & ~(size_t)0xFFF;
+  void* mem = mmap(0, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return 0;
+  memcpy(mem, b->code, b->len);
+  if (mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, *size);
+    return 0;
+  }
+  return mem;
+}
+
+/* Compile the function's bytecode. Builtins are looked up in the
+   environment that the VM is running in. */
+static void Translate(CodeBuffer* b, Chunk* chunk, Env* env, size_t* body) {
+  /* The entry stub: JitStatus (VmState* vm, void* address). Three
+     pushes leave the stack aligned for calls. */
+  EmitByte(b, 0x53);                     /* push rbx */
+  EmitByte(b, 0x41); EmitByte(b, 0x54);  /* push r12 */
+  EmitByte(b, 0x41); EmitByte(b, 0x55);  /* push r13 */
+  EmitMove(b, R12, RDI);
+  EmitLoad(b, RBX, R12, offsetof(VmState, sp));
+  EmitByte(b, 0xFF); EmitByte(b, 0xE6);  /* jmp rsi */
+  size_t exit = b->len;
+  EmitStore(b, R12, offsetof(VmState, sp), RBX);
+  EmitByte(b, 0x41); EmitByte(b, 0x5D);  /* pop r13 */
+  EmitByte(b, 0x41); EmitByte(b, 0x5C);  /* pop r12 */
+  EmitByte(b, 0x5B);                     /* pop rbx */
+  EmitByte(b, 0xC3);                     /* ret */
+  *body = b->len;
+
+  /* For each stack slot, the global that the value there came
+     from, so that calls to builtins can be recognized. */
+  Term** pushedGlobals = (Term**)Alloc((chunk->maxStackDepth + 1) * sizeof(Term*));
+  int depth = 0;
+  const uint8_t* ip = chunk->code;
+  const uint8_t* end = chunk->code + chunk->codeLen;
+  while (ip < end) {
+    OpCode op = (OpCode)*ip++;
+    int operand = 0;
+    if (op != OP_POP && op != OP_RETURN) {
+      operand = ip[0] | ip[1] << 8;
+      ip += 2;
+    }
+    int pushes = op != OP_POP && op != OP_RETURN;
+    Term* pushedGlobal = 0;
+    switch (op) {
+      case OP_CONST:
+        EmitMoveImmediate(b, RAX, chunk->constants[operand]);
+        EmitPushRax(b);
+        depth++;
+        break;
+      case OP_LOCAL:
+        EmitLoadFrame(b);
+        EmitLoad(b, RAX, RAX, offsetof(Frame, slots) + operand * sizeof(Term*));
+        EmitPushRax(b);
+        depth++;
+        break;
+      case OP_CAPTURED:
+        EmitLoadFrame(b);
+        EmitLoad(b, RAX, RAX, offsetof(Frame, parent));
+        EmitLoad(b, RAX, RAX, offsetof(Frame, slots) + operand * sizeof(Term*));
+        EmitPushRax(b);
+        depth++;
+        break;
+      case OP_GLOBAL:
+        pushedGlobal = chunk->constants[operand];
+        EmitGlobal(b, pushedGlobal);
+        depth++;
+        break;
+      case OP_CALL:
+      case OP_TAILCALL: {
+        depth -= operand + 1;
+        Term* eInline = 0;
+        InlineOp inlineOp = pushedGlobals[depth]
+          ? InlineOpFor(pushedGlobals[depth], env, &eInline) : INLINE_NONE;
+        EmitCallInstruction(b, operand, op == OP_TAILCALL, eInline, inlineOp, exit);
+        depth++;
+        break;
+      }
+      case OP_POP:
+        EmitAddImmediate(b, RBX, -(int)sizeof(Term*));
+        depth--;
+        break;
+      case OP_CLOSURE: {
+        Chunk* child = chunk->children[operand];
+        EmitMove(b, RDI, R12);
+        EmitMove(b, RSI, RBX);
+        EmitMoveImmediate(b, RDX, child);
+        EmitCall(b, (void*)VmClosure);
+        EmitMove(b, RBX, RAX);
+        depth += 1 - child->captureCount;
+        break;
+      }
+      case OP_RETURN:
+        EmitExit(b, JIT_RETURN, exit);
+        break;
+      default:
+        Die("Invalid opcode: %d", op);
+    }
+    if (pushes)
+      pushedGlobals[depth - 1] = pushedGlobal;
+  }
+  free(pushedGlobals);
+}
+
+/* Called by the VM when the function gets hot. */
+void JitCompile(Chunk* chunk, Env* env) {
+  CodeBuffer b;
+  memset(&b, 0, sizeof(b));
+  size_t body;
+  Translate(&b, chunk, env, &body);
+  size_t size;
+  char* code = (char*)MapCode(&b, &size);
+  free(b.code);
+  if (!code)
+    return; /* Go on running the bytecode. */
+  chunk->jitCode = code;
+  chunk->jitBody = code + body;
+  chunk->jitSize = size;
+}
+
+void JitFree(Chunk* chunk) {
+  if (chunk->jitCode)
+    munmap(chunk->jitCode, chunk->jitSize);
+}
+
+#else
+
+void JitCompile(Chunk* chunk, Env* env) {
+}
+
+void JitFree(Chunk* chunk) {
+}
+
+#endif
@@ -1,9 +1,18 @@
+/* For MAP_ANONYMOUS and madvise, which POSIX leaves out, under
+   --std=c99. */
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <assert.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 
 #include "datatype.h"
 #include "lexer.h"
@@ -36,68 +45,266 @@ static void* LexerMalloc(size_t size) {
   return p;
 }
 
-static int SkipWhitespace(const char* code, int offset) {
-  for (;;) {
-    int c = code[offset];
-    if (c != ' ' && c != '\n' && c != '\t')
-      break;
-    offset++;
-  }
-  return offset;
-}
-
-static void NextToken(const char* code, int initialOffset, Token* token) {
-  int offset = SkipWhitespace(code, initialOffset);
-  token->offset = offset;
-  token->type = TOK_ERROR; // initialize type to error as a failsafe
-  if (code[offset] == 0) {
-    // TOKEN TYPE: End of file.
-    token->type = TOK_EOF;
-  } else if (isalnum(code[offset])) {
-    // TOKEN TYPE: Identifier or number.
-    int allDigits = 1;
-    for (;;) {
-      //printf("Alnum: [%c]\n", code[offset]);
-      if (isalpha(code[offset]))
-        allDigits = 0;
-      else if (isdigit(code[offset]))
-        ;
-      else
-        break;
-      offset++;
+/* Character classes, for the characters that the lexer cares
+   about. This is used instead of the <ctype.h> functions, which
+   depend on the locale. */
+#define CC_SPACE     0x01
+#define CC_IDENT     0x02 /* Can appear in an identifier or number. */
+#define CC_DIGIT     0x04
+#define CC_SIGN      0x08
+#define CC_PAREN     0x10
+#define CC_QUOTE     0x20
+#define CC_BACKSLASH 0x40
+
+static const unsigned char charClass[256] = {
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x01, 0x02, 0x20, 0x00, 0x02, 0x02, 0x02, 0x00, 0x10, 0x10, 0x02, 0x0a, 0x00, 0x0a, 0x02, 0x02,
+  0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x02, 0x00, 0x02, 0x02, 0x02, 0x02,
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x00, 0x40, 0x00, 0x02, 0x02,
+  0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+  0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x00, 0x00, 0x00, 0x02, 0x00,
+};
+
+#define CHAR_CLASS(C) (charClass[(unsigned char)(C)])
+
+/* Besides letters and digits, identifiers can contain the
+   characters !$%&*+-./:<=>?@^_~, so that names like + and eq?
+   are identifiers. */
+int IsIdentifierChar(int c) {
+  return c >= 0 && c < 256 && (charClass[c] & CC_IDENT);
+}
+
+/* An optional sign followed by one or more digits. */
+int IsNumber(const char* text, int length) {
+  int i = (CHAR_CLASS(text[0]) & CC_SIGN) ? 1 : 0;
+  if (i == length)
+    return 0;
+  for (; i < length; i++) {
+    if (!(CHAR_CLASS(text[i]) & CC_DIGIT))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+Lexing is done in two stages, in the style of simdjson.
+
+Stage 1 looks at the code 64 bytes at a time. It classifies the
+bytes of each block into bitmaps (one bit per byte) of whitespace,
+parentheses, quotes, backslashes and identifier characters, using
+AVX2 or SSE2 if the compiler targets them and a lookup table if
+not. Then, with a few bitwise operations per block and no branches
+per character, it works out which bytes are escaped, which are
+inside strings, and where each token starts and ends. The offsets
+of these are collected into a structural index.
+
+Stage 2 builds the tokens from the index.
+*/
+
+typedef struct BlockClasses {
+  uint64_t space;
+  uint64_t paren;
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t ident;
+} BlockClasses;
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC              __m256i
+#define VEC_BYTES        32
+#define VEC_LOAD(P)      _mm256_loadu_si256((const __m256i*)(P))
+#define VEC_SPLAT(C)     _mm256_set1_epi8(C)
+#define VEC_EQ(A, B)     _mm256_cmpeq_epi8(A, B)
+#define VEC_GT(A, B)     _mm256_cmpgt_epi8(A, B)
+#define VEC_OR(A, B)     _mm256_or_si256(A, B)
+#define VEC_AND(A, B)    _mm256_and_si256(A, B)
+#define VEC_ANDNOT(A, B) _mm256_andnot_si256(A, B)
+#define VEC_MASK(V)      ((uint64_t)(uint32_t)_mm256_movemask_epi8(V))
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VEC              __m128i
+#define VEC_BYTES        16
+#define VEC_LOAD(P)      _mm_loadu_si128((const __m128i*)(P))
+#define VEC_SPLAT(C)     _mm_set1_epi8(C)
+#define VEC_EQ(A, B)     _mm_cmpeq_epi8(A, B)
+#define VEC_GT(A, B)     _mm_cmpgt_epi8(A, B)
+#define VEC_OR(A, B)     _mm_or_si128(A, B)
+#define VEC_AND(A, B)    _mm_and_si128(A, B)
+#define VEC_ANDNOT(A, B) _mm_andnot_si128(A, B)
+#define VEC_MASK(V)      ((uint64_t)(uint32_t)_mm_movemask_epi8(V))
+#endif
+
+#ifdef VEC
+static void ClassifyBlock(const char* block, BlockClasses* classes) {
+  memset(classes, 0, sizeof(BlockClasses));
+  for (int i = 0; i < 64; i += VEC_BYTES) {
+    VEC c = VEC_LOAD(block + i);
+    VEC space = VEC_OR(VEC_OR(VEC_EQ(c, VEC_SPLAT(' ')),
+                              VEC_EQ(c, VEC_SPLAT('\n'))),
+                       VEC_EQ(c, VEC_SPLAT('\t')));
+    VEC paren = VEC_OR(VEC_EQ(c, VEC_SPLAT('(')), VEC_EQ(c, VEC_SPLAT(')')));
+    VEC quote = VEC_EQ(c, VEC_SPLAT('"'));
+    VEC backslash = VEC_EQ(c, VEC_SPLAT('\\'));
+    /* Identifier characters are the printable ASCII characters
+       (0x21 to 0x7E) other than these and the ones above. The
+       comparisons are signed, so bytes from 0x80 up are excluded. */
+    VEC printable = VEC_AND(VEC_GT(c, VEC_SPLAT(0x20)),
+                            VEC_GT(VEC_SPLAT(0x7F), c));
+    VEC other = VEC_OR(VEC_OR(VEC_OR(VEC_EQ(c, VEC_SPLAT('#')),
+                                     VEC_EQ(c, VEC_SPLAT('\''))),
+                              VEC_OR(VEC_EQ(c, VEC_SPLAT(',')),
+                                     VEC_EQ(c, VEC_SPLAT(';')))),
+                       VEC_OR(VEC_OR(VEC_EQ(c, VEC_SPLAT('[')),
+                                     VEC_EQ(c, VEC_SPLAT(']'))),
+                              VEC_OR(VEC_EQ(c, VEC_SPLAT('`')),
+                                     VEC_EQ(c, VEC_SPLAT('|')))));
+    other = VEC_OR(other, VEC_OR(VEC_EQ(c, VEC_SPLAT('{')),
+                                 VEC_EQ(c, VEC_SPLAT('}'))));
+    other = VEC_OR(other, VEC_OR(VEC_OR(paren, quote), backslash));
+    VEC ident = VEC_ANDNOT(other, printable);
+    classes->space |= VEC_MASK(space) << i;
+    classes->paren |= VEC_MASK(paren) << i;
+    classes->quote |= VEC_MASK(quote) << i;
+    classes->backslash |= VEC_MASK(backslash) << i;
+    classes->ident |= VEC_MASK(ident) << i;
+  }
+}
+#else
+static void ClassifyBlock(const char* block, BlockClasses* classes) {
+  memset(classes, 0, sizeof(BlockClasses));
+  for (int i = 0; i < 64; i++) {
+    unsigned cc = CHAR_CLASS(block[i]);
+    uint64_t bit = (uint64_t)1 << i;
+    classes->space |= (cc & CC_SPACE) ? bit : 0;
+    classes->paren |= (cc & CC_PAREN) ? bit : 0;
+    classes->quote |= (cc & CC_QUOTE) ? bit : 0;
+    classes->backslash |= (cc & CC_BACKSLASH) ? bit : 0;
+    classes->ident |= (cc & CC_IDENT) ? bit : 0;
+  }
+}
+#endif
+
+/* Bit i of the result is the XOR of bits 0 to i of x. Applied to
+   the quotes, this marks the bytes from an opening quote up to
+   (but not including) the closing quote. */
+static uint64_t PrefixXor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+/* Find the bytes that are escaped by a backslash: those that
+   follow an odd-length run of backslashes. (This is simdjson's
+   algorithm.) The carry says whether the first byte of the next
+   block is escaped. */
+static uint64_t FindEscaped(uint64_t backslash, uint64_t* carry) {
+  const uint64_t evenBits = 0x5555555555555555ULL;
+  backslash &= ~*carry;
+  uint64_t followsEscape = backslash << 1 | *carry;
+  uint64_t oddStarts = backslash & ~evenBits & ~followsEscape;
+  uint64_t evenStartRuns = oddStarts + backslash;
+  *carry = evenStartRuns < oddStarts; /* Overflowed. */
+  uint64_t invertMask = evenStartRuns << 1;
+  return (evenBits ^ invertMask) & followsEscape;
+}
+
+static int CountTrailingZeros(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+typedef struct OffsetList {
+  uint32_t* offsets;
+  int count;
+  int capacity;
+} OffsetList;
+
+static void AppendOffsets(OffsetList* list, uint64_t bits, size_t base) {
+  while (bits) {
+    if (list->count == list->capacity) {
+      list->capacity = list->capacity ? list->capacity * 2 : 1024;
+      list->offsets = (uint32_t*)Realloc(list->offsets,
+          list->capacity * sizeof(uint32_t));
     }
-    if (allDigits) {
-      token->type = TOK_NUMBER;
-    } else {
-      token->type = TOK_IDENTIFIER;
+    list->offsets[list->count++] = base + CountTrailingZeros(bits);
+    bits &= bits - 1;
+  }
+}
+
+/* The structural index. Every token has a start. Strings and
+   atoms (identifiers and numbers) also have an end, which is the
+   offset just past the token; since tokens don't overlap, the
+   ends are in the same order as the starts of those tokens. */
+typedef struct StructuralIndex {
+  OffsetList starts;
+  OffsetList ends;
+  /* Offset of the first character that can't start or continue
+     a token, or the length of the code if there is none. */
+  size_t errorOffset;
+} StructuralIndex;
+
+static void BuildStructuralIndex(const char* code, size_t len, StructuralIndex* index) {
+  uint64_t escapedCarry = 0;
+  uint64_t inStringCarry = 0; /* All ones if inside a string. */
+  uint64_t atomCarry = 0;
+  uint64_t closeQuoteCarry = 0;
+  memset(index, 0, sizeof(StructuralIndex));
+  index->errorOffset = len;
+  for (size_t base = 0; base < len; base += 64) {
+    const char* block = code + base;
+    char lastBlock[64];
+    if (len - base < 64) {
+      /* Pad the last block with spaces. */
+      memset(lastBlock, ' ', 64);
+      memcpy(lastBlock, block, len - base);
+      block = lastBlock;
     }
-  } else if (code[offset] == '"') {
-    // TOKEN TYPE: String.
-    offset++;
-    for (;;) {
-      if (code[offset] == 0) {
-        token->type = TOK_ERROR;
-        break;
-      } else if (code[offset] == '\\') {
-        offset++; // skip escaped char
-      } else if (code[offset] == '"') {
-        offset++; // include terminating quote in token
-        break;
-      }
-      offset++;
+    BlockClasses classes;
+    ClassifyBlock(block, &classes);
+    uint64_t escaped = FindEscaped(classes.backslash, &escapedCarry);
+    uint64_t quotes = classes.quote & ~escaped;
+    uint64_t inString = PrefixXor(quotes) ^ inStringCarry;
+    uint64_t openQuotes = quotes & inString;
+    uint64_t closeQuotes = quotes & ~inString;
+    uint64_t atom = classes.ident & ~inString;
+    uint64_t atomBefore = atom << 1 | atomCarry;
+    uint64_t starts =
+      (classes.paren & ~inString) | openQuotes | (atom & ~atomBefore);
+    uint64_t ends =
+      (~atom & atomBefore) | (closeQuotes << 1 | closeQuoteCarry);
+    uint64_t invalid =
+      ~(inString | atom | classes.space | classes.paren | classes.quote);
+    inStringCarry = (uint64_t)((int64_t)inString >> 63);
+    atomCarry = atom >> 63;
+    closeQuoteCarry = closeQuotes >> 63;
+    AppendOffsets(&index->starts, starts, base);
+    AppendOffsets(&index->ends, ends, base);
+    if (invalid) {
+      /* Tokens can't extend past an invalid character
+         (outside a string), so nothing after it matters. */
+      index->errorOffset = base + CountTrailingZeros(invalid);
+      return;
     }
-    token->type = TOK_STRING;
-  } else if (code[offset] == '(') {
-    offset++;
-    token->type = TOK_LPAREN;
-  } else if (code[offset] == ')') {
-    offset++;
-    token->type = TOK_RPAREN;
-  } else {
-    // TOKEN TYPE: Error (no match).
-    token->type = TOK_ERROR;
   }
-  token->length = offset - token->offset;
+  /* A token that ends exactly at the end of the code. */
+  if (atomCarry | closeQuoteCarry) {
+    AppendOffsets(&index->ends, 1, len);
+  }
 }
 
 static void PrintToken(const char* code, Token* token) {
@@ -130,29 +337,64 @@ static void PrintToken(const char* code, Token* token) {
   printf("\n");
 }
 
-int Lex(const char* code, Token** tokens) {
-  int offset = 0;
-  int tokenCapacity = 1024;
+/* Lex len bytes of code, which needn't be null-terminated. The
+   token offsets are relative to code. */
+int LexRange(const char* code, size_t len, Token** tokens) {
+  StructuralIndex index;
+  BuildStructuralIndex(code, len, &index);
+  /* Every start is a token, plus the final EOF or error token. */
+  *tokens = (Token*)LexerMalloc((index.starts.count + 1) * sizeof(Token));
   int tokenCount = 0;
-  *tokens = (Token*)LexerMalloc(tokenCapacity * sizeof(Token));
-  for (;;) {
-    if (tokenCount == tokenCapacity) {
-      tokenCapacity *= 2;
-      *tokens = (Token*)Realloc(tokens, tokenCapacity * sizeof(Token));
-    }
+  int nextEnd = 0;
+  for (int i = 0; i < index.starts.count; i++) {
+    uint32_t start = index.starts.offsets[i];
+    if (start >= index.errorOffset)
+      break;
     Token* token = &(*tokens)[tokenCount];
-    NextToken(code, offset, token);
-    offset = token->offset + token->length;
-    PrintToken(code, &(*tokens)[tokenCount]);
-    tokenCount++;
-    if (token->type == TOK_EOF || token->type == TOK_ERROR) {
+    token->offset = start;
+    char c = code[start];
+    if (c == '(' || c == ')') {
+      token->type = (c == '(') ? TOK_LPAREN : TOK_RPAREN;
+      token->length = 1;
+    } else if (nextEnd == index.ends.count) {
+      /* Only an unterminated string has no end. */
+      assert(c == '"');
+      token->type = TOK_ERROR;
+      token->length = 0;
+      tokenCount++;
       break;
+    } else {
+      token->length = index.ends.offsets[nextEnd++] - start;
+      if (c == '"')
+        token->type = TOK_STRING;
+      else if (IsNumber(code + start, token->length))
+        token->type = TOK_NUMBER;
+      else
+        token->type = TOK_IDENTIFIER;
     }
+    tokenCount++;
   }
+  if (tokenCount == 0 || (*tokens)[tokenCount - 1].type != TOK_ERROR) {
+    Token* token = &(*tokens)[tokenCount++];
+    token->offset = index.errorOffset;
+    token->length = 0;
+    token->type = (index.errorOffset < len) ? TOK_ERROR : TOK_EOF;
+  }
+  free(index.starts.offsets);
+  free(index.ends.offsets);
   return tokenCount;
 }
 
-const char* LoadFile(const char* filename) {
+int Lex(const char* code, Token** tokens) {
+  int tokenCount = LexRange(code, strlen(code), tokens);
+  for (int i = 0; i < tokenCount; i++) {
+    PrintToken(code, &(*tokens)[i]);
+  }
+  return tokenCount;
+}
+
+/* Read a copy of the whole file into memory. */
+static const char* LoadFileCopy(const char* filename) {
   FILE* f = fopen(filename, "rb");
   if (!f) {
     fprintf(stderr, "Unable to open file: %s\n", filename);
@@ -170,3 +412,74 @@ const char* LoadFile(const char* filename) {
   return fileContents;
 }
 
+/*
+Map the file into memory instead of copying it, so that its pages
+are shared with the page cache. Atoms point straight into the
+mapping, so it's never unmapped.
+
+The lexer relies on a null byte after the code. When the file
+doesn't end on a page boundary, the rest of its last page reads
+as zeros. Otherwise, on POSIX systems, the file is mapped over
+the start of a zeroed region one page longer than the file, so
+the byte after it is the start of a zero page. On Windows that
+isn't possible, so such files are copied instead.
+
+Returns null if the file can't be mapped (e.g. it's empty or
+isn't a regular file), in which case the caller falls back to
+copying it.
+*/
+static const char* MapFile(const char* filename) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if (file == INVALID_HANDLE_VALUE)
+    return 0;
+  LARGE_INTEGER size;
+  const char* code = 0;
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0
+      && size.QuadPart % pageSize != 0) {
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if (mapping) {
+      code = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping); // The view keeps the mapping alive.
+    }
+  }
+  CloseHandle(file);
+  return code;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  size_t size = st.st_size;
+  char* code;
+  if (size % pageSize != 0) {
+    code = (char*)mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  } else {
+    code = (char*)mmap(0, size + pageSize, PROT_READ,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED
+        && mmap(code, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)
+           == MAP_FAILED) {
+      munmap(code, size + pageSize);
+      code = MAP_FAILED;
+    }
+  }
+  close(fd);
+  if (code == MAP_FAILED)
+    return 0;
+  madvise(code, size, MADV_SEQUENTIAL);
+  return code;
+#endif
+}
+
+/* Load a file as a null-terminated string. */
+const char* LoadFile(const char* filename) {
+  const char* code = MapFile(filename);
+  return code ? code : LoadFileCopy(filename);
+}
+
@@ -18,7 +18,10 @@ typedef struct {
   int length;
 } Token;
 
+int IsIdentifierChar(int c);
+int IsNumber(const char* text, int length);
 const char* LoadFile(const char*);
 int Lex(const char*, Token** tokens);
+int LexRange(const char* code, size_t len, Token** tokens);
 
 
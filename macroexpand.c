@@ -1,102 +1,315 @@
+/*
+Macro expansion.
+
+A macro is defined at the top level with
+
+  (defmacro name (args...) body...)
+
+which binds name in the global environment to a T_FUN_MACRO. A
+form whose head is the name of a macro is a macro call: the macro
+is called with the argument forms, unevaluated, and the form it
+returns takes the place of the call, to be expanded in its turn.
+
+Expansion is a phase of its own that runs over each top-level form
+once, before the form is resolved and evaluated, so macros cost
+nothing at run time. As in the resolver, the form is rewritten in
+place. What a macro returns is copied into the form's pool first,
+since it may share structure with the macro's own quoted data or
+with other forms, and the resolver will rewrite it too.
+
+Expansions are memoized: a macro call with the same macro and
+the same argument forms as an earlier one (anywhere in the
+program) reuses its expansion instead of calling the macro again.
+This assumes that macros have no side effects, which they can
+hardly have anyway.
+*/
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include "datatype.h"
 
-typedef struct MacroExpansion {
-  Term* term;
-  Env* env;
-} MacroExpansion;
+/* Entries in the expansion cache. A power of two. The cache is
+   emptied when it's three quarters full. */
+#define EXPANSION_CACHE_SIZE 0x400
 
-MacroExpansion MacroExpandList(Term* iList, Env* env);
-MacroExpansion MacroExpandForm(Term* iTerm, Env* env);
-MacroExpansion MacroExpandTerm(Term* iTerm, Env* env);
+typedef struct CachedExpansion {
+  Term* macro; /* Null in an empty entry. */
+  Term* args;
+  Term* expansion;
+  unsigned hash;
+} CachedExpansion;
 
-Term* MacroExpand(Term* iProgram) {
-  // TODO: Builtin environment.
-  MacroExpansion ex = MacroExpandTerm(iProgram, 0);
-  return ex.term;
-}
+static CachedExpansion expansionCache[EXPANSION_CACHE_SIZE];
+static int cachedExpansionCount;
+static MemPool* cachePool;  /* Holds the cached forms. */
+static MemPool* macroPool;  /* For evaluating macros. */
 
-static MacroExpansion MacroExpandTerm(Term* iTerm, Env* env) {
-  MacroExpansion ex;
-  ex.term = 0;
-  ex.env = env;
-  if (!iTerm)
-    return ex;
-  switch (iTerm->type) {
-    case T_PRIM_NIL:
-      ; /* Already handled by the null check above. */
-    case T_CONS:
-      return MacroExpandForm(iTerm, env);
-    case T_STRING:
-    case T_NUMBER:
+/* The functions whose bodies enclose the form being expanded.
+   Their arguments shadow global macros. */
+typedef struct Scope {
+  struct Scope* parent;
+  Term* argNames;
+} Scope;
+
+typedef struct Expander {
+  Env* env;
+  MemPool* envPool; /* For macro definitions, which last. */
+  MemPool* pool;    /* For the expanded form. */
+} Expander;
+
+static Term* MacroExpandTerm(Expander* ex, Term* iTerm, Scope* scope);
+
+/* Copy a form into the pool. Only the terms that the parser
+   produces can be copied; anything else can't be evaluated. */
+static Term* CopyTree(Term* term, MemPool* pool) {
+  if (!IS_BOXED(term))
+    return term;
+  switch (term->type) {
     case T_SYMBOL:
-      ex.term = iTerm;
-      return ex;
-    case T_PRIM_FUN:
-    case T_PRIM_QUOTE:
-    case T_PRIM_BEGIN:
-    case T_FUN_NATIVE:
-    case T_FUN_USER:
-      ; /* The parser doesn't generate these. */
+      return term; /* Interned. */
+    case T_STRING: {
+      char* text = (char*)NewFromMemPool(pool, term->value.string.len);
+      memcpy(text, term->value.string.text, term->value.string.len);
+      Term* copy = NewAtom(pool, T_STRING);
+      copy->value.string.text = text;
+      copy->value.string.len = term->value.string.len;
+      return copy;
+    }
+    case T_BIGNUM: {
+      BigNum* src = (BigNum*)term;
+      BigNum* copy = NewBigNum(pool, src->len);
+      copy->negative = src->negative;
+      memcpy(copy->limbs, src->limbs, src->len * sizeof(uint32_t));
+      return (Term*)copy;
+    }
+    case T_CONS: {
+      /* Lists from the parser are proper, but a macro can
+         make an improper one with cons. */
+      int count = 0;
+      Term* node;
+      for (node = term; IS_CONS(node); node = TAIL(node))
+        count++;
+      Term** elements = (Term**)Alloc(count * sizeof(Term*));
+      int i = 0;
+      for (node = term; IS_CONS(node); node = TAIL(node))
+        elements[i++] = CopyTree(HEAD(node), pool);
+      Term* copy;
+      if (!node) {
+        copy = NewList(pool, elements, count);
+      } else {
+        copy = CopyTree(node, pool);
+        while (i > 0)
+          copy = NewCons(pool, elements[--i], copy);
+      }
+      free(elements);
+      return copy;
+    }
+    default:
+      DieShowingTerm("Macro expansion contains a value that isn't code", term);
   }
-  Die("Unexpected term type in MacroExpandTerm.");
 }
 
-static MacroExpansion MacroExpandForm(Term* iTerm, Env* env) {
-  assert(IS_CONS(iTerm));
-  Term* eFormArgs = MacroExpandList(TAIL(iTerm), env);
-  if (HEAD(iTerm)->type == T_SYMBOL) {
-    Term* eSymValue =
-      EnvLookup(env, iTerm->value.string.text, iTerm->value.string.len);
-    if (IS_MACRO(eSymValue)) {
-      // We have a macro to expand.
+static unsigned HashPointer(void* p) {
+  uintptr_t h = (uintptr_t)p;
+  h ^= h >> 17;
+  return (unsigned)(h * 0x9E3779B1u);
+}
+
+/* A hash that agrees with TreeEqual. */
+static unsigned HashTree(Term* term) {
+  if (!IS_BOXED(term))
+    return HashPointer(term);
+  switch (term->type) {
+    case T_STRING: {
+      unsigned h = 2166136261u;
+      for (int i = 0; i < term->value.string.len; i++)
+        h = (h ^ (unsigned char)term->value.string.text[i]) * 16777619u;
+      return h;
+    }
+    case T_BIGNUM: {
+      BigNum* big = (BigNum*)term;
+      unsigned h = big->negative;
+      for (int i = 0; i < big->len; i++)
+        h = (h ^ big->limbs[i]) * 16777619u;
+      return h;
     }
-  } else {
+    case T_CONS: {
+      unsigned h = 1;
+      for (; IS_CONS(term); term = TAIL(term))
+        h = h * 31 + HashTree(HEAD(term));
+      return h * 31 + HashTree(term);
+    }
+    default:
+      return HashPointer(term);
   }
-  switch (HEAD(iTerm)->type) {
-    case T_SYMBOL:
-      // See if this symbol refers to a macro.
-      {
+}
+
+static int TreeEqual(Term* a, Term* b) {
+  if (a == b)
+    return 1;
+  if (!IS_BOXED(a) || !IS_BOXED(b) || a->type != b->type)
+    return 0;
+  switch (a->type) {
+    case T_STRING:
+      return a->value.string.len == b->value.string.len
+        && 0 == memcmp(a->value.string.text, b->value.string.text,
+                       a->value.string.len);
+    case T_BIGNUM:
+      return NumberCompare(a, b) == 0;
+    case T_CONS:
+      for (; IS_CONS(a) && IS_CONS(b); a = TAIL(a), b = TAIL(b)) {
+        if (!TreeEqual(HEAD(a), HEAD(b)))
+          return 0;
       }
-      break;
-    case T_PRIM_QUOTE:
-    case T_PRIM_BEGIN:
-    case T_FUN_NATIVE:
-    case T_FUN_USER:
-      return MacroExpandUdfCall(eHead, TAIL(iTerm), env);
-      break;
-    case T_PRIM_FUN:
-      return MacroExpandFunctionDef(TAIL(iTerm), env);
-      break;
+      return TreeEqual(a, b);
     default:
-      DieShowingTerm("Invalid form", iTerm);
+      return 0;
   }
 }
 
-static MacroExpansion MacroExpandList(Term* iList, Env* env) {
-  MacroExpansion ex;
-  ex.term = 0;
-  ex.env = env;
-  /* Shortcut for lists with no elements. */
-  if (!iList) {
-    return ex;
+static CachedExpansion* FindCachedExpansion(Term* eMacro, Term* iArgs, unsigned hash) {
+  unsigned i = hash & (EXPANSION_CACHE_SIZE - 1);
+  for (;;) {
+    CachedExpansion* entry = &expansionCache[i];
+    if (!entry->macro)
+      return entry;
+    if (entry->hash == hash && entry->macro == eMacro
+        && TreeEqual(entry->args, iArgs))
+      return entry;
+    i = (i + 1) & (EXPANSION_CACHE_SIZE - 1);
   }
-  /* Evaluate list elements in left-to-right order. */
-  Term* eListHead = NewCons(MacroExpandTerm(HEAD(iList), env), 0);
-  Term* eListLast = eListHead;
-  Term* iListNode = TAIL(iList);
-  while (iListNode) {
-    eListLast->value.list.tail =
-      NewCons(MacroExpandTerm(HEAD(iListNode), env), 0);
-    eListLast = TAIL(eListLast);
-    iListNode = TAIL(iListNode);
+}
+
+/* The result is owned by the caller. */
+static Term* ExpandMacroCall(Expander* ex, Term* eMacro, Term* iForm) {
+  Term* iArgs = TAIL(iForm);
+  unsigned hash = HashTree(iArgs) ^ HashPointer(eMacro);
+  CachedExpansion* entry = FindCachedExpansion(eMacro, iArgs, hash);
+  if (!entry->macro) {
+    if (cachedExpansionCount >= EXPANSION_CACHE_SIZE / 4 * 3) {
+      memset(expansionCache, 0, sizeof(expansionCache));
+      cachedExpansionCount = 0;
+      ResetMemPool(cachePool);
+      entry = FindCachedExpansion(eMacro, iArgs, hash);
+    }
+    Term* expansion = CallMacro(eMacro, iArgs, macroPool);
+    entry->macro = eMacro;
+    entry->args = CopyTree(iArgs, cachePool);
+    entry->expansion = CopyTree(expansion, cachePool);
+    entry->hash = hash;
+    cachedExpansionCount++;
+    ResetMemPool(macroPool);
+  }
+  return CopyTree(entry->expansion, ex->pool);
+}
+
+static int IsLocal(Term* iSymbol, Scope* scope) {
+  for (; scope; scope = scope->parent) {
+    for (Term* name = scope->argNames; IS_CONS(name); name = TAIL(name)) {
+      if (HEAD(name) == iSymbol)
+        return 1;
+    }
   }
-  ex.term = eListHead;
-  return ex;
+  return 0;
+}
+
+/* What the head of a form refers to, if it's a global. */
+static Term* StaticFormHead(Expander* ex, Term* iHead, Scope* scope) {
+  if (!IS_SYMBOL(iHead) || IsLocal(iHead, scope))
+    return 0;
+  Term* eHead = EnvLookup(ex->env, iHead);
+  return eHead == ENV_LOOKUP_FAILED ? 0 : eHead;
+}
+
+static void MacroExpandList(Expander* ex, Term* iList, Scope* scope) {
+  for (; IS_CONS(iList); iList = TAIL(iList)) {
+    SET_HEAD(iList, MacroExpandTerm(ex, HEAD(iList), scope));
+  }
+}
+
+/* The form is (fun name (args...) body...). Malformed
+   definitions are left for the interpreter to report. */
+static void MacroExpandFunctionDef(Expander* ex, Term* iFunDef, Scope* scope) {
+  if (!IS_CONS(iFunDef) || !IS_CONS(TAIL(iFunDef)))
+    return;
+  Term* funArgsAndBody = TAIL(iFunDef);
+  Scope funScope;
+  funScope.parent = scope;
+  funScope.argNames = HEAD(funArgsAndBody);
+  MacroExpandList(ex, TAIL(funArgsAndBody), &funScope);
 }
 
+static Term* MacroExpandForm(Expander* ex, Term* iForm, Scope* scope) {
+  for (;;) {
+    Term* eHead = StaticFormHead(ex, HEAD(iForm), scope);
+    switch (TYPE_OF(eHead)) {
+      case T_PRIM_QUOTE:
+        /* Quoted data isn't code. */
+        return iForm;
+      case T_PRIM_FUN:
+        MacroExpandFunctionDef(ex, TAIL(iForm), scope);
+        return iForm;
+      case T_PRIM_DEFMACRO:
+        Die("defmacro is only allowed at the top level.");
+      case T_FUN_MACRO:
+        iForm = ExpandMacroCall(ex, eHead, iForm);
+        if (!IS_CONS(iForm))
+          return MacroExpandTerm(ex, iForm, scope);
+        continue;
+      default:
+        MacroExpandList(ex, iForm, scope);
+        return iForm;
+    }
+  }
+}
+
+static Term* MacroExpandTerm(Expander* ex, Term* iTerm, Scope* scope) {
+  if (IS_CONS(iTerm))
+    return MacroExpandForm(ex, iTerm, scope);
+  return iTerm;
+}
+
+/* The form is (defmacro name (args...) body...). The macro's
+   code is copied out of the form's pool, since it outlasts the
+   form, and resolved like the body of a top-level function. */
+static void DefineMacro(Expander* ex, Term* iForm) {
+  Term* iDef = TAIL(iForm);
+  if (!IS_CONS(iDef) || !IS_SYMBOL(HEAD(iDef))) {
+    Die("defmacro needs a name, a list of arguments and a body.");
+  }
+  Term* iFunForm = NewCons(ex->envPool, GetSymbol("fun"), CopyTree(iDef, ex->envPool));
+  Term* iFunDef = Resolve(iFunForm, ex->env, ex->envPool);
+  if (!IS_FUN_DEF(iFunDef)) {
+    Die("defmacro needs a name, a list of arguments and a body.");
+  }
+  assert(iFunDef->value.funDef.captureCount == 0);
+  Term* eMacro = NewAtom(ex->envPool, T_FUN_MACRO);
+  eMacro->value.udf.funBody = iFunDef->value.funDef.funBody;
+  eMacro->value.udf.funArgs = iFunDef->value.funDef.funArgs;
+  eMacro->value.udf.funFrame = 0;
+  eMacro->value.udf.funCode = 0;
+  ex->env = EnvBind(ex->envPool, ex->env, HEAD(iDef), eMacro);
+}
+
+/* Expand the macro calls in a top-level form, which was parsed
+   into the pool. A macro definition updates the environment and
+   expands to nil. */
+Term* MacroExpand(Term* iForm, Env** env, MemPool* envPool, MemPool* pool) {
+  if (!macroPool) {
+    macroPool = NewMemPool();
+    cachePool = NewMemPool();
+  }
+  Expander ex;
+  ex.env = *env;
+  ex.envPool = envPool;
+  ex.pool = pool;
+  if (IS_CONS(iForm)
+      && TYPE_OF(StaticFormHead(&ex, HEAD(iForm), 0)) == T_PRIM_DEFMACRO) {
+    DefineMacro(&ex, iForm);
+    *env = ex.env;
+    return 0;
+  }
+  return MacroExpandTerm(&ex, iForm, 0);
+}
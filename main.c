@@ -3,19 +3,152 @@
 #include "lexer.h"
 #include "parser.h"
 
+/* Read, evaluate and discard one top-level form at a time. */
+static void RunStream(FILE* f) {
+  MemPool* envPool = NewMemPool();
+  InterpretInit(envPool, 0);
+  Reader* reader = NewReader(f);
+  MemPool* formPool = NewMemPool();
+  Term* form;
+  while (ReadForm(reader, formPool, &form)) {
+    InterpretForm(form, formPool);
+    ResetMemPool(formPool);
+  }
+  FreeMemPool(formPool);
+  FreeReader(reader);
+  InterpretFinish();
+}
+
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage:\n");
+  int stream = 0;
+  int parallel = 0;
+  int image = 0;
+  const char* saveImage = 0;
+  const char* emitC = 0;
+  const char* profileOut = 0;
+  const char* cacheDir = getenv("BYTESIZE_CACHE");
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+    if (0 == strcmp(argv[argi], "--vm")) {
+      useBytecode = 1;
+    } else if (0 == strcmp(argv[argi], "--arena")) {
+      useArena = 1;
+    } else if (0 == strcmp(argv[argi], "--stream")) {
+      stream = 1;
+    } else if (0 == strcmp(argv[argi], "--parallel")) {
+      parallel = 1;
+    } else if (0 == strcmp(argv[argi], "--no-optimize")) {
+      useOptimizer = 0;
+    } else if (0 == strcmp(argv[argi], "--no-jit")) {
+      useJit = 0;
+    } else if (0 == strcmp(argv[argi], "--image")) {
+      image = 1;
+    } else if (0 == strcmp(argv[argi], "--save-image") && argi + 1 < argc) {
+      saveImage = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "--emit-c") && argi + 1 < argc) {
+      emitC = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "--profile") && argi + 1 < argc) {
+      profileOut = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "--cache") && argi + 1 < argc) {
+      cacheDir = argv[++argi];
+    } else if (0 == strcmp(argv[argi], "--no-cache")) {
+      cacheDir = 0;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+      exit(1);
+    }
+  }
+  if (argc - argi != 1) {
+    fprintf(stderr, "Usage: ByteSize [--vm] [--arena] [--stream] [--parallel] [--no-optimize]\n"
+                    "                [--no-jit] [--cache DIR | --no-cache] [--save-image IMAGE | --image]\n"
+                    "                [--emit-c OUT] [--profile OUT] FILE\n");
+    fprintf(stderr, "A FILE of - reads from standard input (implies --stream).\n");
+    fprintf(stderr, "--save-image parses FILE into IMAGE instead of running it.\n");
+    fprintf(stderr, "--image runs FILE, which is an image made by --save-image.\n");
+    fprintf(stderr, "--emit-c compiles FILE to C in OUT instead of running it.\n"
+                    "Build the result with: ./mk.sh program OUT\n");
+    fprintf(stderr, "--profile samples the running program and writes the folded stacks\n"
+                    "to OUT on exit, for flamegraph.pl.\n");
+    fprintf(stderr, "--no-jit keeps the VM from compiling hot functions to native code.\n");
+    fprintf(stderr, "--cache keeps the image of FILE in DIR, and runs it from there while\n"
+                    "FILE is unchanged. It defaults to $BYTESIZE_CACHE.\n");
     exit(1);
   }
-  printf("sizeof(Term) = %Iu\n", sizeof(Term));
-  printf("sizeof(Env)  = %Iu\n", sizeof(Env));
-  const char* filename = argv[1];
+  MemInit();
+  printf("sizeof(Term) = %lu\n", (unsigned long)sizeof(Term));
+  printf("sizeof(Env)  = %lu\n", (unsigned long)sizeof(Env));
+  const char* filename = argv[argi];
+  if (profileOut && (image || stream || 0 == strcmp(filename, "-"))) {
+    fprintf(stderr, "--profile needs a source FILE, not a stream or an image.\n");
+    exit(1);
+  }
+  if (image) {
+    Term* program;
+    Env* env;
+    LoadImage(filename, &program, &env);
+    PrintProgram(program);
+    Interpret(program, NewMemPool(), env);
+    return 0;
+  }
+  if (0 == strcmp(filename, "-")) {
+    RunStream(stdin);
+    return 0;
+  }
+  if (stream) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      exit(1);
+    }
+    RunStream(f);
+    fclose(f);
+    return 0;
+  }
   const char* code = LoadFile(filename);
-  Token* tokens;
-  int tokenCount = Lex(code, &tokens);
-  Term* program = Parse(code, tokens, tokenCount);
+  size_t codeLen = strlen(code);
+  MemPool* programPool = NewMemPool();
+  Term* program;
+  Env* env = 0;
+  char* cachedImage = 0;
+  /* The profiler needs the parser's source positions. */
+  if (cacheDir && *cacheDir && !saveImage && !emitC && !profileOut) {
+    cachedImage = CachedImagePath(cacheDir, code, codeLen);
+    if (LoadCachedImage(cachedImage, &program, &env)) {
+      PrintProgram(program);
+      Interpret(program, programPool, env);
+      return 0;
+    }
+  }
+  if (profileOut) {
+    ProfileStart(profileOut, code, codeLen);
+  }
+  if (parallel) {
+    program = ParseParallel(programPool, code, codeLen);
+  } else {
+    Token* tokens;
+    int tokenCount = Lex(code, &tokens);
+    program = Parse(programPool, code, tokens, tokenCount);
+  }
+  if (emitC) {
+    FILE* out = fopen(emitC, "w");
+    if (!out) {
+      fprintf(stderr, "Unable to open file: %s\n", emitC);
+      exit(1);
+    }
+    InterpretInit(programPool, 0);
+    EmitC(out, program, programPool, filename);
+    fclose(out);
+    return 0;
+  }
+  if (saveImage) {
+    SaveImage(saveImage, program, BuiltinEnvironment(programPool));
+    return 0;
+  }
+  if (cachedImage) {
+    env = BuiltinEnvironment(programPool);
+    SaveCachedImage(cachedImage, program, env);
+  }
   PrintProgram(program);
-  Interpret(program);
+  Interpret(program, programPool, env);
 }
 
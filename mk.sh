@@ -1,10 +1,20 @@
 #!/bin/sh
 
-SOURCES="alloc.c main.c lexer.c parser.c interp.c builtins.c"
+SOURCES="alloc.c main.c lexer.c parser.c reader.c interp.c builtins.c symbols.c resolve.c optimize.c compile.c vm.c jit.c gc.c numbers.c threads.c macroexpand.c image.c emitc.c profile.c"
+# Everything but main.c, for programs made by --emit-c.
+RUNTIME=$(echo "$SOURCES" | sed 's/ main\.c//')
 ALLOWED='--std=c99 -Wall -Werror'
 OPT='-O0 -g'
-if [ "$1" == "opt" ]; then
+if [ "$1" = "opt" ]; then
   OPT='-O2'
 fi
-gcc -o ByteSize $ALLOWED $OPT $SOURCES
-
+# ./mk.sh program OUT.c builds the program OUT.
+if [ "$1" = "program" ]; then
+  gcc -o "${2%.c}" -I. $ALLOWED -O2 "$2" $RUNTIME -lpthread
+  exit
+fi
+gcc -o ByteSize $ALLOWED $OPT $SOURCES -lpthread || exit
+# ./mk.sh test builds ByteSize and runs the tests in tests/.
+if [ "$1" = "test" ]; then
+  sh tests/run.sh
+fi
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "datatype.h"
+
+/*
+The numeric tower. Integers that fit in a fixnum are immediate
+values (see datatype.h); anything bigger is a heap-allocated
+BigNum holding its magnitude as an array of 32-bit limbs.
+
+Every operation first tries the fixnum case, using the
+compiler's overflow-checking intrinsics directly on the tagged
+words, and only falls back to the general bignum code when an
+operand isn't a fixnum or the result overflows. Results are
+always normalized: a value that fits in a fixnum is never
+represented as a bignum, so fixnums and bignums are never equal.
+
+The bignum code computes into temporary buffers and allocates
+the result at the very end, so it never holds a collected object
+across an allocation.
+*/
+
+#ifdef __GNUC__
+#define LIKELY(X) __builtin_expect(!!(X), 1)
+#define ADD_OVERFLOW(A, B, R) __builtin_add_overflow(A, B, R)
+#define SUB_OVERFLOW(A, B, R) __builtin_sub_overflow(A, B, R)
+#define MUL_OVERFLOW(A, B, R) __builtin_mul_overflow(A, B, R)
+#else
+#define LIKELY(X) (X)
+#define ADD_OVERFLOW(A, B, R) AddOverflow(A, B, R)
+#define SUB_OVERFLOW(A, B, R) SubOverflow(A, B, R)
+#define MUL_OVERFLOW(A, B, R) MulOverflow(A, B, R)
+
+static int AddOverflow(intptr_t a, intptr_t b, intptr_t* r) {
+  if ((b > 0 && a > INTPTR_MAX - b) || (b < 0 && a < INTPTR_MIN - b))
+    return 1;
+  *r = a + b;
+  return 0;
+}
+
+static int SubOverflow(intptr_t a, intptr_t b, intptr_t* r) {
+  if ((b < 0 && a > INTPTR_MAX + b) || (b > 0 && a < INTPTR_MIN + b))
+    return 1;
+  *r = a - b;
+  return 0;
+}
+
+static int MulOverflow(intptr_t a, intptr_t b, intptr_t* r) {
+  if (a != 0 && b != 0) {
+    if (a == -1 ? b == INTPTR_MIN : b == -1 ? a == INTPTR_MIN
+        : (a > 0) == (b > 0) ? a > INTPTR_MAX / b : a < INTPTR_MIN / b)
+      return 1;
+  }
+  *r = a * b;
+  return 0;
+}
+#endif
+
+/* An integer of either kind, unpacked into sign and magnitude.
+   The limbs may point into buf, so don't copy a Num. */
+typedef struct Num {
+  int negative;
+  int len;
+  const uint32_t* limbs;
+  uint32_t buf[sizeof(uintmax_t) / sizeof(uint32_t)];
+} Num;
+
+static void Unpack(Term* term, Num* num) {
+  if (IS_FIXNUM(term)) {
+    intptr_t n = FIXNUM_VALUE(term);
+    uintmax_t mag = n < 0 ? -(uintmax_t)n : (uintmax_t)n;
+    num->negative = n < 0;
+    num->len = 0;
+    while (mag) {
+      num->buf[num->len++] = (uint32_t)mag;
+      mag >>= 32;
+    }
+    num->limbs = num->buf;
+  } else if (IS_BIGNUM(term)) {
+    BigNum* b = AS_BIGNUM(term);
+    num->negative = b->negative;
+    num->len = b->len;
+    num->limbs = b->limbs;
+  } else {
+    DieShowingTerm("Not a number", term);
+  }
+}
+
+static uint32_t* NewLimbs(int len) {
+  return (uint32_t*)Alloc((len > 0 ? len : 1) * sizeof(uint32_t));
+}
+
+static int Normalize(const uint32_t* limbs, int len) {
+  while (len > 0 && limbs[len - 1] == 0)
+    len--;
+  return len;
+}
+
+/* Build a number from a sign and a magnitude, as a fixnum if
+   it fits. The limbs are freed. */
+static Term* Pack(MemPool* pool, int negative, uint32_t* limbs, int len) {
+  len = Normalize(limbs, len);
+  if (len * sizeof(uint32_t) <= sizeof(uintmax_t)) {
+    uintmax_t mag = 0;
+    for (int i = len - 1; i >= 0; i--) {
+      mag = (mag << 32) | limbs[i];
+    }
+    uintmax_t limit = negative ? (uintmax_t)FIXNUM_MAX + 1 : FIXNUM_MAX;
+    if (mag <= limit) {
+      free(limbs);
+      /* Written so that FIXNUM_MIN doesn't overflow. */
+      return MAKE_FIXNUM(mag == 0 ? 0
+          : negative ? -(intptr_t)(mag - 1) - 1 : (intptr_t)mag);
+    }
+  }
+  BigNum* b = NewBigNum(pool, len);
+  b->negative = negative;
+  memcpy(b->limbs, limbs, len * sizeof(uint32_t));
+  free(limbs);
+  return (Term*)b;
+}
+
+static int MagCompare(const Num* a, const Num* b) {
+  if (a->len != b->len)
+    return a->len < b->len ? -1 : 1;
+  for (int i = a->len - 1; i >= 0; i--) {
+    if (a->limbs[i] != b->limbs[i])
+      return a->limbs[i] < b->limbs[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+/* |a| + |b| */
+static uint32_t* MagAdd(const Num* a, const Num* b, int* len) {
+  int n = a->len > b->len ? a->len : b->len;
+  uint32_t* r = NewLimbs(n + 1);
+  uint64_t carry = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t sum = carry;
+    if (i < a->len) sum += a->limbs[i];
+    if (i < b->len) sum += b->limbs[i];
+    r[i] = (uint32_t)sum;
+    carry = sum >> 32;
+  }
+  r[n] = (uint32_t)carry;
+  *len = n + 1;
+  return r;
+}
+
+/* |a| - |b|, where |a| >= |b| */
+static uint32_t* MagSub(const Num* a, const Num* b, int* len) {
+  uint32_t* r = NewLimbs(a->len);
+  int64_t borrow = 0;
+  for (int i = 0; i < a->len; i++) {
+    int64_t diff = (int64_t)a->limbs[i] - borrow;
+    if (i < b->len) diff -= b->limbs[i];
+    borrow = diff < 0;
+    r[i] = (uint32_t)(diff + (borrow << 32));
+  }
+  assert(!borrow);
+  *len = a->len;
+  return r;
+}
+
+/* |a| * |b| */
+static uint32_t* MagMul(const Num* a, const Num* b, int* len) {
+  int n = a->len + b->len;
+  uint32_t* r = NewLimbs(n);
+  memset(r, 0, n * sizeof(uint32_t));
+  for (int i = 0; i < a->len; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < b->len; j++) {
+      uint64_t t = (uint64_t)a->limbs[i] * b->limbs[j] + r[i + j] + carry;
+      r[i + j] = (uint32_t)t;
+      carry = t >> 32;
+    }
+    r[i + b->len] = (uint32_t)carry;
+  }
+  *len = n;
+  return r;
+}
+
+/* Shift r (len limbs) left by one bit, shifting in bit. */
+static void ShiftInBit(uint32_t* r, int len, uint32_t bit) {
+  for (int i = 0; i < len; i++) {
+    uint32_t out = r[i] >> 31;
+    r[i] = (r[i] << 1) | bit;
+    bit = out;
+  }
+}
+
+/* |a| divided by |b| (b nonzero), by binary long division.
+   Both the quotient and the remainder have a->len limbs. */
+static void MagDivMod(const Num* a, const Num* b, uint32_t** q, uint32_t** r) {
+  int n = a->len;
+  *q = NewLimbs(n);
+  *r = NewLimbs(n + 1);
+  memset(*q, 0, n * sizeof(uint32_t));
+  memset(*r, 0, (n + 1) * sizeof(uint32_t));
+  for (int bit = n * 32 - 1; bit >= 0; bit--) {
+    ShiftInBit(*r, n + 1, (a->limbs[bit / 32] >> (bit % 32)) & 1);
+    Num rem;
+    rem.negative = 0;
+    rem.limbs = *r;
+    rem.len = Normalize(*r, n + 1);
+    if (MagCompare(&rem, b) >= 0) {
+      int len;
+      uint32_t* diff = MagSub(&rem, b, &len);
+      memset(*r, 0, (n + 1) * sizeof(uint32_t));
+      memcpy(*r, diff, len * sizeof(uint32_t));
+      free(diff);
+      (*q)[bit / 32] |= (uint32_t)1 << (bit % 32);
+    }
+  }
+}
+
+/* a + b, or a - b if subtract is set. */
+static Term* BigAdd(Term* a, Term* b, int subtract, MemPool* pool) {
+  Num x, y;
+  Unpack(a, &x);
+  Unpack(b, &y);
+  if (subtract)
+    y.negative = !y.negative;
+  int len;
+  uint32_t* r;
+  int negative;
+  if (x.negative == y.negative) {
+    r = MagAdd(&x, &y, &len);
+    negative = x.negative;
+  } else if (MagCompare(&x, &y) >= 0) {
+    r = MagSub(&x, &y, &len);
+    negative = x.negative;
+  } else {
+    r = MagSub(&y, &x, &len);
+    negative = y.negative;
+  }
+  return Pack(pool, negative, r, len);
+}
+
+static Term* BigMul(Term* a, Term* b, MemPool* pool) {
+  Num x, y;
+  Unpack(a, &x);
+  Unpack(b, &y);
+  int len;
+  uint32_t* r = MagMul(&x, &y, &len);
+  return Pack(pool, x.negative != y.negative, r, len);
+}
+
+/* Division truncates toward zero, so the remainder has the
+   sign of the dividend. */
+static Term* BigDivide(Term* a, Term* b, int wantRemainder, MemPool* pool) {
+  Num x, y;
+  Unpack(a, &x);
+  Unpack(b, &y);
+  if (y.len == 0) {
+    Die("Division by zero.");
+  }
+  uint32_t* q;
+  uint32_t* r;
+  MagDivMod(&x, &y, &q, &r);
+  if (wantRemainder) {
+    free(q);
+    return Pack(pool, x.negative, r, x.len + 1);
+  }
+  free(r);
+  return Pack(pool, x.negative != y.negative, q, x.len);
+}
+
+Term* NumberAdd(Term* a, Term* b, MemPool* pool) {
+  intptr_t r;
+  /* (2x + 1) + (2y + 1) - 1 = 2(x + y) + 1 */
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b)
+      && !ADD_OVERFLOW((intptr_t)a, (intptr_t)b - FIXNUM_TAG, &r)))
+    return (Term*)r;
+  return BigAdd(a, b, 0, pool);
+}
+
+Term* NumberSubtract(Term* a, Term* b, MemPool* pool) {
+  intptr_t r;
+  /* (2x + 1) - (2y + 1) + 1 = 2(x - y) + 1 */
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b)
+      && !SUB_OVERFLOW((intptr_t)a, (intptr_t)b - FIXNUM_TAG, &r)))
+    return (Term*)r;
+  return BigAdd(a, b, 1, pool);
+}
+
+Term* NumberMultiply(Term* a, Term* b, MemPool* pool) {
+  intptr_t r;
+  /* x * 2y + 1 = 2xy + 1, and 2xy can't be the largest word. */
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b)
+      && !MUL_OVERFLOW(FIXNUM_VALUE(a), (intptr_t)b - FIXNUM_TAG, &r)))
+    return (Term*)(r | FIXNUM_TAG);
+  return BigMul(a, b, pool);
+}
+
+Term* NumberQuotient(Term* a, Term* b, MemPool* pool) {
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b) && FIXNUM_VALUE(b) != 0)) {
+    /* Only FIXNUM_MIN / -1 is out of range. */
+    intptr_t q = FIXNUM_VALUE(a) / FIXNUM_VALUE(b);
+    if (LIKELY(q <= FIXNUM_MAX))
+      return MAKE_FIXNUM(q);
+  }
+  return BigDivide(a, b, 0, pool);
+}
+
+Term* NumberRemainder(Term* a, Term* b, MemPool* pool) {
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b) && FIXNUM_VALUE(b) != 0))
+    return MAKE_FIXNUM(FIXNUM_VALUE(a) % FIXNUM_VALUE(b));
+  return BigDivide(a, b, 1, pool);
+}
+
+/* Returns -1, 0 or 1 as a is less than, equal to or greater than b. */
+int NumberCompare(Term* a, Term* b) {
+  /* Tagging preserves the order of fixnums. */
+  if (LIKELY(IS_FIXNUM(a) && IS_FIXNUM(b)))
+    return (intptr_t)a < (intptr_t)b ? -1 : (intptr_t)a > (intptr_t)b;
+  Num x, y;
+  Unpack(a, &x);
+  Unpack(b, &y);
+  if (x.negative != y.negative)
+    return x.negative ? -1 : 1;
+  int c = MagCompare(&x, &y);
+  return x.negative ? -c : c;
+}
+
+/* Parse an optionally signed decimal integer of any size. */
+Term* ParseInteger(MemPool* pool, const char* text, int len) {
+  int negative = 0;
+  int i = 0;
+  if (i < len && (text[i] == '-' || text[i] == '+')) {
+    negative = text[i] == '-';
+    i++;
+  }
+  /* Each decimal digit needs less than four bits. */
+  int maxLen = (len * 4) / 32 + 1;
+  uint32_t* limbs = NewLimbs(maxLen);
+  memset(limbs, 0, maxLen * sizeof(uint32_t));
+  for (; i < len; i++) {
+    assert(text[i] >= '0' && text[i] <= '9');
+    uint64_t carry = text[i] - '0';
+    for (int j = 0; j < maxLen; j++) {
+      uint64_t t = (uint64_t)limbs[j] * 10 + carry;
+      limbs[j] = (uint32_t)t;
+      carry = t >> 32;
+    }
+  }
+  return Pack(pool, negative, limbs, maxLen);
+}
+
+void PrintBigNum(FILE* f, Term* term) {
+  BigNum* b = AS_BIGNUM(term);
+  /* Peel off nine decimal digits at a time. */
+  int len = b->len;
+  uint32_t* mag = NewLimbs(len);
+  memcpy(mag, b->limbs, len * sizeof(uint32_t));
+  uint32_t* chunks = NewLimbs(len * 2);
+  int chunkCount = 0;
+  while (len > 0) {
+    uint64_t rem = 0;
+    for (int i = len - 1; i >= 0; i--) {
+      uint64_t t = (rem << 32) | mag[i];
+      mag[i] = (uint32_t)(t / 1000000000);
+      rem = t % 1000000000;
+    }
+    chunks[chunkCount++] = (uint32_t)rem;
+    len = Normalize(mag, len);
+  }
+  if (b->negative)
+    fprintf(f, "-");
+  fprintf(f, "%u", (unsigned)chunks[chunkCount - 1]);
+  for (int i = chunkCount - 2; i >= 0; i--) {
+    fprintf(f, "%09u", (unsigned)chunks[i]);
+  }
+  free(chunks);
+  free(mag);
+}
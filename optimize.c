@@ -0,0 +1,269 @@
+/*
+The optimizer runs over each top-level form after the resolver
+(see resolve.c), and rewrites it into a form that does the same
+with less work at run time:
+
+- A quote form becomes its quoted term, wrapped in a T_LITERAL
+  term unless it evaluates to itself.
+- A call to a pure builtin (see the bif struct) whose arguments
+  are all numbers is made now, and replaced with its result.
+- A call to a function defined in place, as in
+  ((fun f (x) body) arg), is replaced with the function's body
+  when the body is a single small term that defines no functions
+  and the arguments are simple enough to be evaluated any number
+  of times: constants and variables. Such a function can't call
+  itself, since it has no name in scope.
+- Terms with no side effects are dropped from anywhere but the
+  end of a begin form or a function body.
+
+Like the resolver, it rewrites the form in place where it can.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "datatype.h"
+
+/* Inline function bodies of up to this many terms. */
+#define INLINE_MAX_SIZE 32
+
+typedef struct Optimizer {
+  Env* env;
+  MemPool* pool;
+} Optimizer;
+
+static Term* OptimizeTerm(Optimizer* opt, Term* iTerm);
+
+/* The special form that a symbol at the head of a form names.
+   The resolver leaves only those symbols unresolved. */
+static DataType SpecialFormType(Optimizer* opt, Term* iHead) {
+  if (!IS_SYMBOL(iHead))
+    return T_PRIM_NIL;
+  Term* eHead = EnvLookup(opt->env, iHead);
+  if (eHead == ENV_LOOKUP_FAILED)
+    return T_PRIM_NIL;
+  return TYPE_OF(eHead);
+}
+
+/* The value of a global reference, if it's bound. */
+static Term* GlobalValue(Optimizer* opt, Term* iRef) {
+  Term* eValue = EnvLookup(opt->env, iRef->value.globalRef.name);
+  return eValue == ENV_LOOKUP_FAILED ? 0 : eValue;
+}
+
+static Term* NewLiteral(Optimizer* opt, Term* value) {
+  switch (TYPE_OF(value)) {
+    case T_PRIM_NIL:
+    case T_NUMBER:
+    case T_BIGNUM:
+    case T_STRING:
+      return value; /* Evaluates to itself. */
+    default: {
+      Term* literal = NewAtom(opt->pool, T_LITERAL);
+      literal->value.literal.value = value;
+      return literal;
+    }
+  }
+}
+
+static int IsConstant(Term* iTerm) {
+  switch (TYPE_OF(iTerm)) {
+    case T_PRIM_NIL:
+    case T_NUMBER:
+    case T_BIGNUM:
+    case T_STRING:
+    case T_LITERAL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Evaluating the term has no effect, and can't fail. */
+static int IsSideEffectFree(Optimizer* opt, Term* iTerm) {
+  if (IsConstant(iTerm) || IS_LOCAL_REF(iTerm) || IS_FUN_DEF(iTerm))
+    return 1;
+  if (IS_GLOBAL_REF(iTerm))
+    return GlobalValue(opt, iTerm) != 0;
+  return 0;
+}
+
+/* Drop the terms with no side effects from all but the end of a
+   sequence. Returns null if nothing was dropped. */
+static Term* DropDeadTerms(Optimizer* opt, Term* iList) {
+  int count = 0;
+  int live = 0;
+  for (Term* node = iList; node; node = TAIL(node)) {
+    count++;
+    if (!TAIL(node) || !IsSideEffectFree(opt, HEAD(node)))
+      live++;
+  }
+  if (live == count)
+    return 0;
+  Term** elements = (Term**)Alloc(live * sizeof(Term*));
+  int i = 0;
+  for (Term* node = iList; node; node = TAIL(node)) {
+    if (!TAIL(node) || !IsSideEffectFree(opt, HEAD(node)))
+      elements[i++] = HEAD(node);
+  }
+  Term* list = NewList(opt->pool, elements, live);
+  free(elements);
+  return list;
+}
+
+/* Optimize each term of a sequence, as in a begin form or a
+   function body, and return the sequence. */
+static Term* OptimizeSequence(Optimizer* opt, Term* iList) {
+  for (Term* node = iList; node; node = TAIL(node)) {
+    SET_HEAD(node, OptimizeTerm(opt, HEAD(node)));
+  }
+  Term* live = DropDeadTerms(opt, iList);
+  return live ? live : iList;
+}
+
+/* A call to a pure builtin with only numbers for arguments. */
+static Term* FoldCall(Optimizer* opt, Term* iForm) {
+  Term* iHead = HEAD(iForm);
+  if (!IS_GLOBAL_REF(iHead))
+    return 0;
+  Term* eFun = GlobalValue(opt, iHead);
+  if (!IS_FUN_NATIVE(eFun) || !eFun->value.bif.pure)
+    return 0;
+  int argc = 0;
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    if (!IS_NUMBER(HEAD(iArg)))
+      return 0;
+    argc++;
+  }
+  int arity = eFun->value.bif.arity;
+  if (argc == 0 || (arity != ARITY_VARIADIC && argc != arity))
+    return 0;
+  Term** argv = (Term**)Alloc(argc * sizeof(Term*));
+  int i = 0;
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    argv[i++] = HEAD(iArg);
+  }
+  Term* eResult = eFun->value.bif.arrayFunPtr(argc, argv, opt->pool);
+  free(argv);
+  return NewLiteral(opt, eResult);
+}
+
+/* The number of terms in a function body that can be inlined,
+   or -1 if it can't. */
+static int InlineSize(Optimizer* opt, Term* iTerm) {
+  if (IS_FUN_DEF(iTerm))
+    return -1;
+  if (!IS_CONS(iTerm))
+    return 1;
+  DataType form = SpecialFormType(opt, HEAD(iTerm));
+  if (form == T_PRIM_QUOTE)
+    return 1;
+  if (form == T_PRIM_FUN)
+    return -1;
+  int size = 0;
+  for (; iTerm; iTerm = TAIL(iTerm)) {
+    int termSize = InlineSize(opt, HEAD(iTerm));
+    if (termSize < 0)
+      return -1;
+    size += termSize;
+  }
+  return size;
+}
+
+/* Replace the function's references to its arguments with the
+   arguments themselves, and its references to captured variables
+   with the references that the closure would capture them with. */
+static Term* Substitute(Optimizer* opt, Term* iTerm, Term** args, Term* captures) {
+  if (IS_LOCAL_REF(iTerm)) {
+    int slot = iTerm->value.localRef.slot;
+    if (!iTerm->value.localRef.captured)
+      return args[slot];
+    while (slot-- > 0)
+      captures = TAIL(captures);
+    return HEAD(captures);
+  }
+  if (!IS_CONS(iTerm) || SpecialFormType(opt, HEAD(iTerm)) == T_PRIM_QUOTE)
+    return iTerm;
+  for (Term* node = iTerm; node; node = TAIL(node)) {
+    SET_HEAD(node, Substitute(opt, HEAD(node), args, captures));
+  }
+  return iTerm;
+}
+
+/* A call whose head is a function definition. The arguments
+   have been optimized already. */
+static Term* InlineCall(Optimizer* opt, Term* iForm) {
+  Term* iFunDef = HEAD(iForm);
+  Term* funBody = iFunDef->value.funDef.funBody;
+  if (TAIL(funBody) || InlineSize(opt, HEAD(funBody)) > INLINE_MAX_SIZE
+      || InlineSize(opt, HEAD(funBody)) < 0)
+    return 0;
+  int arity = ListLength(iFunDef->value.funDef.funArgs);
+  if (ListLength(TAIL(iForm)) != arity)
+    return 0;
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    if (!IsSideEffectFree(opt, HEAD(iArg)) || IS_FUN_DEF(HEAD(iArg)))
+      return 0;
+  }
+  Term** args = (Term**)Alloc((arity ? arity : 1) * sizeof(Term*));
+  int i = 0;
+  for (Term* iArg = TAIL(iForm); iArg; iArg = TAIL(iArg)) {
+    args[i++] = HEAD(iArg);
+  }
+  /* The function is only used here, so its body can be
+     rewritten in place. */
+  Term* iBody = Substitute(opt, HEAD(funBody), args, iFunDef->value.funDef.captures);
+  free(args);
+  return OptimizeTerm(opt, iBody);
+}
+
+static Term* OptimizeForm(Optimizer* opt, Term* iForm) {
+  switch (SpecialFormType(opt, HEAD(iForm))) {
+    case T_PRIM_QUOTE:
+      if (!IS_CONS(TAIL(iForm)) || TAIL(TAIL(iForm)))
+        return iForm; /* Malformed; let the interpreter say so. */
+      return NewLiteral(opt, HEAD(TAIL(iForm)));
+    case T_PRIM_BEGIN: {
+      Term* iBody = OptimizeSequence(opt, TAIL(iForm));
+      if (!iBody)
+        return 0;
+      if (!TAIL(iBody))
+        return HEAD(iBody);
+      if (iBody != TAIL(iForm))
+        iForm = NewCons(opt->pool, HEAD(iForm), iBody);
+      return iForm;
+    }
+    case T_PRIM_FUN:
+      /* Not resolved as a definition, so malformed. */
+      return iForm;
+    default:
+      break;
+  }
+  for (Term* node = iForm; node; node = TAIL(node)) {
+    SET_HEAD(node, OptimizeTerm(opt, HEAD(node)));
+  }
+  Term* iResult = 0;
+  if (IS_FUN_DEF(HEAD(iForm))) {
+    iResult = InlineCall(opt, iForm);
+  } else {
+    iResult = FoldCall(opt, iForm);
+  }
+  return iResult ? iResult : iForm;
+}
+
+static Term* OptimizeTerm(Optimizer* opt, Term* iTerm) {
+  if (IS_CONS(iTerm))
+    return OptimizeForm(opt, iTerm);
+  if (IS_FUN_DEF(iTerm)) {
+    iTerm->value.funDef.funBody =
+      OptimizeSequence(opt, iTerm->value.funDef.funBody);
+  }
+  return iTerm;
+}
+
+Term* Optimize(Term* iProgram, Env* env, MemPool* pool) {
+  Optimizer opt;
+  opt.env = env;
+  opt.pool = pool;
+  return OptimizeTerm(&opt, iProgram);
+}
@@ -1,28 +1,40 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "datatype.h"
 #include "lexer.h"
 #include "parser.h"
 
 typedef struct {
+  MemPool* pool;
   const char* code;
   Token* tokens;
   int tokenCount;
   int nextToken;
+  /* Elements of the lists being parsed, innermost last. */
+  Term** elements;
+  int elementCount;
+  int elementCapacity;
 } ParseInfo;
 
 // TODO: Handle more than just integers.
-int ParseNumber(const char* text, int length) {
+Term* ParseNumber(MemPool* pool, const char* text, int length) {
   char *endptr;
   errno = 0;
-  long n = strtol(text, &endptr, 10);
+  long long n = strtoll(text, &endptr, 10);
   // Since the string isn't null-terminated,
   // instead of checking that *endptr=='\0' we
   // check if it was advanced the right number
   // of characters.
+  if (endptr - text == length && (errno == ERANGE
+      || n < (long long)FIXNUM_MIN || n > (long long)FIXNUM_MAX)) {
+    // Too big for a fixnum.
+    return ParseInteger(pool, text, length);
+  }
   if (errno != 0 || endptr - text < length) {
     fprintf(stderr, "Failed to parse number: ");
     fwrite(text, 1, length, stderr);
@@ -33,13 +45,7 @@ int ParseNumber(const char* text, int length) {
       fprintf(stderr, "endptr: %d\n", *endptr);
     exit(1);
   }
-  if (n < (long)INT_MIN || n > (long)INT_MAX) {
-    fprintf(stderr, "Number out of range: ");
-    fwrite(text, 1, length, stderr);
-    fprintf(stderr, "\n");
-    exit(1);
-  }
-  return (int)n;
+  return MAKE_FIXNUM(n);
 }
 
 Term* ParseAtom(ParseInfo* parseInfo, Token* token) {
@@ -47,21 +53,27 @@ Term* ParseAtom(ParseInfo* parseInfo, Token* token) {
   const char* tokenText = parseInfo->code + token->offset;
   switch (token->type) {
     case TOK_IDENTIFIER:
-      // TODO: Intern symbols.
-      term = NewAtom(0, T_SYMBOL);
-      term->value.string.text = tokenText;
-      term->value.string.len = token->length;
+      term = InternSymbol(tokenText, token->length);
       break;
     case TOK_STRING:
       // TODO: Copy strings to a consolidated space.
-      term = NewAtom(0, T_STRING);
+      term = NewAtom(parseInfo->pool, T_STRING);
       term->value.string.text = tokenText;
       term->value.string.len = token->length;
       break;
     case TOK_NUMBER:
-      term = NewAtom(0, T_NUMBER);
-      term->value.number.n = ParseNumber(tokenText, token->length);
+      term = ParseNumber(parseInfo->pool, tokenText, token->length);
       break;
+    case TOK_ERROR:
+      /* The lexer stops at a string with no closing quote, or at a
+         character that can't start a token. */
+      if (*tokenText == '"') {
+        fprintf(stderr, "Unterminated string at offset %d.\n", token->offset);
+      } else {
+        fprintf(stderr, "Unexpected character at offset %d: %c\n",
+                token->offset, *tokenText);
+      }
+      exit(1);
     default:
       fprintf(stderr, "Unexpected token type: %d\n", token->type);
       exit(1);
@@ -69,9 +81,22 @@ Term* ParseAtom(ParseInfo* parseInfo, Token* token) {
   return term;
 }
 
+static void PushElement(ParseInfo* parseInfo, Term* element) {
+  if (parseInfo->elementCount == parseInfo->elementCapacity) {
+    parseInfo->elementCapacity =
+      parseInfo->elementCapacity ? parseInfo->elementCapacity * 2 : 256;
+    parseInfo->elements = (Term**)Realloc(parseInfo->elements,
+        parseInfo->elementCapacity * sizeof(Term*));
+  }
+  parseInfo->elements[parseInfo->elementCount++] = element;
+}
+
+/* The elements are collected first so that the list can be
+   allocated as a single CDR-coded run. While profiling, the
+   profiler is told where each list starts in the source. */
 Term* ParseList(ParseInfo* parseInfo) {
-  Term* listHead = 0;
-  Term* listTail = 0;
+  int firstElement = parseInfo->elementCount;
+  int open = parseInfo->nextToken - 1; /* -1 for the whole program. */
   for (;;) {
     Token* nextToken = &parseInfo->tokens[parseInfo->nextToken];
     parseInfo->nextToken++;
@@ -88,25 +113,29 @@ Term* ParseList(ParseInfo* parseInfo) {
     } else {
       newNode = ParseAtom(parseInfo, nextToken);
     }
-    Term* newListPair = NewCons(0, newNode, 0);
-    if (!listHead) {
-      listHead = newListPair;
-      listTail = newListPair;
-    } else {
-      TAIL(listTail) = newListPair;
-      listTail = TAIL(listTail);
-    }
+    PushElement(parseInfo, newNode);
   }
-  return listHead;
+  Term* list = NewList(parseInfo->pool, parseInfo->elements + firstElement,
+                       parseInfo->elementCount - firstElement);
+  parseInfo->elementCount = firstElement;
+  if (profiling && open >= 0) {
+    ProfileNoteList(list, parseInfo->code + parseInfo->tokens[open].offset);
+  }
+  return list;
 }
 
-Term* Parse(const char* code, Token* tokens, int tokenCount) {
+Term* Parse(MemPool* pool, const char* code, Token* tokens, int tokenCount) {
   ParseInfo parseInfo;
+  parseInfo.pool = pool;
   parseInfo.code = code;
   parseInfo.tokens = tokens;
   parseInfo.tokenCount = tokenCount;
   parseInfo.nextToken = 0;
+  parseInfo.elements = 0;
+  parseInfo.elementCount = 0;
+  parseInfo.elementCapacity = 0;
   Term* program = ParseList(&parseInfo);
+  free(parseInfo.elements);
   if (parseInfo.nextToken < parseInfo.tokenCount) {
     fprintf(stderr, "Unmatched right parenthesis.\n");
     exit(1);
@@ -114,15 +143,129 @@ Term* Parse(const char* code, Token* tokens, int tokenCount) {
   return program;
 }
 
+/*
+Parallel parsing.
+
+Top-level forms don't depend on each other until they're evaluated,
+so a large source file can be split between top-level forms and the
+pieces lexed and parsed at the same time, each on its own thread
+and into its own pool. The forms are then put back together into
+one program, in their original order.
+
+Finding the split points takes a quick pass over the code that
+only tracks parenthesis depth and strings. The split points are
+the first top-level boundaries after equally spaced offsets.
+*/
+
+/* Smaller chunks aren't worth a thread. */
+#define PARALLEL_MIN_CHUNK_SIZE 0x40000 // 256 KB
+
+typedef struct ParseChunk {
+  const char* code;
+  size_t len;
+  MemPool* pool;
+  Term* forms;
+} ParseChunk;
+
+static void ParseChunkTask(void* arg) {
+  ParseChunk* chunk = (ParseChunk*)arg;
+  Token* tokens;
+  int tokenCount = LexRange(chunk->code, chunk->len, &tokens);
+  chunk->pool = NewMemPool();
+  chunk->forms = Parse(chunk->pool, chunk->code, tokens, tokenCount);
+  free(tokens);
+}
+
+/* Split the code into at most maxChunks chunks that each hold
+   whole top-level forms, and store the offset of the end of each
+   chunk in ends. Returns the number of chunks. Unbalanced code
+   ends up in the last chunk, where parsing it reports the error. */
+static int SplitTopLevel(const char* code, size_t len, size_t* ends, int maxChunks) {
+  size_t chunkSize = len / maxChunks;
+  size_t nextSplit = chunkSize;
+  int chunkCount = 0;
+  int depth = 0;
+  for (size_t i = 0; i < len && chunkCount < maxChunks - 1; i++) {
+    char c = code[i];
+    if (c == '"') {
+      for (i++; i < len && code[i] != '"'; i++) {
+        if (code[i] == '\\')
+          i++;
+      }
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      depth--;
+      if (depth == 0 && i + 1 >= nextSplit) {
+        ends[chunkCount++] = i + 1;
+        nextSplit = i + 1 + chunkSize;
+      }
+    }
+  }
+  ends[chunkCount++] = len;
+  return chunkCount;
+}
+
+/* Parse a program using as many threads as there are processors,
+   or fewer for small programs. Token offsets in error messages are
+   relative to the start of the chunk. */
+Term* ParseParallel(MemPool* pool, const char* code, size_t len) {
+  int maxChunks = ProcessorCount();
+  if (len / PARALLEL_MIN_CHUNK_SIZE < (size_t)maxChunks)
+    maxChunks = len / PARALLEL_MIN_CHUNK_SIZE;
+  if (maxChunks < 1)
+    maxChunks = 1;
+  size_t* ends = (size_t*)Alloc(maxChunks * sizeof(size_t));
+  int chunkCount = SplitTopLevel(code, len, ends, maxChunks);
+  ParseChunk* chunks = (ParseChunk*)Alloc(chunkCount * sizeof(ParseChunk));
+  void** args = (void**)Alloc(chunkCount * sizeof(void*));
+  size_t start = 0;
+  for (int i = 0; i < chunkCount; i++) {
+    chunks[i].code = code + start;
+    chunks[i].len = ends[i] - start;
+    args[i] = &chunks[i];
+    start = ends[i];
+  }
+  ShareSymbols(1);
+  RunParallel(ParseChunkTask, args, chunkCount);
+  ShareSymbols(0);
+  /* Put the forms back together as one list. */
+  int formCount = 0;
+  for (int i = 0; i < chunkCount; i++) {
+    formCount += ListLength(chunks[i].forms);
+  }
+  Term** forms = (Term**)Alloc((formCount + 1) * sizeof(Term*));
+  formCount = 0;
+  for (int i = 0; i < chunkCount; i++) {
+    for (Term* f = chunks[i].forms; f; f = TAIL(f)) {
+      forms[formCount++] = HEAD(f);
+    }
+    AdoptMemPool(pool, chunks[i].pool);
+  }
+  Term* program = NewList(pool, forms, formCount);
+  free(forms);
+  free(args);
+  free(chunks);
+  free(ends);
+  return program;
+}
+
 void PrintAtomText(FILE* f, Term* atom) {
   fwrite(atom->value.string.text, 1, atom->value.string.len, f);
 }
 
+/* A pair made by cons can end in something other than a list,
+   which is printed dotted. */
 void PrintList(FILE* f, Term* list) {
   Term* node = list;
   while (node) {
     if (node != list)
       fprintf(f, " ");
+    if (!IS_CONS(node)) {
+      fprintf(f, ". ");
+      PrintTerm(f, node);
+      break;
+    }
     Term* head = HEAD(node);
     PrintTerm(f, head);
     node = TAIL(node);
@@ -134,7 +277,7 @@ void PrintTerm(FILE* f, Term* atom) {
     fprintf(f, "#nil");
     return;
   }
-  switch (atom->type) {
+  switch (TYPE_OF(atom)) {
     case T_CONS:
       fprintf(f, "(");
       PrintList(f, atom);
@@ -142,12 +285,31 @@ void PrintTerm(FILE* f, Term* atom) {
       break;
     case T_SYMBOL:
     case T_STRING:      PrintAtomText(f, atom); break;
-    case T_NUMBER:      fprintf(f, "%d", atom->value.number.n); break;
+    case T_LOCAL_REF:   PrintTerm(f, atom->value.localRef.name); break;
+    case T_GLOBAL_REF:  PrintTerm(f, atom->value.globalRef.name); break;
+    case T_LITERAL:
+      fprintf(f, "(quote ");
+      PrintTerm(f, atom->value.literal.value);
+      fprintf(f, ")");
+      break;
+    case T_FUN_DEF:
+      fprintf(f, "(fun (");
+      PrintList(f, atom->value.funDef.funArgs);
+      fprintf(f, ") ");
+      PrintList(f, atom->value.funDef.funBody);
+      fprintf(f, ")");
+      break;
+    case T_FRAME:       fprintf(f, "#frame"); break;
+    case T_NUMBER:      fprintf(f, "%ld", (long)FIXNUM_VALUE(atom)); break;
+    case T_BIGNUM:      PrintBigNum(f, atom); break;
+    case T_PRIM_BOOL:   fprintf(f, CONSTANT_VALUE(atom) ? "#t" : "#f"); break;
     case T_PRIM_FUN:    fprintf(f, "#fun"); break;
     case T_PRIM_QUOTE:  fprintf(f, "#quote"); break;
     case T_PRIM_BEGIN:  fprintf(f, "#begin"); break;
+    case T_PRIM_DEFMACRO: fprintf(f, "#defmacro"); break;
     case T_FUN_NATIVE:
-    case T_FUN_USER:    fprintf(f, "#function"); break;
+    case T_FUN_USER:
+    case T_FUN_COMPILED: fprintf(f, "#function"); break;
     case T_FUN_MACRO:   fprintf(f, "#macro"); break;
     case T_PRIM_NIL: break; // Handled above.
   }
@@ -22,6 +22,14 @@ typedef struct SyntaxNode {
 } SyntaxNode;
 */
 
-Term* Parse(const char* code, Token* tokens, int tokenCount);
+Term* Parse(MemPool* pool, const char* code, Token* tokens, int tokenCount);
+Term* ParseParallel(MemPool* pool, const char* code, size_t len);
+Term* ParseNumber(MemPool* pool, const char* text, int length);
+
+/* Streaming reader (see reader.c). */
+typedef struct Reader Reader;
+Reader* NewReader(FILE* f);
+void FreeReader(Reader* reader);
+int ReadForm(Reader* reader, MemPool* pool, Term** form);
 void PrintProgram(Term* program);
 
@@ -0,0 +1,339 @@
+/*
+The sampling profiler (ByteSize --profile OUT FILE).
+
+The interpreter keeps a shadow stack of what it's running: the
+top-level form, then each user function (or macro) that has been
+called and hasn't returned. A tail call takes over its caller's
+entry, as it takes over its caller's C stack frame (see
+InterpretTerm). Each thread has its own stack.
+
+A SIGPROF timer samples the stack of whichever thread is running
+every millisecond of CPU time. The handler can't allocate, so it
+counts the samples of each distinct stack in a hash table that is
+allocated up front, and drops a sample if the table is full.
+
+On exit the stacks are written to OUT as folded stacks, the input
+format of flamegraph.pl (and speedscope): one line per stack, with
+its frames from the outermost in, separated by semicolons, and then
+the number of samples. A frame is named after the function and the
+line that its definition starts on, which come from the source
+positions of lists that the parser notes while profiling. A
+function that wasn't in the source (e.g. one made by a macro) is
+just #function.
+
+Only the tree walker keeps the stack up to date. Under --vm, calls
+made by bytecode (or by code that the JIT compiled) don't show up,
+only the forms and the functions that builtins such as map call.
+*/
+
+/* For sigaction and setitimer, which --std=c99 leaves out. */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "datatype.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#define PROFILE_INTERVAL_USEC 1000
+/* Entries in each thread's shadow stack. Deeper calls aren't
+   recorded. */
+#define PROFILE_STACK_SIZE 16384
+/* The innermost frames that are kept of each sample. */
+#define PROFILE_SAMPLE_DEPTH 256
+/* Distinct stacks that can be counted (a power of 2), and the
+   frames that they can hold between them. */
+#define PROFILE_TABLE_SIZE 16384
+#define PROFILE_FRAME_POOL_SIZE (1 << 20)
+
+/* Frames are the funBody of the function that was called, or the
+   top-level form. Both are parsed terms, which stay put. */
+typedef struct ShadowStack {
+  const void* volatile* frames;
+  volatile int depth;
+} ShadowStack;
+
+typedef struct ProfileStack {
+  unsigned hash;
+  int count;          /* Samples. Zero for an unused entry. */
+  int frameCount;
+  int truncated;      /* Outer frames were dropped. */
+  int deeper;         /* Inner frames were never recorded. */
+  const void** frames;
+} ProfileStack;
+
+/* A list in the source: the run of cells from start to last, and
+   where its opening parenthesis is. */
+typedef struct SourceList {
+  Term* start;
+  Term* last;
+  const char* pos;
+} SourceList;
+
+int profiling;
+static THREAD_LOCAL ShadowStack shadowStack;
+
+static const char* profileOut;
+static const char* sourceCode;
+static size_t sourceLen;
+
+static ProfileStack* stacks;
+static int stackCount;
+static const void** framePool;
+static int framePoolUsed;
+static volatile int sampleLock;
+static volatile unsigned long sampleCount;
+static volatile unsigned long droppedCount;
+
+static SourceList* sourceLists;
+static int sourceListCount;
+static int sourceListCapacity;
+static Lock sourceListLock; /* For parallel parsing. */
+
+/* Note where a list that the parser made starts in the source. */
+void ProfileNoteList(Term* list, const char* pos) {
+  if (!list)
+    return;
+  Term* last = list;
+  while (TAIL(last)) {
+    last = TAIL(last);
+  }
+  AcquireLock(&sourceListLock);
+  if (sourceListCount == sourceListCapacity) {
+    sourceListCapacity = sourceListCapacity ? sourceListCapacity * 2 : 1024;
+    sourceLists = (SourceList*)Realloc(sourceLists,
+        sourceListCapacity * sizeof(SourceList));
+  }
+  SourceList* sl = &sourceLists[sourceListCount++];
+  sl->start = list;
+  sl->last = last;
+  sl->pos = pos;
+  ReleaseLock(&sourceListLock);
+}
+
+int ProfileDepth() {
+  return shadowStack.depth;
+}
+
+/* Make the key the entry of the shadow stack at the given depth,
+   and the top of the stack. The entry is written before the depth,
+   so a sample never sees a stale one. */
+void ProfileEnter(int depth, const void* key) {
+  if (!shadowStack.frames) {
+    shadowStack.frames =
+      (const void* volatile*)Alloc(PROFILE_STACK_SIZE * sizeof(void*));
+  }
+  if (depth < PROFILE_STACK_SIZE) {
+    shadowStack.frames[depth] = key;
+  }
+  shadowStack.depth = depth + 1;
+}
+
+void ProfileLeave(int depth) {
+  shadowStack.depth = depth;
+}
+
+static unsigned HashFrames(const void* volatile* frames, int count) {
+  unsigned hash = 2166136261u; /* FNV-1a, a pointer at a time. */
+  for (int i = 0; i < count; i++) {
+    hash = (hash ^ (unsigned)((uintptr_t)frames[i] >> 4)) * 16777619u;
+  }
+  return hash;
+}
+
+/* Count a sample of the running thread's shadow stack. */
+static void RecordSample() {
+  int depth = shadowStack.depth;
+  int top = depth < PROFILE_STACK_SIZE ? depth : PROFILE_STACK_SIZE;
+  if (!shadowStack.frames)
+    top = 0;
+  int first = top > PROFILE_SAMPLE_DEPTH ? top - PROFILE_SAMPLE_DEPTH : 0;
+  const void* volatile* frames = shadowStack.frames + first;
+  int frameCount = top - first;
+  int deeper = depth > top;
+  unsigned hash = HashFrames(frames, frameCount) ^ (first > 0) ^ (deeper << 1);
+  unsigned mask = PROFILE_TABLE_SIZE - 1;
+  for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+    ProfileStack* stack = &stacks[i];
+    if (!stack->count) {
+      if (stackCount >= PROFILE_TABLE_SIZE * 3 / 4
+          || framePoolUsed + frameCount > PROFILE_FRAME_POOL_SIZE) {
+        droppedCount++;
+        return;
+      }
+      stack->hash = hash;
+      stack->frameCount = frameCount;
+      stack->truncated = first > 0;
+      stack->deeper = deeper;
+      stack->frames = framePool + framePoolUsed;
+      for (int j = 0; j < frameCount; j++) {
+        stack->frames[j] = frames[j];
+      }
+      framePoolUsed += frameCount;
+      stackCount++;
+      stack->count = 1;
+      return;
+    }
+    if (stack->hash == hash && stack->frameCount == frameCount
+        && stack->truncated == (first > 0) && stack->deeper == deeper) {
+      int j = 0;
+      while (j < frameCount && stack->frames[j] == frames[j]) {
+        j++;
+      }
+      if (j == frameCount) {
+        stack->count++;
+        return;
+      }
+    }
+  }
+}
+
+#ifndef _WIN32
+static void OnProfileSignal(int sig) {
+  int savedErrno = errno;
+  /* Another thread may be in here too. */
+  if (__sync_lock_test_and_set(&sampleLock, 1)) {
+    droppedCount++;
+  } else {
+    sampleCount++;
+    RecordSample();
+    __sync_lock_release(&sampleLock);
+  }
+  errno = savedErrno;
+}
+#endif
+
+static int CompareSourceLists(const void* a, const void* b) {
+  const SourceList* x = (const SourceList*)a;
+  const SourceList* y = (const SourceList*)b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* The source list whose run of cells holds the cell. */
+static SourceList* FindSourceList(const void* cell) {
+  int lo = 0;
+  int hi = sourceListCount - 1;
+  SourceList* found = 0;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if ((const void*)sourceLists[mid].start <= cell) {
+      found = &sourceLists[mid];
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found && cell <= (const void*)found->last ? found : 0;
+}
+
+static int LineOf(const char* pos) {
+  if (pos < sourceCode || pos > sourceCode + sourceLen)
+    return 0;
+  int line = 1;
+  for (const char* p = sourceCode; p < pos; p++) {
+    if (*p == '\n')
+      line++;
+  }
+  return line;
+}
+
+/* The name of a frame: the top-level form, or the function whose
+   body is the frame. */
+static void WriteFrame(FILE* f, const void* frame) {
+  SourceList* sl = FindSourceList(frame);
+  if (!sl) {
+    fprintf(f, "#function");
+    return;
+  }
+  if (frame == sl->start) {
+    fprintf(f, "form:%d", LineOf(sl->pos));
+    return;
+  }
+  /* The body is part of (fun name (args...) body...). */
+  Term* name = TAIL(sl->start) ? HEAD(TAIL(sl->start)) : 0;
+  if (IS_SYMBOL(name)) {
+    PrintTerm(f, name);
+  } else {
+    fprintf(f, "fun");
+  }
+  fprintf(f, ":%d", LineOf(sl->pos));
+}
+
+static void WriteProfile() {
+#ifndef _WIN32
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, 0);
+  signal(SIGPROF, SIG_IGN);
+#endif
+  FILE* f = fopen(profileOut, "w");
+  if (!f) {
+    fprintf(stderr, "Unable to open file: %s\n", profileOut);
+    return;
+  }
+  qsort(sourceLists, sourceListCount, sizeof(SourceList), CompareSourceLists);
+  for (int i = 0; i < PROFILE_TABLE_SIZE; i++) {
+    ProfileStack* stack = &stacks[i];
+    if (!stack->count)
+      continue;
+    int written = 0;
+    if (stack->truncated) {
+      fprintf(f, "[truncated]");
+      written++;
+    }
+    for (int j = 0; j < stack->frameCount; j++) {
+      if (written++)
+        fprintf(f, ";");
+      WriteFrame(f, stack->frames[j]);
+    }
+    if (stack->deeper) {
+      fprintf(f, "%s[deeper]", written++ ? ";" : "");
+    }
+    if (!written) {
+      /* Outside of any form: parsing, or setting up. */
+      fprintf(f, "[runtime]");
+    }
+    fprintf(f, " %d\n", stack->count);
+  }
+  fclose(f);
+  fprintf(stderr, "Profile: %lu samples of %d stacks written to %s",
+          sampleCount, stackCount, profileOut);
+  if (droppedCount) {
+    fprintf(stderr, " (%lu dropped)", droppedCount);
+  }
+  fprintf(stderr, "\n");
+}
+
+/* Start sampling, and write the profile to the file on exit. The
+   parser notes source positions in the code from now on. */
+void ProfileStart(const char* outPath, const char* code, size_t len) {
+#ifdef _WIN32
+  Die("--profile isn't supported on Windows.");
+#else
+  profileOut = outPath;
+  sourceCode = code;
+  sourceLen = len;
+  InitLock(&sourceListLock);
+  stacks = (ProfileStack*)Alloc(PROFILE_TABLE_SIZE * sizeof(ProfileStack));
+  memset(stacks, 0, PROFILE_TABLE_SIZE * sizeof(ProfileStack));
+  framePool = (const void**)Alloc(PROFILE_FRAME_POOL_SIZE * sizeof(void*));
+  profiling = 1;
+  atexit(WriteProfile);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = OnProfileSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, 0);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = PROFILE_INTERVAL_USEC;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, 0);
+#endif
+}
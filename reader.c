@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "datatype.h"
+#include "lexer.h"
+#include "parser.h"
+
+/*
+The reader is a streaming alternative to Lex and Parse. Instead
+of loading the whole file and tokenizing all of it up front, it
+pulls characters from a FILE through a fixed-size buffer and
+parses one top-level form at a time, so that the form can be
+evaluated before the next one is read. Memory use is bounded by
+the size of the largest form rather than the size of the input,
+and the input can come from a pipe.
+
+It produces the same terms as Parse, except that the text of
+string atoms is copied into the pool, since the buffer it was
+read from is reused.
+*/
+
+#define READER_BUFFER_SIZE 0x10000 // 64 KB
+
+struct Reader {
+  FILE* f;
+  char* buf;
+  size_t pos;
+  size_t end;
+  /* Offset in the input of the start of the buffer, for errors. */
+  size_t bufOffset;
+  /* Text of the atom being read. */
+  char* text;
+  int textLen;
+  int textCapacity;
+  /* Elements of the lists being read, innermost last. */
+  Term** elements;
+  int elementCount;
+  int elementCapacity;
+};
+
+Reader* NewReader(FILE* f) {
+  Reader* reader = (Reader*)Alloc(sizeof(Reader));
+  reader->f = f;
+  reader->buf = (char*)Alloc(READER_BUFFER_SIZE);
+  reader->pos = 0;
+  reader->end = 0;
+  reader->bufOffset = 0;
+  reader->textCapacity = 256;
+  reader->text = (char*)Alloc(reader->textCapacity);
+  reader->textLen = 0;
+  reader->elements = 0;
+  reader->elementCount = 0;
+  reader->elementCapacity = 0;
+  return reader;
+}
+
+void FreeReader(Reader* reader) {
+  free(reader->elements);
+  free(reader->text);
+  free(reader->buf);
+  free(reader);
+}
+
+/* The next character, or EOF. */
+static int Peek(Reader* reader) {
+  if (reader->pos == reader->end) {
+    reader->bufOffset += reader->end;
+    reader->pos = 0;
+    reader->end = fread(reader->buf, 1, READER_BUFFER_SIZE, reader->f);
+    if (reader->end == 0) {
+      if (ferror(reader->f)) {
+        Die("Error reading input.");
+      }
+      return EOF;
+    }
+  }
+  return (unsigned char)reader->buf[reader->pos];
+}
+
+/* Add the next character to the atom text and move past it.
+   There's always room left for a terminating null. */
+static void Take(Reader* reader) {
+  if (reader->textLen + 1 == reader->textCapacity) {
+    reader->textCapacity *= 2;
+    reader->text = (char*)Realloc(reader->text, reader->textCapacity);
+  }
+  reader->text[reader->textLen++] = reader->buf[reader->pos++];
+}
+
+/* The offset in the input of the next character. Errors report
+   offsets as the parser does, so that both give the same message
+   for the same input. */
+static size_t Offset(Reader* reader) {
+  return reader->bufOffset + reader->pos;
+}
+
+static void SkipWhitespace(Reader* reader) {
+  for (;;) {
+    int c = Peek(reader);
+    if (c != ' ' && c != '\n' && c != '\t')
+      break;
+    reader->pos++;
+  }
+}
+
+static Term* ReadTerm(Reader* reader, MemPool* pool);
+
+static void PushElement(Reader* reader, Term* element) {
+  if (reader->elementCount == reader->elementCapacity) {
+    reader->elementCapacity =
+      reader->elementCapacity ? reader->elementCapacity * 2 : 256;
+    reader->elements = (Term**)Realloc(reader->elements,
+        reader->elementCapacity * sizeof(Term*));
+  }
+  reader->elements[reader->elementCount++] = element;
+}
+
+/* As in ParseList, the list is allocated as a CDR-coded run. */
+static Term* ReadList(Reader* reader, MemPool* pool) {
+  int firstElement = reader->elementCount;
+  for (;;) {
+    SkipWhitespace(reader);
+    int c = Peek(reader);
+    if (c == EOF) {
+      Die("Premature end of file.");
+    }
+    if (c == ')') {
+      reader->pos++;
+      break;
+    }
+    PushElement(reader, ReadTerm(reader, pool));
+  }
+  Term* list = NewList(pool, reader->elements + firstElement,
+                       reader->elementCount - firstElement);
+  reader->elementCount = firstElement;
+  return list;
+}
+
+/* The text includes the quotes, as it does in Parse. */
+static Term* ReadString(Reader* reader, MemPool* pool) {
+  size_t start = Offset(reader);
+  Take(reader); // Opening quote.
+  for (;;) {
+    int c = Peek(reader);
+    if (c == EOF) {
+      Die("Unterminated string at offset %d.", (int)start);
+    }
+    Take(reader);
+    if (c == '"') {
+      break;
+    } else if (c == '\\') {
+      if (Peek(reader) == EOF) {
+        Die("Unterminated string at offset %d.", (int)start);
+      }
+      Take(reader); // Escaped char.
+    }
+  }
+  char* text = (char*)NewFromMemPool(pool, reader->textLen);
+  memcpy(text, reader->text, reader->textLen);
+  Term* term = NewAtom(pool, T_STRING);
+  term->value.string.text = text;
+  term->value.string.len = reader->textLen;
+  return term;
+}
+
+static Term* ReadAtom(Reader* reader, MemPool* pool) {
+  while (IsIdentifierChar(Peek(reader))) {
+    Take(reader);
+  }
+  reader->text[reader->textLen] = 0;
+  if (IsNumber(reader->text, reader->textLen)) {
+    return ParseNumber(pool, reader->text, reader->textLen);
+  }
+  return InternSymbol(reader->text, reader->textLen);
+}
+
+static Term* ReadTerm(Reader* reader, MemPool* pool) {
+  int c = Peek(reader);
+  reader->textLen = 0;
+  if (c == '(') {
+    reader->pos++;
+    return ReadList(reader, pool);
+  } else if (c == ')') {
+    Die("Unmatched right parenthesis.");
+  } else if (c == '"') {
+    return ReadString(reader, pool);
+  } else if (IsIdentifierChar(c)) {
+    return ReadAtom(reader, pool);
+  }
+  Die("Unexpected character at offset %d: %c", (int)Offset(reader), c);
+}
+
+/* Read the next top-level form into *form. Returns 0 at the
+   end of the input. */
+int ReadForm(Reader* reader, MemPool* pool, Term** form) {
+  SkipWhitespace(reader);
+  if (Peek(reader) == EOF) {
+    return 0;
+  }
+  *form = ReadTerm(reader, pool);
+  return 1;
+}
@@ -0,0 +1,209 @@
+/*
+The resolver runs over the parsed program before it is
+interpreted. It replaces every reference to a local variable
+with a T_LOCAL_REF term that records which slot holds the value:
+either a slot of the current call's frame, for an argument, or a
+slot of the closure's captured variables, for a variable of an
+enclosing function. Symbols that aren't bound by an enclosing
+function are replaced with T_GLOBAL_REF terms, which look up the
+symbol in the global environment at run time and cache its
+value. The symbol at the head of a special form is left alone.
+
+Along the way it finds the free variables of each function
+definition: the variables of enclosing functions that the body
+uses, directly or in a function defined inside it. The definition
+is replaced with a T_FUN_DEF term listing them, so that the
+closure can copy just those values when it's made.
+
+The rewrite is done in place, since the parse tree isn't
+shared with anything else.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "datatype.h"
+
+/* A function whose body is being resolved. */
+typedef struct Scope {
+  struct Scope* parent;
+  Term* argNames; /* List of symbols. */
+  /* Variables of enclosing functions used so far, in the order
+     of their slots in the captured frame. */
+  Term** captures;
+  int captureCount;
+  int captureCapacity;
+} Scope;
+
+static Term* ResolveTerm(Term* iTerm, Scope* scope, Env* env, MemPool* pool);
+
+static int FindSlot(Term* argNames, Term* symbol) {
+  int slot = 0;
+  while (argNames) {
+    if (HEAD(argNames) == symbol)
+      return slot;
+    argNames = TAIL(argNames);
+    slot++;
+  }
+  return -1;
+}
+
+static int AddCapture(Scope* scope, Term* symbol) {
+  if (scope->captureCount == scope->captureCapacity) {
+    scope->captureCapacity =
+      scope->captureCapacity ? scope->captureCapacity * 2 : 8;
+    scope->captures = (Term**)Realloc(scope->captures,
+        scope->captureCapacity * sizeof(Term*));
+  }
+  scope->captures[scope->captureCount] = symbol;
+  return scope->captureCount++;
+}
+
+/* Find the slot of a local variable, setting *captured if it's
+   one of the captured variables. A variable of an enclosing
+   function is added to the captures of this function, and of each
+   function in between. Returns -1 for a global. */
+static int FindLocal(Scope* scope, Term* symbol, int* captured) {
+  if (!scope)
+    return -1;
+  *captured = 0;
+  int slot = FindSlot(scope->argNames, symbol);
+  if (slot >= 0)
+    return slot;
+  *captured = 1;
+  for (slot = 0; slot < scope->captureCount; slot++) {
+    if (scope->captures[slot] == symbol)
+      return slot;
+  }
+  int outerCaptured;
+  if (FindLocal(scope->parent, symbol, &outerCaptured) < 0)
+    return -1;
+  return AddCapture(scope, symbol);
+}
+
+static Term* NewLocalRef(Term* iSymbol, int captured, int slot, MemPool* pool) {
+  Term* ref = NewAtom(pool, T_LOCAL_REF);
+  ref->value.localRef.captured = captured;
+  ref->value.localRef.slot = slot;
+  ref->value.localRef.name = iSymbol;
+  return ref;
+}
+
+static Term* ResolveSymbol(Term* iSymbol, Scope* scope, MemPool* pool) {
+  int captured;
+  int slot = FindLocal(scope, iSymbol, &captured);
+  if (slot >= 0) {
+    return NewLocalRef(iSymbol, captured, slot, pool);
+  }
+  /* Each reference gets a cache of its own. */
+  Term* ref = NewAtom(pool, T_GLOBAL_REF);
+  ref->value.globalRef.name = iSymbol;
+  ref->value.globalRef.value = 0;
+  ref->value.globalRef.native = 0;
+  ref->value.globalRef.version = 0;
+  return ref;
+}
+
+static int IsLocal(Term* iSymbol, Scope* scope) {
+  for (; scope; scope = scope->parent) {
+    if (FindSlot(scope->argNames, iSymbol) >= 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void ResolveList(Term* iList, Scope* scope, Env* env, MemPool* pool) {
+  while (iList) {
+    SET_HEAD(iList, ResolveTerm(HEAD(iList), scope, env, pool));
+    iList = TAIL(iList);
+  }
+}
+
+static int IsWellFormedFunctionDef(Term* iFunDef) {
+  if (!IS_CONS(iFunDef) || !IS_CONS(TAIL(iFunDef)))
+    return 0;
+  Term* funArgsAndBody = TAIL(iFunDef);
+  Term* funArgDecls = HEAD(funArgsAndBody);
+  if (!IS_LIST(funArgDecls) || !TAIL(funArgsAndBody))
+    return 0;
+  for (; funArgDecls; funArgDecls = TAIL(funArgDecls)) {
+    if (!IS_SYMBOL(HEAD(funArgDecls)))
+      return 0;
+  }
+  return 1;
+}
+
+/* The form is (fun name (args...) body...). It's replaced by a
+   T_FUN_DEF term. Malformed definitions are left as they are so
+   that the interpreter can report them. */
+static Term* ResolveFunctionDef(Term* iForm, Scope* scope, Env* env, MemPool* pool) {
+  Term* iFunDef = TAIL(iForm);
+  if (!IsWellFormedFunctionDef(iFunDef))
+    return iForm;
+  Term* funArgsAndBody = TAIL(iFunDef);
+  Scope funScope;
+  funScope.parent = scope;
+  funScope.argNames = HEAD(funArgsAndBody);
+  funScope.captures = 0;
+  funScope.captureCount = 0;
+  funScope.captureCapacity = 0;
+  ResolveList(TAIL(funArgsAndBody), &funScope, env, pool);
+  /* Each captured variable is local to the defining function,
+     and has already been added to its captures if need be. */
+  for (int i = 0; i < funScope.captureCount; i++) {
+    funScope.captures[i] = ResolveSymbol(funScope.captures[i], scope, pool);
+    assert(IS_LOCAL_REF(funScope.captures[i]));
+  }
+  Term* def = NewAtom(pool, T_FUN_DEF);
+  def->value.funDef.funArgs = funScope.argNames;
+  def->value.funDef.funBody = TAIL(funArgsAndBody);
+  def->value.funDef.captures =
+    NewList(pool, funScope.captures, funScope.captureCount);
+  def->value.funDef.captureCount = funScope.captureCount;
+  free(funScope.captures);
+  return def;
+}
+
+/* Determine what the head of a form refers to, as far as it
+   can be known before evaluation. Only global symbols can be
+   known; everything else yields null. */
+static Term* StaticFormHead(Term* iHead, Scope* scope, Env* env) {
+  if (!IS_SYMBOL(iHead))
+    return 0;
+  if (IsLocal(iHead, scope))
+    return 0; /* Shadowed by a local. */
+  Term* eHead = EnvLookup(env, iHead);
+  return eHead == ENV_LOOKUP_FAILED ? 0 : eHead;
+}
+
+static Term* ResolveForm(Term* iForm, Scope* scope, Env* env, MemPool* pool) {
+  Term* eHead = StaticFormHead(HEAD(iForm), scope, env);
+  if (eHead) {
+    switch (TYPE_OF(eHead)) {
+      case T_PRIM_QUOTE:
+        /* Quoted data isn't code. */
+        return iForm;
+      case T_PRIM_FUN:
+        return ResolveFunctionDef(iForm, scope, env, pool);
+      case T_PRIM_BEGIN:
+        ResolveList(TAIL(iForm), scope, env, pool);
+        return iForm;
+      default:
+        break;
+    }
+  }
+  ResolveList(iForm, scope, env, pool);
+  return iForm;
+}
+
+static Term* ResolveTerm(Term* iTerm, Scope* scope, Env* env, MemPool* pool) {
+  if (IS_SYMBOL(iTerm))
+    return ResolveSymbol(iTerm, scope, pool);
+  if (IS_CONS(iTerm))
+    return ResolveForm(iTerm, scope, env, pool);
+  return iTerm;
+}
+
+Term* Resolve(Term* iProgram, Env* env, MemPool* pool) {
+  return ResolveTerm(iProgram, 0, env, pool);
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "datatype.h"
+
+/*
+The symbol table maps symbol names to canonical T_SYMBOL
+terms, so that there is exactly one term for each distinct
+name. Once symbols are interned, two symbols are the same
+symbol iff they are the same pointer, so environment lookups
+(and anything else that compares symbols) never have to look
+at the name bytes.
+
+The table uses open addressing with linear probing. Names are
+copied into memory owned by the table so that symbols don't
+depend on the lifetime of the buffer they were parsed from.
+*/
+
+typedef struct SymbolTable {
+  Term** slots;
+  unsigned capacity; /* Always a power of two. */
+  unsigned count;
+} SymbolTable;
+
+#define SYMBOL_TABLE_INITIAL_CAPACITY 256
+
+static SymbolTable symbolTable;
+static MemPool* symbolPool; /* Symbols are never freed. */
+
+/* Held while interning, when symbols are shared between threads. */
+static Lock symbolLock;
+static int symbolLockReady;
+static int symbolsShared;
+
+void ShareSymbols(int shared) {
+  if (!symbolLockReady) {
+    InitLock(&symbolLock);
+    symbolLockReady = 1;
+  }
+  symbolsShared = shared;
+}
+
+/* FNV-1a */
+static unsigned HashName(const char* text, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)text[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void SymbolTableInsert(Term** slots, unsigned capacity, Term* sym) {
+  unsigned mask = capacity - 1;
+  unsigned i = HashName(sym->value.string.text, sym->value.string.len) & mask;
+  while (slots[i]) {
+    i = (i + 1) & mask;
+  }
+  slots[i] = sym;
+}
+
+static void SymbolTableGrow() {
+  unsigned newCapacity = symbolTable.capacity
+    ? symbolTable.capacity * 2 : SYMBOL_TABLE_INITIAL_CAPACITY;
+  Term** newSlots = (Term**)Alloc(newCapacity * sizeof(Term*));
+  memset(newSlots, 0, newCapacity * sizeof(Term*));
+  for (unsigned i = 0; i < symbolTable.capacity; i++) {
+    if (symbolTable.slots[i])
+      SymbolTableInsert(newSlots, newCapacity, symbolTable.slots[i]);
+  }
+  free(symbolTable.slots);
+  symbolTable.slots = newSlots;
+  symbolTable.capacity = newCapacity;
+}
+
+static Term* InternSymbolUnlocked(const char* text, int len) {
+  /* Keep the load factor at or below one half. */
+  if (2 * (symbolTable.count + 1) > symbolTable.capacity) {
+    SymbolTableGrow();
+  }
+  unsigned mask = symbolTable.capacity - 1;
+  unsigned i = HashName(text, len) & mask;
+  for (;;) {
+    Term* sym = symbolTable.slots[i];
+    if (!sym)
+      break;
+    if (sym->value.string.len == len
+        && 0 == memcmp(sym->value.string.text, text, len)) {
+      return sym;
+    }
+    i = (i + 1) & mask;
+  }
+  /* Not found: create the canonical symbol in the empty slot. */
+  if (!symbolPool) {
+    symbolPool = NewMemPool();
+  }
+  char* name = (char*)NewFromMemPool(symbolPool, len + 1);
+  memcpy(name, text, len);
+  name[len] = 0;
+  Term* sym = NewAtom(symbolPool, T_SYMBOL);
+  sym->value.string.text = name;
+  sym->value.string.len = len;
+  symbolTable.slots[i] = sym;
+  symbolTable.count++;
+  return sym;
+}
+
+Term* InternSymbol(const char* text, int len) {
+  if (!symbolsShared) {
+    return InternSymbolUnlocked(text, len);
+  }
+  AcquireLock(&symbolLock);
+  Term* sym = InternSymbolUnlocked(text, len);
+  ReleaseLock(&symbolLock);
+  return sym;
+}
+
+/* The interned symbols, for writing an image (see image.c).
+   The caller frees the array. */
+Term** InternedSymbols(int* count) {
+  Term** symbols = (Term**)Alloc((symbolTable.count + 1) * sizeof(Term*));
+  int n = 0;
+  for (unsigned i = 0; i < symbolTable.capacity; i++) {
+    if (symbolTable.slots[i])
+      symbols[n++] = symbolTable.slots[i];
+  }
+  *count = n;
+  return symbols;
+}
+
+/* Make a symbol loaded from an image the canonical one for its
+   name. No symbol of that name can have been interned already. */
+void AdoptSymbol(Term* sym) {
+  if (2 * (symbolTable.count + 1) > symbolTable.capacity) {
+    SymbolTableGrow();
+  }
+  unsigned mask = symbolTable.capacity - 1;
+  unsigned i = HashName(sym->value.string.text, sym->value.string.len) & mask;
+  for (; symbolTable.slots[i]; i = (i + 1) & mask) {
+    Term* other = symbolTable.slots[i];
+    if (other->value.string.len == sym->value.string.len
+        && 0 == memcmp(other->value.string.text, sym->value.string.text,
+                       sym->value.string.len)) {
+      Die("Symbol interned twice: %s", sym->value.string.text);
+    }
+  }
+  symbolTable.slots[i] = sym;
+  symbolTable.count++;
+}
+
+Term* GetSymbol(const char* name) {
+  return InternSymbol(name, strlen(name));
+}
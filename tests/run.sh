@@ -0,0 +1,85 @@
+#!/bin/sh
+# Run each tests/NAME.txt in every mode, and compare what it
+# displays with tests/NAME.out. Every mode must display the same
+# thing. Run from the top of the tree after building ByteSize
+# (./mk.sh test does both).
+#
+# The modes are the tree walker on a parsed file and on a stream,
+# the VM with and without the JIT, arena mode, no optimizer, a
+# saved image, the image cache (the first run fills it and the
+# second loads from it), --parallel, and the program compiled by
+# --emit-c. --parallel runs the test repeated until it's large
+# enough to be split, on a machine with more than one processor.
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Keep only what the program displays: what comes after the
+# environment, up to the GC statistics, without bytecode dumps.
+Displayed() {
+  awk '/^Environment:/ { skip = 1 }
+       /^Bytecode:/ { skip = 1 }
+       /^--------------------$/ {
+         if (skip) { skip = 0; shown = 1; next }
+         if (shown) exit
+       }
+       shown && !skip'
+}
+
+Run() {
+  ./ByteSize "$@" | Displayed
+}
+
+# Repeat the file the given number of times.
+Repeated() {
+  i=0
+  while [ $i -lt $2 ]; do
+    cat "$1"
+    i=$((i + 1))
+  done
+}
+
+failed=0
+Check() {
+  if ! diff -u "$expected" "$tmp/got" > "$tmp/diff"; then
+    echo "FAIL: $test $1"
+    cat "$tmp/diff"
+    failed=1
+  fi
+}
+
+for test in tests/*.txt; do
+  name=$(basename "$test" .txt)
+  expected="${test%.txt}.out"
+  for mode in "" "--stream" "--vm" "--vm --no-jit" "--arena" "--no-optimize"; do
+    Run --no-cache $mode "$test" > "$tmp/got"
+    Check "$mode"
+  done
+
+  ./ByteSize --save-image "$tmp/$name.img" "$test" > /dev/null
+  Run --image "$tmp/$name.img" > "$tmp/got"
+  Check "--image"
+
+  for pass in fill load; do
+    Run --cache "$tmp/cache" "$test" > "$tmp/got"
+    Check "--cache ($pass)"
+  done
+
+  # About 600 KB of the test, and what that should display.
+  copies=$((600000 / $(wc -c < "$test") + 1))
+  Repeated "$test" $copies > "$tmp/big.txt"
+  Repeated "$expected" $copies > "$tmp/big.out"
+  Run --no-cache --parallel "$tmp/big.txt" > "$tmp/got"
+  expected="$tmp/big.out"
+  Check "--parallel"
+  expected="${test%.txt}.out"
+
+  ./ByteSize --emit-c "$tmp/$name.c" "$test" > /dev/null &&
+    sh mk.sh program "$tmp/$name.c" &&
+    "$tmp/$name" > "$tmp/got"
+  Check "--emit-c"
+done
+if [ $failed = 0 ]; then
+  echo "All tests passed."
+fi
+exit $failed
@@ -0,0 +1,206 @@
+/*
+Running work on several threads at once.
+
+RunParallel calls a function once for each of a number of tasks
+and returns when they have all finished. The tasks are shared out
+between a fixed pool of worker threads, started on first use with
+one thread per processor beyond the first, and the calling thread,
+which takes tasks too. Only one batch of tasks runs at a time: a
+call from inside a task just runs its tasks itself, one after
+another.
+
+Work that runs this way must not allocate garbage-collected
+objects, since the collector isn't thread-safe. It can allocate
+from a MemPool of its own, and intern symbols.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "datatype.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+typedef struct Condition {
+#ifdef _WIN32
+  CONDITION_VARIABLE cond;
+#else
+  pthread_cond_t cond;
+#endif
+} Condition;
+
+/* The batch of tasks being run. Everything is guarded by lock. */
+typedef struct WorkerPool {
+  Lock lock;
+  Condition workReady; /* There are tasks left to start. */
+  Condition workDone;  /* The last task of the batch finished. */
+  int started;
+  int workerCount;
+  TaskFun fun;
+  void** args;
+  int taskCount;
+  int nextTask;
+  int unfinishedTasks;
+} WorkerPool;
+
+static WorkerPool workerPool;
+static THREAD_LOCAL int inTask;
+
+static void InitCondition(Condition* c) {
+#ifdef _WIN32
+  InitializeConditionVariable(&c->cond);
+#else
+  pthread_cond_init(&c->cond, 0);
+#endif
+}
+
+static void WaitCondition(Condition* c, Lock* lock) {
+#ifdef _WIN32
+  SleepConditionVariableCS(&c->cond, &lock->section, INFINITE);
+#else
+  pthread_cond_wait(&c->cond, &lock->mutex);
+#endif
+}
+
+static void WakeAll(Condition* c) {
+#ifdef _WIN32
+  WakeAllConditionVariable(&c->cond);
+#else
+  pthread_cond_broadcast(&c->cond);
+#endif
+}
+
+/* Run tasks from the current batch until none are left to start.
+   Called with the lock held, and returns with it held. */
+static void RunTasks(WorkerPool* pool) {
+  while (pool->nextTask < pool->taskCount) {
+    int task = pool->nextTask++;
+    ReleaseLock(&pool->lock);
+    inTask = 1;
+    pool->fun(pool->args[task]);
+    inTask = 0;
+    AcquireLock(&pool->lock);
+    if (--pool->unfinishedTasks == 0) {
+      WakeAll(&pool->workDone);
+    }
+  }
+}
+
+static void WorkerLoop(WorkerPool* pool) {
+  AcquireLock(&pool->lock);
+  for (;;) {
+    while (pool->nextTask == pool->taskCount) {
+      WaitCondition(&pool->workReady, &pool->lock);
+    }
+    RunTasks(pool);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WorkerThread(LPVOID p) {
+  WorkerLoop((WorkerPool*)p);
+  return 0;
+}
+#else
+static void* WorkerThread(void* p) {
+  WorkerLoop((WorkerPool*)p);
+  return 0;
+}
+#endif
+
+/* Whether the current thread is running a task for RunParallel. */
+int InParallelTask() {
+  return inTask;
+}
+
+int ProcessorCount() {
+  static int processorCount;
+  if (!processorCount) {
+#ifdef _WIN32
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    processorCount = sysInfo.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    processorCount = count > 0 ? count : 1;
+#endif
+  }
+  return processorCount;
+}
+
+static void StartWorkers(WorkerPool* pool) {
+  InitLock(&pool->lock);
+  InitCondition(&pool->workReady);
+  InitCondition(&pool->workDone);
+  pool->started = 1;
+  pool->workerCount = ProcessorCount() - 1;
+  for (int i = 0; i < pool->workerCount; i++) {
+#ifdef _WIN32
+    HANDLE thread = CreateThread(0, 0, WorkerThread, pool, 0, 0);
+    int failure = (thread == 0);
+    if (thread)
+      CloseHandle(thread);
+#else
+    pthread_t thread;
+    int failure = pthread_create(&thread, 0, WorkerThread, pool);
+    if (!failure)
+      pthread_detach(thread);
+#endif
+    if (failure) {
+      Die("Failed to start a thread.");
+    }
+  }
+}
+
+/* Call fun(args[i]) for each i, in parallel. */
+void RunParallel(TaskFun fun, void** args, int count) {
+  if (inTask || count < 2 || ProcessorCount() < 2) {
+    for (int i = 0; i < count; i++) {
+      fun(args[i]);
+    }
+    return;
+  }
+  WorkerPool* pool = &workerPool;
+  if (!pool->started) {
+    StartWorkers(pool);
+  }
+  AcquireLock(&pool->lock);
+  pool->fun = fun;
+  pool->args = args;
+  pool->taskCount = count;
+  pool->nextTask = 0;
+  pool->unfinishedTasks = count;
+  WakeAll(&pool->workReady);
+  RunTasks(pool);
+  while (pool->unfinishedTasks > 0) {
+    WaitCondition(&pool->workDone, &pool->lock);
+  }
+  ReleaseLock(&pool->lock);
+}
+
+/* A lock, for the few places that worker threads share. */
+
+void InitLock(Lock* lock) {
+#ifdef _WIN32
+  InitializeCriticalSection(&lock->section);
+#else
+  pthread_mutex_init(&lock->mutex, 0);
+#endif
+}
+
+void AcquireLock(Lock* lock) {
+#ifdef _WIN32
+  EnterCriticalSection(&lock->section);
+#else
+  pthread_mutex_lock(&lock->mutex);
+#endif
+}
+
+void ReleaseLock(Lock* lock) {
+#ifdef _WIN32
+  LeaveCriticalSection(&lock->section);
+#else
+  pthread_mutex_unlock(&lock->mutex);
+#endif
+}
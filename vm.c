@@ -0,0 +1,339 @@
+/*
+The bytecode VM. It's a stack machine: instructions take
+their operands from the value stack and push their results
+back onto it. Calls between compiled functions don't recurse
+on the C stack; the caller's state is saved in a CallInfo
+record instead.
+
+When compiled with GCC (or anything else that supports
+"labels as values") dispatch is threaded through a table of
+label addresses, so each instruction jumps directly to the
+next one's handler. Otherwise it falls back to a switch.
+
+The VM keeps its registers (sp, frame, ...) in C locals. Before
+anything that can allocate, they are saved in the VmState, which
+the garbage collector scans for roots, and the frame is reloaded
+afterwards in case the collector moved it.
+
+A function that has been called JIT_CALL_THRESHOLD times is
+compiled to native code (see jit.c), which the VM runs in place
+of its bytecode. The native code works on the VmState directly,
+and hands control back to the VM to return and to call user
+functions, so those work the same either way: a call from native
+code leaves a CallInfo whose resume address says where to go on.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "datatype.h"
+#include "bytecode.h"
+
+#ifdef __GNUC__
+#define VM_THREADED_DISPATCH
+#endif
+
+#define VM_STACK_SIZE     0x10000
+#define VM_MAX_CALL_DEPTH 0x4000
+
+/* Calls to a function before it's compiled to native code. */
+#define JIT_CALL_THRESHOLD 100
+
+/* The stacks of the last run, kept for the next one, since each
+   top-level form is a run of its own and the stacks are too big to
+   allocate that often. A nested run allocates its own. */
+static Term** spareStack;
+static CallInfo* spareCalls;
+
+static void VmVisitRoots(void* data, GcVisitor visit) {
+  VmState* vm = (VmState*)data;
+  for (Term** slot = vm->stack; slot < vm->sp; slot++) {
+    visit((void**)slot);
+  }
+  for (int i = 0; i < vm->callDepth; i++) {
+    visit((void**)&vm->calls[i].frame);
+  }
+  visit((void**)&vm->frame);
+}
+
+/* The arguments are on the VM stack, where the collector can
+   find them while the list is allocated. A builtin that takes an
+   array gets them in place. */
+Term* CallNative(Term* eFun, Term** args, int nArgs, MemPool* pool) {
+  if (eFun->value.bif.arrayFunPtr) {
+    CheckNativeArity(eFun, nArgs);
+    return eFun->value.bif.arrayFunPtr(nArgs, args, pool);
+  }
+  NativeFun funPtr = eFun->value.bif.funPtr;
+  Term* eArgList = NewList(pool, args, nArgs);
+  return funPtr(eArgList, pool);
+}
+
+/* Closures made by the tree walker, while a builtin such as map
+   runs a function (see Apply), have no bytecode. The tree walker
+   runs them as well. */
+static Term* CallInterpreted(Term* eFun, Term** args, int nArgs, MemPool* pool) {
+  Term* eArgList = NewList(pool, args, nArgs);
+  return Apply(eFun, eArgList, pool);
+}
+
+/* Make a closure of the child function over the values it
+   captures, which are on top of the stack, and leave the closure
+   in their place. Returns the new top of the stack. Since this
+   allocates, the caller's registers must be saved in the state. */
+Term** VmClosure(VmState* vm, Term** sp, Chunk* child) {
+  int captureCount = child->captureCount;
+  GC_ENTER();
+  Frame* captured = 0;
+  GC_ROOT(captured);
+  vm->sp = sp;
+  if (captureCount > 0) {
+    /* The values stay on the stack, where the collector
+       can see them, until the frame has been allocated. */
+    captured = NewFrame(vm->pool, 0, captureCount);
+    sp -= captureCount;
+    for (int i = 0; i < captureCount; i++) {
+      captured->slots[i] = sp[i];
+      GC_WRITE_BARRIER(captured, sp[i]);
+    }
+  }
+  Term* eFun = NewAtom(vm->pool, T_FUN_USER);
+  GC_LEAVE();
+  eFun->value.udf.funBody = child->funBody;
+  eFun->value.udf.funArgs = child->funArgs;
+  eFun->value.udf.funFrame = captured;
+  eFun->value.udf.funCode = child;
+  *sp++ = eFun;
+  return sp;
+}
+
+Term* VmRun(Chunk* chunk, Env* env, MemPool* pool) {
+  Term** stack = spareStack;
+  CallInfo* calls = spareCalls;
+  spareStack = 0;
+  spareCalls = 0;
+  if (!stack) {
+    stack = (Term**)Alloc(VM_STACK_SIZE * sizeof(Term*));
+    calls = (CallInfo*)Alloc(VM_MAX_CALL_DEPTH * sizeof(CallInfo));
+  }
+  Term** stackEnd = stack + VM_STACK_SIZE;
+  int callDepth = 0;
+  Term** sp = stack; /* Points to the next free slot. */
+  const uint8_t* ip = chunk->code;
+  Term** constants = chunk->constants;
+  Frame* frame = 0;
+  Term* result;
+  int nArgs;
+  int tailCall;
+  void* resume;      /* Where the caller goes on in its native code. */
+  void* nativeEntry; /* Where to start running native code. */
+  VmState vm;
+
+  if (sp + chunk->maxStackDepth > stackEnd) {
+    Die("Stack overflow.");
+  }
+  vm.stack = stack;
+  vm.calls = calls;
+  vm.env = env;
+  vm.pool = pool;
+  GcPushRootScanner(VmVisitRoots, &vm);
+
+#define SAVE_VM_STATE() (vm.sp = sp, vm.callDepth = callDepth, vm.frame = frame)
+#define LOAD_VM_STATE() (frame = vm.frame)
+
+#define READ_OPERAND() (ip += 2, (int)(ip[-2] | ip[-1] << 8))
+
+#ifdef VM_THREADED_DISPATCH
+  static void* dispatchTable[OP_COUNT] = {
+    &&do_OP_CONST, &&do_OP_LOCAL, &&do_OP_CAPTURED, &&do_OP_GLOBAL,
+    &&do_OP_CALL, &&do_OP_TAILCALL, &&do_OP_POP, &&do_OP_CLOSURE,
+    &&do_OP_RETURN,
+  };
+#define VM_DISPATCH() goto *dispatchTable[*ip++]
+#define VM_CASE(OP) do_##OP
+  VM_DISPATCH();
+#else
+#define VM_DISPATCH() goto dispatch
+#define VM_CASE(OP) case OP
+dispatch:
+  switch (*ip++) {
+#endif
+
+  VM_CASE(OP_CONST): {
+    *sp++ = constants[READ_OPERAND()];
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_LOCAL): {
+    *sp++ = frame->slots[READ_OPERAND()];
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_CAPTURED): {
+    *sp++ = frame->parent->slots[READ_OPERAND()];
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_GLOBAL): {
+    Term* ref = constants[READ_OPERAND()];
+    if (IS_GLOBAL_REF(ref)) {
+      *sp++ = GLOBAL_REF_VALUE(ref, env);
+      VM_DISPATCH();
+    }
+    Term* value = EnvLookup(env, ref);
+    if (value == ENV_LOOKUP_FAILED) {
+      DieShowingTerm("Unresolved symbol", ref);
+    }
+    *sp++ = value;
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_CALL):
+    tailCall = 0;
+    goto call;
+
+  VM_CASE(OP_TAILCALL):
+    tailCall = 1;
+    goto call;
+
+  call:
+    nArgs = READ_OPERAND();
+    resume = 0;
+  callWithArgs: {
+    Term** base = sp - nArgs - 1;
+    Term* eFun = *base;
+    int interpreted = IS_FUN_USER(eFun) && !eFun->value.udf.funCode;
+    if (IS_FUN_NATIVE(eFun) || interpreted) {
+      SAVE_VM_STATE();
+      Term* eResult = interpreted ? CallInterpreted(eFun, base + 1, nArgs, pool)
+                                  : CallNative(eFun, base + 1, nArgs, pool);
+      LOAD_VM_STATE();
+      *base = eResult;
+      sp = base + 1;
+      if (tailCall)
+        goto doReturn;
+      if (resume) {
+        nativeEntry = resume;
+        goto runNative;
+      }
+      VM_DISPATCH();
+    }
+    if (!IS_FUN_USER(eFun)) {
+      DieShowingTerm("Called a non-function", eFun);
+    }
+    Chunk* callee = eFun->value.udf.funCode;
+    if (nArgs < callee->arity) {
+      Die("Too few arguments to function.");
+    } else if (nArgs > callee->arity) {
+      Die("Too many arguments to function.");
+    }
+    SAVE_VM_STATE();
+    Frame* callFrame = NewFrame(pool, eFun->value.udf.funFrame, nArgs);
+    LOAD_VM_STATE();
+    for (int i = 0; i < nArgs; i++) {
+      callFrame->slots[i] = base[i + 1];
+      GC_WRITE_BARRIER(callFrame, base[i + 1]);
+    }
+    if (tailCall) {
+      /* The callee takes over the current call record, so it
+         will return straight to our caller. */
+      assert(callDepth > 0);
+      sp = calls[callDepth - 1].base;
+    } else {
+      if (callDepth == VM_MAX_CALL_DEPTH) {
+        Die("Stack overflow.");
+      }
+      CallInfo* ci = &calls[callDepth++];
+      ci->chunk = chunk;
+      ci->ip = ip;
+      ci->resume = resume;
+      ci->frame = frame;
+      ci->base = base;
+      sp = base;
+    }
+    if (sp + callee->maxStackDepth > stackEnd) {
+      Die("Stack overflow.");
+    }
+    chunk = callee;
+    frame = callFrame;
+    if (!chunk->jitCode && useJit && chunk->callCount++ == JIT_CALL_THRESHOLD) {
+      JitCompile(chunk, env);
+    }
+    if (chunk->jitCode) {
+      nativeEntry = chunk->jitBody;
+      goto runNative;
+    }
+    ip = chunk->code;
+    constants = chunk->constants;
+    VM_DISPATCH();
+  }
+
+  runNative: {
+    SAVE_VM_STATE();
+    JitStatus status = ((JitEntry)chunk->jitCode)(&vm, nativeEntry);
+    LOAD_VM_STATE();
+    sp = vm.sp;
+    switch (status) {
+      case JIT_RETURN:
+        goto doReturn;
+      case JIT_CALL:
+      case JIT_TAILCALL:
+        nArgs = vm.callArgs;
+        tailCall = status == JIT_TAILCALL;
+        resume = tailCall ? 0 : vm.resume;
+        goto callWithArgs;
+    }
+    Die("Invalid native code status: %d", status);
+  }
+
+  VM_CASE(OP_POP): {
+    sp--;
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_CLOSURE): {
+    Chunk* child = chunk->children[READ_OPERAND()];
+    SAVE_VM_STATE();
+    sp = VmClosure(&vm, sp, child);
+    LOAD_VM_STATE();
+    VM_DISPATCH();
+  }
+
+  VM_CASE(OP_RETURN):
+  doReturn: {
+    result = sp[-1];
+    if (callDepth == 0) {
+      goto done;
+    }
+    CallInfo* ci = &calls[--callDepth];
+    sp = ci->base;
+    *sp++ = result;
+    chunk = ci->chunk;
+    frame = ci->frame;
+    if (ci->resume) {
+      nativeEntry = ci->resume;
+      goto runNative;
+    }
+    ip = ci->ip;
+    constants = chunk->constants;
+    VM_DISPATCH();
+  }
+
+#ifndef VM_THREADED_DISPATCH
+  default:
+    Die("Invalid opcode: %d", ip[-1]);
+  }
+#endif
+
+done:
+  GcPopRootScanner();
+  if (spareStack) {
+    free(calls);
+    free(stack);
+  } else {
+    spareStack = stack;
+    spareCalls = calls;
+  }
+  return result;
+}